@@ -0,0 +1,281 @@
+/*
+ * Benchmark for the cache behaviour of the image buffers.
+ *
+ * Runs each filter's kernel on a generated image in an aligned image
+ * buffer, and on the same image packed the way the rows used to be (one
+ * row straight after another, from an unaligned address), then runs it
+ * through stream_chain, and last converts the image between the
+ * interleaved and planar layouts. Each prints its time, and the cache
+ * references, cache misses and L1 data cache read misses the hardware
+ * counters saw, or "n/a" where the kernel or the CPU (or a virtual
+ * machine) doesn't provide them.
+ *
+ * Usage: cache_bench [width] [height] [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../filters/bitmap.h"
+
+
+static const char *const filters[] = {
+    "copy", "greyscale", "luma", "threshold", "invert", "brightness", "contrast",
+    "gamma", "gaussian_blur", "edge_detection", "scale", "bilinear", "lanczos",
+};
+
+// The counters, each opened on its own (so one that's missing doesn't
+// take the others with it).
+#define NUM_COUNTERS 3
+
+static const struct {
+    const char *name;
+    unsigned type;
+    unsigned long long config;
+} counters[NUM_COUNTERS] = {
+    {"refs", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {"misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"L1d misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                       PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                       PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+};
+
+static int counter_fds[NUM_COUNTERS];
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void open_counters(void) {
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counters[c].type;
+        attr.config = counters[c].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.inherit = 1;
+        counter_fds[c] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    if (counter_fds[0] < 0) {
+        perror("No cache counters (perf_event_open)");
+    }
+}
+
+/*
+ * A measurement: the best time of a number of rounds, and the counts of
+ * the round it was.
+ */
+typedef struct {
+    double secs;
+    long long counts[NUM_COUNTERS];
+} Sample;
+
+static void start_counters(void) {
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+        if (counter_fds[c] >= 0) {
+            ioctl(counter_fds[c], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counter_fds[c], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+static void stop_counters(long long counts[NUM_COUNTERS]) {
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+        counts[c] = -1;
+        if (counter_fds[c] >= 0) {
+            ioctl(counter_fds[c], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(counter_fds[c], &counts[c], sizeof(counts[c])) != sizeof(counts[c])) {
+                counts[c] = -1;
+            }
+        }
+    }
+}
+
+static void keep_best(Sample *best, double start, const long long counts[NUM_COUNTERS]) {
+    double secs = now() - start;
+    if (best->secs == 0 || secs < best->secs) {
+        best->secs = secs;
+        memcpy(best->counts, counts, sizeof(best->counts));
+    }
+}
+
+static void print_sample(const char *name, const char *how, const Sample *sample,
+                         double mpix) {
+    printf("%-16s %-8s %8.2f ms %8.1f MPix/s", name, how, sample->secs * 1e3,
+           mpix / sample->secs);
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+        if (sample->counts[c] < 0) {
+            printf("  %s n/a", counters[c].name);
+        } else {
+            printf("  %s %.3f/px", counters[c].name, sample->counts[c] / (mpix * 1e6));
+        }
+    }
+    printf("\n");
+}
+
+
+/*
+ * Return a bitmap file of the given size with random pixels, storing its
+ * size in len.
+ */
+static unsigned char *make_bitmap(int width, int height, size_t *len) {
+    int header_size = 54, info_size = 40;
+    *len = header_size + BMP_ROW_SIZE(width) * height;
+    unsigned char *bmp = calloc(1, *len);
+    int file_size = *len;
+    short planes = 1, bits = 24;
+    memcpy(bmp, "BM", 2);
+    memcpy(bmp + BMP_FILE_SIZE_OFFSET, &file_size, 4);
+    memcpy(bmp + BMP_HEADER_SIZE_OFFSET, &header_size, 4);
+    memcpy(bmp + 14, &info_size, 4);
+    memcpy(bmp + BMP_WIDTH_OFFSET, &width, 4);
+    memcpy(bmp + BMP_HEIGHT_OFFSET, &height, 4);
+    memcpy(bmp + 26, &planes, 2);
+    memcpy(bmp + 28, &bits, 2);
+    srand(1);
+    for (size_t i = header_size; i < *len; i++) {
+        bmp[i] = rand();
+    }
+    return bmp;
+}
+
+// Count the output, without touching it (so only the chain is measured).
+static int count_output(void *arg, const void *data, size_t len) {
+    *(size_t *)arg += len;
+    return 0;
+}
+
+/*
+ * Describe the pixels at data as an image of packed rows, the way the
+ * kernels used to get them.
+ */
+static ImageBuf packed_image(unsigned char *data, int width, int height) {
+    ImageBuf image = {data, width, height, (size_t)width * sizeof(Pixel), IMAGE_INTERLEAVED};
+    return image;
+}
+
+static Sample time_kernel(filter_fn apply, const ImageBuf *in, ImageBuf *out, int rounds) {
+    Sample best = {0};
+    for (int r = 0; r < rounds; r++) {
+        long long counts[NUM_COUNTERS];
+        double start = now();
+        start_counters();
+        apply(in, out);
+        stop_counters(counts);
+        keep_best(&best, start, counts);
+    }
+    return best;
+}
+
+
+int main(int argc, char **argv) {
+    int width = argc > 1 ? atoi(argv[1]) : 1920;
+    int height = argc > 2 ? atoi(argv[2]) : 1080;
+    int rounds = argc > 3 ? atoi(argv[3]) : 5;
+    open_counters();
+
+    size_t len;
+    unsigned char *src = make_bitmap(width, height, &len);
+    double mpix = (double)width * height / 1e6;
+    ImageBuf in, planar;
+    if (image_alloc(&in, width, height, IMAGE_INTERLEAVED) < 0 ||
+            image_alloc(&planar, width, height, IMAGE_PLANAR) < 0) {
+        perror("Failed to allocate the images");
+        return 1;
+    }
+    BmpIO io;
+    bmp_open_memory(&io, src + 54, len - 54);
+    io.width = width;
+    bmp_read_image(&io, &in, 0, height);
+
+    // The packed copies start a byte into their allocations, so that no
+    // row is aligned.
+    size_t packed_size = (size_t)width * height * sizeof(Pixel);
+    unsigned char *packed_in = malloc(packed_size + 1);
+    unsigned char *packed_out = malloc(4 * packed_size + 1);
+    if (packed_in == NULL || packed_out == NULL) {
+        perror("Failed to allocate the images");
+        return 1;
+    }
+    ImageBuf packed = packed_image(packed_in + 1, width, height);
+    for (int i = 0; i < height; i++) {
+        memcpy(image_row(&packed, i), image_row(&in, i), width * sizeof(Pixel));
+    }
+    printf("filters on %dx%d, best of %d\n", width, height, rounds);
+
+    for (int f = 0; f < sizeof(filters) / sizeof(filters[0]); f++) {
+        ChainStep step = {find_filter(filters[f])};
+        step.scale = (Scale){step.filter->scale_factor, 1};
+        int out_width = scaled_size(width, step.scale);
+        int out_height = scaled_size(height, step.scale);
+        ImageBuf out;
+        if (image_alloc(&out, out_width, out_height, IMAGE_INTERLEAVED) < 0) {
+            perror("Failed to allocate the images");
+            return 1;
+        }
+        ImageBuf packed_result = packed_image(packed_out + 1, out_width, out_height);
+
+        Sample sample = time_kernel(step.filter->apply, &in, &out, rounds);
+        print_sample(filters[f], "aligned", &sample, mpix);
+        sample = time_kernel(step.filter->apply, &packed, &packed_result, rounds);
+        print_sample(filters[f], "packed", &sample, mpix);
+        for (int i = 0; i < out_height; i++) {
+            if (memcmp(image_row(&out, i), image_row(&packed_result, i),
+                       out_width * sizeof(Pixel)) != 0) {
+                fprintf(stderr, "%s: packed output differs\n", filters[f]);
+                return 1;
+            }
+        }
+
+        sample = (Sample){0};
+        for (int r = 0; r < rounds; r++) {
+            size_t out_len, total = 0;
+            long long counts[NUM_COUNTERS];
+            double start = now();
+            start_counters();
+            int result = stream_chain(&step, 1, src, len, &out_len, 1, count_output, &total);
+            stop_counters(counts);
+            if (result < 0 || total != out_len) {
+                return 1;
+            }
+            keep_best(&sample, start, counts);
+        }
+        print_sample(filters[f], "stream", &sample, mpix);
+        image_free(&out);
+    }
+
+    ImageBuf back;
+    if (image_alloc(&back, width, height, IMAGE_INTERLEAVED) < 0) {
+        perror("Failed to allocate the images");
+        return 1;
+    }
+    Sample sample = time_kernel(image_convert, &in, &planar, rounds);
+    print_sample("to planar", "", &sample, mpix);
+    sample = time_kernel(image_convert, &planar, &back, rounds);
+    print_sample("to interleaved", "", &sample, mpix);
+    for (int i = 0; i < height; i++) {
+        if (memcmp(image_row(&in, i), image_row(&back, i), width * sizeof(Pixel)) != 0) {
+            fprintf(stderr, "the layouts don't convert back\n");
+            return 1;
+        }
+    }
+
+    image_free(&in);
+    image_free(&planar);
+    image_free(&back);
+    free(packed_in);
+    free(packed_out);
+    free(src);
+    return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * Benchmark for filter chains.
+ *
+ * Runs two chains from the filters test target on a generated bitmap. One
+ * has three blurs, greyscale and a 2x scale; the other, seven blurs,
+ * greyscale and a 2x scale. Each runs four ways: as a process pipeline
+ * with image_filter (one process per filter), connected by pipes, and by
+ * shared-memory rings; as one apply_filter call per filter (each storing
+ * its whole output image); and as one fused pass with apply_chain. The
+ * outputs are checked against each other.
+ *
+ * Usage: chain_bench [width] [height] [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "../filters/bitmap.h"
+
+
+#define INPUT "/tmp/chain_bench_in.bmp"
+#define OUTPUT "/tmp/chain_bench_out.bmp"
+
+// A chain, and the image_filter arguments for it, with pipes (-p), which
+// are left out for rings; it runs in ../filters.
+typedef struct {
+    const char *chain;
+    char *const pipeline[14];
+} Bench;
+
+static const Bench benches[] = {
+    {"gaussian_blur,gaussian_blur,gaussian_blur,greyscale,scale:2",
+     {"./image_filter", "-p", INPUT, OUTPUT, "./gaussian_blur", "./gaussian_blur",
+      "./gaussian_blur", "./greyscale", "./scale 2", NULL}},
+    {"gaussian_blur,gaussian_blur,gaussian_blur,gaussian_blur,gaussian_blur,"
+     "gaussian_blur,gaussian_blur,greyscale,scale:2",
+     {"./image_filter", "-p", INPUT, OUTPUT, "./gaussian_blur", "./gaussian_blur",
+      "./gaussian_blur", "./gaussian_blur", "./gaussian_blur", "./gaussian_blur",
+      "./gaussian_blur", "./greyscale", "./scale 2", NULL}},
+};
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Return a bitmap file of the given size with random pixels, storing its
+ * size in len.
+ */
+static unsigned char *make_bitmap(int width, int height, size_t *len) {
+    int header_size = 54, info_size = 40;
+    *len = header_size + (size_t)width * height * sizeof(Pixel);
+    unsigned char *bmp = calloc(1, *len);
+    int file_size = *len;
+    short planes = 1, bits = 24;
+    memcpy(bmp, "BM", 2);
+    memcpy(bmp + BMP_FILE_SIZE_OFFSET, &file_size, 4);
+    memcpy(bmp + BMP_HEADER_SIZE_OFFSET, &header_size, 4);
+    memcpy(bmp + 14, &info_size, 4);
+    memcpy(bmp + BMP_WIDTH_OFFSET, &width, 4);
+    memcpy(bmp + BMP_HEIGHT_OFFSET, &height, 4);
+    memcpy(bmp + 26, &planes, 2);
+    memcpy(bmp + 28, &bits, 2);
+    srand(1);
+    for (size_t i = header_size; i < *len; i++) {
+        bmp[i] = rand();
+    }
+    return bmp;
+}
+
+static void check_same(const char *what, const unsigned char *a, size_t a_len,
+                       const unsigned char *b, size_t b_len) {
+    if (a_len != b_len || memcmp(a, b, a_len) != 0) {
+        fprintf(stderr, "%s: output differs\n", what);
+        exit(1);
+    }
+}
+
+// Run a pipeline with image_filter, and return the output file's contents.
+static unsigned char *run_pipeline(char *const *pipeline, size_t *len) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        if (chdir("../filters") < 0) {
+            perror("chdir");
+            exit(1);
+        }
+        execv(pipeline[0], pipeline);
+        perror("execv image_filter");
+        exit(1);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "image_filter failed\n");
+        exit(1);
+    }
+
+    FILE *f = fopen(OUTPUT, "r");
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    rewind(f);
+    unsigned char *out = malloc(*len);
+    if (fread(out, 1, *len, f) != *len) {
+        fprintf(stderr, "short read from %s\n", OUTPUT);
+        exit(1);
+    }
+    fclose(f);
+    return out;
+}
+
+// Run the chain one whole image at a time.
+static unsigned char *run_steps(const ChainStep *steps, int num_steps,
+                                const unsigned char *src, size_t len,
+                                size_t *out_len) {
+    unsigned char *image = NULL;
+    for (int s = 0; s < num_steps; s++) {
+        unsigned char *next = apply_filter(steps[s].filter, steps[s].scale,
+                                           image ? image : src, len, out_len);
+        free(image);
+        image = next;
+        len = *out_len;
+    }
+    return image;
+}
+
+
+int main(int argc, char **argv) {
+    int width = argc > 1 ? atoi(argv[1]) : 1920;
+    int height = argc > 2 ? atoi(argv[2]) : 1080;
+    int rounds = argc > 3 ? atoi(argv[3]) : 5;
+
+    size_t len;
+    unsigned char *src = make_bitmap(width, height, &len);
+    FILE *in = fopen(INPUT, "w");
+    fwrite(src, 1, len, in);
+    fclose(in);
+    double mpix = (double)width * height / 1e6;
+
+    for (int b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+        ChainStep steps[MAX_CHAIN];
+        int num_steps = parse_chain(benches[b].chain, steps);
+        char *const *pipes = benches[b].pipeline;
+        char *rings[14] = {pipes[0]};
+        memcpy(rings + 1, pipes + 2, sizeof(rings) - 2 * sizeof(rings[0]));
+
+        double best[4] = {0, 0, 0, 0};
+        for (int r = 0; r < rounds; r++) {
+            size_t out_len[4];
+            unsigned char *out[4];
+            double start = now();
+            out[0] = run_pipeline(pipes, &out_len[0]);
+            double t1 = now();
+            out[1] = run_pipeline(rings, &out_len[1]);
+            double t2 = now();
+            out[2] = run_steps(steps, num_steps, src, len, &out_len[2]);
+            double t3 = now();
+            out[3] = apply_chain(steps, num_steps, src, len, &out_len[3]);
+            double t4 = now();
+
+            double secs[4] = {t1 - start, t2 - t1, t3 - t2, t4 - t3};
+            for (int i = 0; i < 4; i++) {
+                if (best[i] == 0 || secs[i] < best[i]) {
+                    best[i] = secs[i];
+                }
+            }
+            check_same("rings", out[1], out_len[1], out[0], out_len[0]);
+            check_same("whole images", out[2], out_len[2], out[0], out_len[0]);
+            check_same("fused", out[3], out_len[3], out[0], out_len[0]);
+            for (int i = 0; i < 4; i++) {
+                free(out[i]);
+            }
+        }
+
+        printf("chain %s: %dx%d, best of %d\n", benches[b].chain, width, height, rounds);
+        printf("process pipeline, pipes          %8.1f ms %8.1f MPix/s\n",
+               best[0] * 1e3, mpix / best[0]);
+        printf("process pipeline, rings          %8.1f ms %8.1f MPix/s\n",
+               best[1] * 1e3, mpix / best[1]);
+        printf("one image per filter             %8.1f ms %8.1f MPix/s\n",
+               best[2] * 1e3, mpix / best[2]);
+        printf("fused row pass (apply_chain)     %8.1f ms %8.1f MPix/s\n",
+               best[3] * 1e3, mpix / best[3]);
+    }
+    unlink(INPUT);
+    unlink(OUTPUT);
+    free(src);
+    return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * Benchmark for reading and writing the rows of a bitmap file.
+ *
+ * Generates a bitmap with padded rows (an odd width), and copies its
+ * pixels from a file to /dev/null four ways: a pixel at a time with
+ * fread and fwrite, as the filters first did; as one whole image with
+ * fread and fwrite, as run_filter did before the row I/O layer (which
+ * leaves the padding in with the pixels); a row at a time with
+ * bmp_read_rows and bmp_write_rows; and with the copy filter's
+ * pipe_chain, which maps the file rather than reading it. The copies
+ * made with the row functions and with pipe_chain are checked against
+ * the generated file.
+ *
+ * Usage: io_bench [width] [height] [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../filters/bitmap.h"
+
+
+#define INPUT "/tmp/io_bench_in.bmp"
+#define OUTPUT "/tmp/io_bench_out.bmp"
+#define HEADER_SIZE 54
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Write a bitmap file of the given size with random pixels (and zeroed
+ * padding) to INPUT.
+ */
+static void make_bitmap(int width, int height) {
+    size_t stride = BMP_ROW_SIZE(width);
+    unsigned char header[HEADER_SIZE] = {'B', 'M'};
+    int file_size = HEADER_SIZE + stride * height, header_size = HEADER_SIZE;
+    int info_size = 40;
+    short planes = 1, bits = 24;
+    memcpy(header + BMP_FILE_SIZE_OFFSET, &file_size, 4);
+    memcpy(header + BMP_HEADER_SIZE_OFFSET, &header_size, 4);
+    memcpy(header + 14, &info_size, 4);
+    memcpy(header + BMP_WIDTH_OFFSET, &width, 4);
+    memcpy(header + BMP_HEIGHT_OFFSET, &height, 4);
+    memcpy(header + 26, &planes, 2);
+    memcpy(header + 28, &bits, 2);
+
+    FILE *f = fopen(INPUT, "w");
+    unsigned char *row = calloc(1, stride);
+    fwrite(header, 1, HEADER_SIZE, f);
+    srand(1);
+    for (int i = 0; i < height; i++) {
+        for (size_t j = 0; j < width * sizeof(Pixel); j++) {
+            row[j] = rand();
+        }
+        fwrite(row, 1, stride, f);
+    }
+    free(row);
+    fclose(f);
+}
+
+static void per_pixel(int width, int height) {
+    FILE *in = fopen(INPUT, "r"), *out = fopen("/dev/null", "w");
+    unsigned char header[HEADER_SIZE], padding[3];
+    size_t pad = BMP_ROW_SIZE(width) - width * sizeof(Pixel);
+    fread(header, 1, HEADER_SIZE, in);
+    fwrite(header, 1, HEADER_SIZE, out);
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            Pixel pixel;
+            fread(&pixel, sizeof(Pixel), 1, in);
+            fwrite(&pixel, sizeof(Pixel), 1, out);
+        }
+        fread(padding, 1, pad, in);
+        fwrite(padding, 1, pad, out);
+    }
+    fclose(in);
+    fclose(out);
+}
+
+static void whole_image(int width, int height) {
+    FILE *in = fopen(INPUT, "r"), *out = fopen("/dev/null", "w");
+    size_t len = HEADER_SIZE + BMP_ROW_SIZE(width) * height;
+    unsigned char *image = malloc(len);
+    if (fread(image, 1, len, in) != len) {
+        fprintf(stderr, "short read from %s\n", INPUT);
+        exit(1);
+    }
+    fwrite(image, 1, len, out);
+    free(image);
+    fclose(in);
+    fclose(out);
+}
+
+static void rows(int width, int height, const char *output) {
+    int in_fd = open(INPUT, O_RDONLY);
+    int out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    Pixel *pixels = malloc((size_t)width * height * sizeof(Pixel));
+    unsigned char header[HEADER_SIZE];
+    BmpIO in, out;
+    bmp_open_reader(&in, in_fd);
+    bmp_open_writer(&out, out_fd);
+    in.width = out.width = width;
+    if (bmp_read(&in, header, HEADER_SIZE) < 0 || bmp_read_rows(&in, pixels, height) < 0 ||
+            bmp_write(&out, header, HEADER_SIZE) < 0 ||
+            bmp_write_rows(&out, pixels, height) < 0 || bmp_flush(&out) < 0) {
+        exit(1);
+    }
+    bmp_close(&in);
+    bmp_close(&out);
+    free(pixels);
+    close(in_fd);
+    close(out_fd);
+}
+
+static void mapped(const char *output) {
+    int in_fd = open(INPUT, O_RDONLY);
+    int out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ChainStep step = {find_filter("copy"), {1, 1}};
+    if (pipe_chain(&step, 1, in_fd, out_fd, 1) < 0) {
+        exit(1);
+    }
+    close(in_fd);
+    close(out_fd);
+}
+
+static void check_copy(void) {
+    FILE *a = fopen(INPUT, "r"), *b = fopen(OUTPUT, "r");
+    int ca, cb;
+    do {
+        ca = getc(a);
+        cb = getc(b);
+    } while (ca == cb && ca != EOF);
+    if (ca != cb) {
+        fprintf(stderr, "copy differs\n");
+        exit(1);
+    }
+    fclose(a);
+    fclose(b);
+}
+
+
+int main(int argc, char **argv) {
+    int width = argc > 1 ? atoi(argv[1]) : 4001;
+    int height = argc > 2 ? atoi(argv[2]) : 3001;
+    int rounds = argc > 3 ? atoi(argv[3]) : 5;
+
+    make_bitmap(width, height);
+    rows(width, height, OUTPUT);
+    check_copy();
+    mapped(OUTPUT);
+    check_copy();
+
+    double best[4] = {0, 0, 0, 0};
+    for (int r = 0; r < rounds; r++) {
+        double start = now();
+        per_pixel(width, height);
+        double t1 = now();
+        whole_image(width, height);
+        double t2 = now();
+        rows(width, height, "/dev/null");
+        double t3 = now();
+        mapped("/dev/null");
+        double t4 = now();
+
+        double secs[4] = {t1 - start, t2 - t1, t3 - t2, t4 - t3};
+        for (int i = 0; i < 4; i++) {
+            if (best[i] == 0 || secs[i] < best[i]) {
+                best[i] = secs[i];
+            }
+        }
+    }
+    unlink(INPUT);
+    unlink(OUTPUT);
+
+    double mb = (HEADER_SIZE + BMP_ROW_SIZE(width) * height) / 1e6;
+    printf("copy a %dx%d bitmap (%.1f MB) to /dev/null, best of %d\n",
+           width, height, mb, rounds);
+    printf("a pixel at a time (stdio)     %8.1f ms %8.1f MB/s\n",
+           best[0] * 1e3, mb / best[0]);
+    printf("whole image (stdio)           %8.1f ms %8.1f MB/s\n",
+           best[1] * 1e3, mb / best[1]);
+    printf("rows (bmp_read/write_rows)    %8.1f ms %8.1f MB/s\n",
+           best[2] * 1e3, mb / best[2]);
+    printf("mapped (pipe_chain)           %8.1f ms %8.1f MB/s\n",
+           best[3] * 1e3, mb / best[3]);
+    return 0;
+}
@@ -0,0 +1,225 @@
+/*
+ * Benchmark for the filter kernels.
+ *
+ * Runs each filter's kernel over random pixels at every SIMD level the
+ * CPU has, next to the kernel the filter used before it was vectorized
+ * (or its scalar version, for the filters that are newer than that), and
+ * checks that they all give the same output. Then runs the resampling
+ * filters at a few scale factors, with the integer-only nearest-neighbour
+ * kernel scale had before next to its replacement.
+ *
+ * Usage: kernel_bench [width] [height] [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../filters/bitmap.h"
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The kernels as they were: a 3-by-3 window copied out for every pixel
+ * and passed to the per-pixel function.
+ */
+static void window_row(const Pixel *in[3], Pixel *out, int width,
+                       Pixel (*kernel)(Pixel *, Pixel *, Pixel *)) {
+    out[0] = in[1][1];
+    for (int j = 1; j < width - 1; j++) {
+        Pixel window[3][3];
+        for (int y = 0; y < 3; y++) {
+            memcpy(window[y], in[y] + j - 1, sizeof(window[0]));
+        }
+        out[j] = kernel(window[0], window[1], window[2]);
+    }
+    out[width - 1] = in[1][width - 2];
+}
+
+static void old_gaussian_blur_row(const Pixel *in[3], Pixel *out, int width) {
+    window_row(in, out, width, apply_gaussian_kernel);
+}
+
+static void old_gaussian_blur(const ImageBuf *in, ImageBuf *out) {
+    apply_stencil(in, out, old_gaussian_blur_row);
+}
+
+static void old_greyscale_row(const Pixel *in[3], Pixel *out, int width) {
+    const Pixel *row = in[1];
+    for (int i = 0; i < width; i++) {
+        Pixel pixel = row[i];
+        unsigned char average = (pixel.red + pixel.green + pixel.blue) / 3;
+        pixel.red = pixel.green = pixel.blue = average;
+        out[i] = pixel;
+    }
+}
+
+static void old_greyscale(const ImageBuf *in, ImageBuf *out) {
+    apply_point(in, out, old_greyscale_row);
+}
+
+static void old_edge_detection_row(const Pixel *in[3], Pixel *out, int width) {
+    window_row(in, out, width, apply_edge_detection_kernel);
+}
+
+static void old_edge_detection(const ImageBuf *in, ImageBuf *out) {
+    apply_stencil(in, out, old_edge_detection_row);
+}
+
+// The scale kernel as it was: a division for every output pixel.
+static void old_scale(const ImageBuf *in, ImageBuf *out) {
+    int factor = out->width / in->width;
+    for (int i = 0; i < out->height; i++) {
+        const Pixel *original = image_row(in, i / factor);
+        Pixel *row = image_row(out, i);
+        for (int j = 0; j < out->width; j++) {
+            row[j] = original[j / factor];
+        }
+    }
+}
+
+// A filter, and the kernel it had before, if any (else the scalar one
+// is the reference).
+typedef struct {
+    const char *name;
+    filter_fn old;
+} Bench;
+
+static const Bench benches[] = {
+    {"greyscale", old_greyscale},
+    {"luma", NULL},
+    {"threshold", NULL},
+    {"invert", NULL},
+    {"contrast", NULL},
+    {"gamma", NULL},
+    {"gaussian_blur", old_gaussian_blur},
+    {"edge_detection", old_edge_detection},
+};
+
+// A resampling filter, the scale factor to run it at, and the kernel it
+// had before, if any.
+typedef struct {
+    const char *name;
+    Scale scale;
+    filter_fn old;
+} ScaleBench;
+
+static const ScaleBench scale_benches[] = {
+    {"scale", {2, 1}, old_scale},
+    {"scale", {1, 4}, NULL},
+    {"bilinear", {1, 4}, NULL},
+    {"lanczos", {1, 4}, NULL},
+    {"bilinear", {3, 2}, NULL},
+    {"lanczos", {3, 2}, NULL},
+};
+
+static const char *const level_names[] = {"scalar", "sse2", "ssse3", "avx2"};
+
+
+static double time_filter(filter_fn apply, const ImageBuf *in, ImageBuf *out, int rounds) {
+    double best = 0;
+    for (int r = 0; r < rounds; r++) {
+        double start = now();
+        apply(in, out);
+        double secs = now() - start;
+        if (best == 0 || secs < best) {
+            best = secs;
+        }
+    }
+    return best;
+}
+
+// Whether two images of the same size have the same pixels.
+static int same_image(const ImageBuf *a, const ImageBuf *b) {
+    for (int i = 0; i < a->height; i++) {
+        if (memcmp(image_row(a, i), image_row(b, i), a->width * sizeof(Pixel)) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+int main(int argc, char **argv) {
+    int width = argc > 1 ? atoi(argv[1]) : 1920;
+    int height = argc > 2 ? atoi(argv[2]) : 1080;
+    int rounds = argc > 3 ? atoi(argv[3]) : 5;
+
+    ImageBuf in, expected, out;
+    if (image_alloc(&in, width, height, IMAGE_INTERLEAVED) < 0 ||
+            image_alloc(&expected, width, height, IMAGE_INTERLEAVED) < 0 ||
+            image_alloc(&out, width, height, IMAGE_INTERLEAVED) < 0) {
+        perror("Failed to allocate the images");
+        return 1;
+    }
+    srand(1);
+    for (size_t i = 0; i < in.stride * height; i++) {
+        in.data[i] = rand();
+    }
+    double mpix = (double)width * height / 1e6;
+    enum simd_level best_level = simd_level;
+    printf("filter kernels on %dx%d, best of %d\n", width, height, rounds);
+
+    for (int b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+        const Filter *filter = find_filter(benches[b].name);
+        filter_fn old = benches[b].old;
+        if (old == NULL) {
+            old = filter->apply;
+            simd_level = SIMD_NONE;
+        }
+        double secs = time_filter(old, &in, &expected, rounds);
+        printf("%-16s %-8s %8.2f ms %8.1f MPix/s\n", filter->name,
+               benches[b].old != NULL ? "before" : "scalar", secs * 1e3, mpix / secs);
+
+        for (enum simd_level level = benches[b].old != NULL ? SIMD_NONE : SIMD_SSE2;
+                level <= best_level; level++) {
+            simd_level = level;
+            secs = time_filter(filter->apply, &in, &out, rounds);
+            printf("%-16s %-8s %8.2f ms %8.1f MPix/s\n", filter->name, level_names[level],
+                   secs * 1e3, mpix / secs);
+            if (!same_image(&out, &expected)) {
+                fprintf(stderr, "%s: %s output differs\n", filter->name, level_names[level]);
+                return 1;
+            }
+        }
+        simd_level = best_level;
+    }
+
+    // The resampling filters, timed by the pixels they read.
+    for (int b = 0; b < sizeof(scale_benches) / sizeof(scale_benches[0]); b++) {
+        const ScaleBench *bench = &scale_benches[b];
+        int out_width = scaled_size(width, bench->scale);
+        int out_height = scaled_size(height, bench->scale);
+        ImageBuf scaled_out, scaled_expected;
+        if (image_alloc(&scaled_out, out_width, out_height, IMAGE_INTERLEAVED) < 0 ||
+                image_alloc(&scaled_expected, out_width, out_height, IMAGE_INTERLEAVED) < 0) {
+            perror("Failed to allocate the images");
+            return 1;
+        }
+        char name[32];
+        ChainStep step = {find_filter(bench->name), bench->scale};
+        format_chain(&step, 1, name, sizeof(name));
+        if (bench->old != NULL) {
+            double secs = time_filter(bench->old, &in, &scaled_expected, rounds);
+            printf("%-16s %-8s %8.2f ms %8.1f MPix/s\n", name, "before", secs * 1e3,
+                   mpix / secs);
+        }
+        double secs = time_filter(step.filter->apply, &in, &scaled_out, rounds);
+        printf("%-16s %-8s %8.2f ms %8.1f MPix/s\n", name, "", secs * 1e3, mpix / secs);
+        if (bench->old != NULL && !same_image(&scaled_out, &scaled_expected)) {
+            fprintf(stderr, "%s: output differs\n", name);
+            return 1;
+        }
+        image_free(&scaled_out);
+        image_free(&scaled_expected);
+    }
+    image_free(&in);
+    image_free(&expected);
+    image_free(&out);
+    return 0;
+}
@@ -0,0 +1,234 @@
+/*
+ * Microbenchmark for the HTTP request-head parser.
+ *
+ * Parses a typical browser request (start line, query string and a dozen
+ * headers) over and over with parse_request, and with a copy of the
+ * previous parser (strtok on a copy of each line, strdup'd fields, one
+ * memmove per line), and reports requests/s and MB/s for both. Each case
+ * runs twice: with the whole head buffered at once, and with it arriving
+ * in small reads, as it does from a slow client.
+ *
+ * Usage: parse_bench [iterations] [bytes per read]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "../request.h"
+
+
+static const char REQUEST[] =
+    "GET /image-filter?filter=gaussian_blur&image=dog.bmp HTTP/1.1\r\n"
+    "Host: localhost:58611\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) "
+    "Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://localhost:58611/main.html\r\n"
+    "DNT: 1\r\n"
+    "Connection: keep-alive\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+
+/******************************************************************************
+ * The previous parser, kept here for comparison.
+ *****************************************************************************/
+
+typedef struct {
+    char buf[MAXLINE];
+    int num_bytes;
+    ReqData *reqData;
+    int keep_alive;
+} LegacyClient;
+
+static int legacy_find_network_newline(const char *buf, int n) {
+    for (int i = 0; i < n - 1; i++) {
+        if (buf[i] == '\r' && buf[i + 1] == '\n') {
+            return i + 2;
+        }
+    }
+    return -1;
+}
+
+static void legacy_remove_buffered_line(LegacyClient *client) {
+    int newline = legacy_find_network_newline(client->buf, client->num_bytes);
+    if (newline > 0) {
+        memmove(client->buf, client->buf + newline, client->num_bytes - newline);
+        client->num_bytes -= newline;
+    }
+}
+
+static void legacy_parse_query(ReqData *req, char *str) {
+    char *token = strtok(str, "&");
+    int index = 0;
+    while (token != NULL && index < MAX_QUERY_PARAMS) {
+        char *value = strchr(token, '=');
+        if (value) {
+            *value++ = '\0';
+            req->params[index].name = strdup(token);
+            req->params[index].value = strdup(value);
+        }
+        index++;
+        token = strtok(NULL, "&");
+    }
+}
+
+static int legacy_parse_req_start_line(LegacyClient *client) {
+    int newline = legacy_find_network_newline(client->buf, client->num_bytes);
+    if (newline < 0) {
+        return 0;
+    }
+
+    char line[newline + 1];
+    strncpy(line, client->buf, newline);
+    line[newline] = '\0';
+
+    char *method = strtok(line, " ");
+    char *path = strtok(NULL, " ");
+    char *version = strtok(NULL, " \r\n");
+    client->keep_alive = version != NULL && strcmp(version, "HTTP/1.1") == 0;
+    if (method == NULL || path == NULL) {
+        return 0;
+    }
+
+    ReqData *req = calloc(1, sizeof(ReqData));
+    req->method = strdup(method);
+    char *query = strchr(path, '?');
+    if (query) {
+        *query++ = '\0';
+        legacy_parse_query(req, query);
+    }
+    req->path = strdup(path);
+    client->reqData = req;
+
+    legacy_remove_buffered_line(client);
+    return 1;
+}
+
+// Return 1 once the empty line is consumed, 0 if more data is needed.
+static int legacy_skip_headers(LegacyClient *client) {
+    while (1) {
+        int where = legacy_find_network_newline(client->buf, client->num_bytes);
+        if (where == 2) {
+            legacy_remove_buffered_line(client);
+            return 1;
+        } else if (where < 0) {
+            return 0;
+        }
+        if (strncasecmp(client->buf, "Connection:", 11) == 0) {
+            client->keep_alive = strncasecmp(client->buf + 12, "close", 5) != 0;
+        }
+        legacy_remove_buffered_line(client);
+    }
+}
+
+static void legacy_free(LegacyClient *client) {
+    ReqData *req = client->reqData;
+    free(req->method);
+    free(req->path);
+    for (int i = 0; i < MAX_QUERY_PARAMS; i++) {
+        free(req->params[i].name);
+        free(req->params[i].value);
+    }
+    free(req);
+    client->reqData = NULL;
+}
+
+
+/******************************************************************************
+ * Timing
+ *****************************************************************************/
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, int iterations, double secs) {
+    double bytes = (double)iterations * (sizeof(REQUEST) - 1);
+    printf("%-28s %10.0f req/s %9.1f MB/s\n",
+           name, iterations / secs, bytes / secs / 1e6);
+}
+
+// Feed the request in reads of chunk bytes, parsing after each read.
+static void bench_incremental(int iterations, int chunk) {
+    static ClientState client;
+    int len = sizeof(REQUEST) - 1;
+    client.sock = -1;
+    client.num_bytes = client.pos = client.scan = 0;
+    clear_request(&client);
+    reserve_buffer(&client, MAXLINE);
+
+    double start = now();
+    for (int it = 0; it < iterations; it++) {
+        int done = 0;
+        for (int off = 0; off < len && !done; off += chunk) {
+            int n = off + chunk <= len ? chunk : len - off;
+            memcpy(client.buf + client.num_bytes, REQUEST + off, n);
+            client.num_bytes += n;
+            client.buf[client.num_bytes] = '\0';
+            done = parse_request(&client);
+        }
+        if (done != 1 || client.keep_alive != 1 ||
+                strcmp(get_known_header(client.reqData, HDR_HOST), "localhost:58611")) {
+            fprintf(stderr, "parse_request failed\n");
+            exit(1);
+        }
+        clear_request(&client);
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "incremental (%d B reads)", chunk);
+    report(name, iterations, now() - start);
+}
+
+static void bench_legacy(int iterations, int chunk) {
+    static LegacyClient client;
+    int len = sizeof(REQUEST) - 1;
+
+    double start = now();
+    for (int it = 0; it < iterations; it++) {
+        client.num_bytes = 0;
+        client.reqData = NULL;
+        int done = 0;
+        for (int off = 0; off < len && !done; off += chunk) {
+            int n = off + chunk <= len ? chunk : len - off;
+            memcpy(client.buf + client.num_bytes, REQUEST + off, n);
+            client.num_bytes += n;
+            client.buf[client.num_bytes] = '\0';
+            if (client.reqData == NULL && !legacy_parse_req_start_line(&client)) {
+                continue;
+            }
+            done = legacy_skip_headers(&client);
+        }
+        if (!done || client.keep_alive != 1) {
+            fprintf(stderr, "legacy parser failed\n");
+            exit(1);
+        }
+        legacy_free(&client);
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "legacy (%d B reads)", chunk);
+    report(name, iterations, now() - start);
+}
+
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+    int chunk = argc > 2 ? atoi(argv[2]) : 16;
+    int whole = sizeof(REQUEST) - 1;
+
+    printf("request head: %d bytes, %d iterations\n", whole, iterations);
+    bench_legacy(iterations, whole);
+    bench_incremental(iterations, whole);
+    bench_legacy(iterations / 4, chunk);
+    bench_incremental(iterations / 4, chunk);
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * Benchmark for chain planning.
+ *
+ * Plans each chain below (the ones from the filters test target, and
+ * some that only the rules with a tolerance rewrite) with tolerances 0
+ * and 2, and runs the chain and its plan on a generated bitmap with
+ * stream_chain on one thread, passing the output to a function that only
+ * counts it. Prints the estimated (chain_cost) and measured time of each,
+ * and the largest difference between a channel of their outputs (from a
+ * run that stores them), which must be no more than the plan says.
+ *
+ * Usage: plan_bench [width] [height] [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../filters/bitmap.h"
+
+
+static const char *const chains[] = {
+    "gaussian_blur,gaussian_blur,gaussian_blur,greyscale,scale:2",
+    "gaussian_blur,gaussian_blur,gaussian_blur,scale:2,greyscale,scale:2,gaussian_blur",
+    "gaussian_blur,gaussian_blur,gaussian_blur,gaussian_blur,gaussian_blur,gaussian_blur,"
+    "gaussian_blur,greyscale,scale:2",
+    "copy,greyscale,greyscale,invert,invert,scale:2,threshold,scale:2",
+    "luma,gaussian_blur,greyscale,scale:1/4",
+    "bilinear:2,greyscale,invert",
+};
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Return a bitmap file of the given size with smooth, noisy pixels (so
+ * rounding shows), storing its size in len.
+ */
+static unsigned char *make_bitmap(int width, int height, size_t *len) {
+    int header_size = 54, info_size = 40;
+    *len = header_size + BMP_ROW_SIZE(width) * height;
+    unsigned char *bmp = calloc(1, *len);
+    int file_size = *len;
+    short planes = 1, bits = 24;
+    memcpy(bmp, "BM", 2);
+    memcpy(bmp + BMP_FILE_SIZE_OFFSET, &file_size, 4);
+    memcpy(bmp + BMP_HEADER_SIZE_OFFSET, &header_size, 4);
+    memcpy(bmp + 14, &info_size, 4);
+    memcpy(bmp + BMP_WIDTH_OFFSET, &width, 4);
+    memcpy(bmp + BMP_HEIGHT_OFFSET, &height, 4);
+    memcpy(bmp + 26, &planes, 2);
+    memcpy(bmp + 28, &bits, 2);
+    srand(1);
+    for (int y = 0; y < height; y++) {
+        unsigned char *row = bmp + header_size + BMP_ROW_SIZE(width) * y;
+        for (int x = 0; x < width * 3; x++) {
+            row[x] = x / 3 + y * (x % 3 + 1) + rand() % 16;
+        }
+    }
+    return bmp;
+}
+
+// The output of a chain: a buffer of the whole result.
+typedef struct {
+    unsigned char *data;
+    size_t len;
+} Output;
+
+static int store_output(void *arg, const void *data, size_t len) {
+    Output *out = arg;
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    return 0;
+}
+
+static int count_output(void *arg, const void *data, size_t len) {
+    ((Output *)arg)->len += len;
+    return 0;
+}
+
+/*
+ * Run a chain rounds times, counting its output, and then once more,
+ * storing it in out. Return the best time of the counted runs.
+ */
+static double run(const ChainStep *steps, int num_steps, const unsigned char *src,
+                  size_t len, Output *out, int rounds) {
+    double best = 0;
+    size_t out_len;
+    for (int r = 0; r <= rounds; r++) {
+        out->len = 0;
+        double start = now();
+        if (stream_chain(steps, num_steps, src, len, &out_len, 1,
+                         r < rounds ? count_output : store_output, out) < 0) {
+            fprintf(stderr, "the chain failed\n");
+            exit(1);
+        }
+        double secs = now() - start;
+        if (r < rounds && (best == 0 || secs < best)) {
+            best = secs;
+        }
+    }
+    return best;
+}
+
+
+int main(int argc, char **argv) {
+    int width = argc > 1 ? atoi(argv[1]) : 1920;
+    int height = argc > 2 ? atoi(argv[2]) : 1080;
+    int rounds = argc > 3 ? atoi(argv[3]) : 5;
+
+    size_t len;
+    unsigned char *src = make_bitmap(width, height, &len);
+    // No chain below enlarges the image more than 4 times each way.
+    size_t max_len = 54 + BMP_ROW_SIZE(4 * width) * 4 * height;
+    Output chain_out = {malloc(max_len)}, plan_out = {malloc(max_len)};
+    if (chain_out.data == NULL || plan_out.data == NULL) {
+        perror("Failed to allocate the images");
+        return 1;
+    }
+    printf("chains on %dx%d, best of %d\n", width, height, rounds);
+
+    for (int c = 0; c < sizeof(chains) / sizeof(chains[0]); c++) {
+        ChainStep steps[MAX_CHAIN];
+        int num_steps = parse_chain(chains[c], steps);
+        double secs = run(steps, num_steps, src, len, &chain_out, rounds);
+        printf("%s\n  chain              estimated %8.2f ms  measured %8.2f ms\n", chains[c],
+               chain_cost(steps, num_steps, width, height) * 1e3, secs * 1e3);
+
+        for (int tolerance = 0; tolerance <= 2; tolerance += 2) {
+            Plan plan;
+            plan_chain(steps, num_steps, tolerance, &plan);
+            secs = run(plan.steps, plan.num_steps, src, len, &plan_out, rounds);
+            int error = 0;
+            if (plan_out.len != chain_out.len) {
+                fprintf(stderr, "%s: the plan's output is a different size\n", chains[c]);
+                return 1;
+            }
+            for (size_t i = 0; i < chain_out.len; i++) {
+                error = max(error, abs(chain_out.data[i] - plan_out.data[i]));
+            }
+            printf("  plan, tolerance %d estimated %8.2f ms  measured %8.2f ms  "
+                   "error %d (at most %d)\n", tolerance,
+                   chain_cost(plan.steps, plan.num_steps, width, height) * 1e3, secs * 1e3,
+                   error, plan.error);
+            if (error > plan.error) {
+                fprintf(stderr, "%s: the plan's output differs by too much\n", chains[c]);
+                return 1;
+            }
+        }
+    }
+    free(chain_out.data);
+    free(plan_out.data);
+    free(src);
+    return 0;
+}
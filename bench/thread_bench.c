@@ -0,0 +1,116 @@
+/*
+ * Benchmark for band-parallel filters.
+ *
+ * Runs each filter on a generated bitmap with stream_chain on 1 to N
+ * threads, and prints the time each takes and its speedup over one
+ * thread. The result is passed to a function that only checksums it, and
+ * each is checked against the one-thread result.
+ *
+ * Usage: thread_bench [width] [height] [max threads] [rounds]
+ * (by default, as many threads as there are cores)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../filters/bitmap.h"
+
+
+static const char *const filters[] = {
+    "copy", "greyscale", "luma", "threshold", "invert", "brightness", "contrast",
+    "gamma", "gaussian_blur", "edge_detection", "scale", "bilinear", "lanczos",
+};
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Return a bitmap file of the given size with random pixels, storing its
+ * size in len.
+ */
+static unsigned char *make_bitmap(int width, int height, size_t *len) {
+    int header_size = 54, info_size = 40;
+    *len = header_size + BMP_ROW_SIZE(width) * height;
+    unsigned char *bmp = calloc(1, *len);
+    int file_size = *len;
+    short planes = 1, bits = 24;
+    memcpy(bmp, "BM", 2);
+    memcpy(bmp + BMP_FILE_SIZE_OFFSET, &file_size, 4);
+    memcpy(bmp + BMP_HEADER_SIZE_OFFSET, &header_size, 4);
+    memcpy(bmp + 14, &info_size, 4);
+    memcpy(bmp + BMP_WIDTH_OFFSET, &width, 4);
+    memcpy(bmp + BMP_HEIGHT_OFFSET, &height, 4);
+    memcpy(bmp + 26, &planes, 2);
+    memcpy(bmp + 28, &bits, 2);
+    srand(1);
+    for (size_t i = header_size; i < *len; i++) {
+        bmp[i] = rand();
+    }
+    return bmp;
+}
+
+// Add the output to a checksum.
+static int add_output(void *arg, const void *data, size_t len) {
+    unsigned long *sum = arg;
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        *sum = *sum * 31 + bytes[i];
+    }
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+    int width = argc > 1 ? atoi(argv[1]) : 4000;
+    int height = argc > 2 ? atoi(argv[2]) : 3000;
+    int max_threads = argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    int rounds = argc > 4 ? atoi(argv[4]) : 3;
+    max_threads = max(1, min(max_threads, MAX_FILTER_THREADS));
+
+    size_t len;
+    unsigned char *src = make_bitmap(width, height, &len);
+    double mpix = (double)width * height / 1e6;
+    printf("filters on %dx%d, 1 to %d threads, best of %d\n",
+           width, height, max_threads, rounds);
+
+    for (int f = 0; f < sizeof(filters) / sizeof(filters[0]); f++) {
+        ChainStep step = {find_filter(filters[f])};
+        step.scale = (Scale){step.filter->scale_factor, 1};
+        double one = 0;
+        unsigned long expected = 0;
+        for (int threads = 1; threads <= max_threads; threads++) {
+            double best = 0;
+            for (int r = 0; r < rounds; r++) {
+                unsigned long sum = 0;
+                size_t out_len;
+                double start = now();
+                if (stream_chain(&step, 1, src, len, &out_len, threads, add_output, &sum) < 0) {
+                    return 1;
+                }
+                double secs = now() - start;
+                if (best == 0 || secs < best) {
+                    best = secs;
+                }
+                if (threads == 1) {
+                    expected = sum;
+                } else if (sum != expected) {
+                    fprintf(stderr, "%s: output differs on %d threads\n", filters[f], threads);
+                    return 1;
+                }
+            }
+            if (threads == 1) {
+                one = best;
+            }
+            printf("%-16s %2d threads %8.1f ms %8.1f MPix/s %5.2fx\n", filters[f], threads,
+                   best * 1e3, mpix / best, one / best);
+        }
+    }
+    free(src);
+    return 0;
+}
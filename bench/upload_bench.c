@@ -0,0 +1,256 @@
+/*
+ * Benchmark for multipart upload ingest (save_file_upload).
+ *
+ * Builds a multipart body around a file of random bytes, stores it in a
+ * temporary file, and has save_file_upload read it from there (read() and
+ * splice() work the same on a file as on a socket) and write the part to
+ * a second temporary file, which is checked against the original. The
+ * previous byte-at-a-time matcher with 1 KiB reads is timed on the same
+ * body. The data is saved twice: once without a bitmap header, so it is
+ * searched for the delimiter, and once with one, so it is spliced.
+ *
+ * Before that, bitmaps whose header gives the wrong size, and ones sent
+ * without a Content-Length, are saved once each and checked the same way,
+ * and a body with another part after the file must be rejected.
+ *
+ * Usage: upload_bench [MiB] [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../request.h"
+
+
+#define BOUNDARY "----WebKitFormBoundary7MA4YWxkTrZu0gW"
+
+
+/*
+ * The previous matcher, kept here for comparison: it compares one byte
+ * at a time against "\r\n<boundary>--\r\n" and starts over on a mismatch.
+ */
+static int legacy_save_file_upload(int sock, const char *boundary, int file_fd) {
+    char end_boundary[strlen(boundary) + 7];
+    sprintf(end_boundary, "\r\n%s--\r\n", boundary);
+    size_t end_boundary_len = strlen(end_boundary);
+    size_t end_boundary_found = 0;
+    char buffer[MAXLINE];
+
+    while (1) {
+        ssize_t read_bytes = read(sock, buffer, sizeof(buffer));
+        if (read_bytes <= 0) {
+            return -1;
+        }
+        size_t i;
+        for (i = 0; i < read_bytes; i++) {
+            if (buffer[i] == end_boundary[end_boundary_found]) {
+                end_boundary_found++;
+                if (end_boundary_found == end_boundary_len) {
+                    break;
+                }
+            } else {
+                end_boundary_found = 0;
+            }
+        }
+        if (end_boundary_found == end_boundary_len) {
+            ssize_t write_bytes = i + 1 - end_boundary_found;
+            if (write_bytes > 0 && write(file_fd, buffer, write_bytes) < 0) {
+                return -1;
+            }
+            return 0;
+        }
+        if (write(file_fd, buffer, read_bytes) < 0) {
+            return -1;
+        }
+    }
+}
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static FILE *temp_file(void) {
+    FILE *f = tmpfile();
+    if (f == NULL) {
+        perror("tmpfile");
+        exit(1);
+    }
+    return f;
+}
+
+
+/*
+ * Write a multipart body around data to a temporary file and return its fd.
+ * The file data starts at offset *data_start, and the body is *body_size
+ * bytes long. If next_part isn't NULL, a part with those headers and
+ * value follows the file.
+ */
+static int make_body(const char *data, long size, const char *next_part,
+                     long *data_start, long *body_size) {
+    FILE *body = temp_file();
+    fprintf(body, "Content-Type: image/bmp\r\n\r\n");
+    *data_start = ftell(body);
+    fwrite(data, 1, size, body);
+    if (next_part != NULL) {
+        fprintf(body, "\r\n--%s\r\n%s", BOUNDARY, next_part);
+    }
+    fprintf(body, "\r\n--%s--\r\n", BOUNDARY);
+    fflush(body);
+    *body_size = ftell(body);
+    return fileno(body);
+}
+
+/*
+ * Store the bitmap file size in the header of data.
+ */
+static void set_bitmap_size(char *data, long size) {
+    data[0] = 'B';
+    data[1] = 'M';
+    data[2] = size;
+    data[3] = size >> 8;
+    data[4] = size >> 16;
+    data[5] = size >> 24;
+}
+
+/*
+ * Return a client that reads the body in body_fd, sent with the given
+ * Content-Length (-1 for none).
+ */
+static ClientState *upload_client(int body_fd, long content_length) {
+    static ClientState client;
+    client.sock = body_fd;
+    client.pos = client.scan = client.num_bytes = 0;
+    clear_request(&client);
+    reserve_buffer(&client, MAXLINE);
+    client.reqData = &client.req;
+    client.req.content_length = content_length;
+    return &client;
+}
+
+/*
+ * Check that save_file_upload rejects the body in body_fd.
+ */
+static void check_rejected(int body_fd, long content_length) {
+    ClientState *client = upload_client(body_fd, content_length);
+    FILE *out = temp_file();
+    lseek(body_fd, 0, SEEK_SET);
+    if (save_file_upload(client, "--" BOUNDARY, fileno(out)) == 0) {
+        fprintf(stderr, "save_file_upload accepted a second part\n");
+        exit(1);
+    }
+    fclose(out);
+}
+
+/*
+ * Time save_file_upload on the body in body_fd, sent with the given
+ * Content-Length (-1 for none), and check what it saved. Return the best
+ * time of the given number of rounds.
+ */
+static double time_upload(int body_fd, long content_length, const char *data, long size,
+                          int rounds) {
+    ClientState *client = upload_client(body_fd, content_length);
+
+    double best = 0;
+    for (int r = 0; r < rounds; r++) {
+        FILE *out = temp_file();
+        lseek(body_fd, 0, SEEK_SET);
+        client->pos = client->scan = client->num_bytes = 0;
+        double start = now();
+        if (save_file_upload(client, "--" BOUNDARY, fileno(out)) < 0) {
+            fprintf(stderr, "save_file_upload failed\n");
+            exit(1);
+        }
+        double secs = now() - start;
+        if (best == 0 || secs < best) {
+            best = secs;
+        }
+
+        // Check the saved part.
+        if (lseek(fileno(out), 0, SEEK_END) != size) {
+            fprintf(stderr, "saved %ld bytes, expected %ld\n",
+                    (long)lseek(fileno(out), 0, SEEK_END), size);
+            exit(1);
+        }
+        char *saved = malloc(size);
+        if (pread(fileno(out), saved, size, 0) != size ||
+                memcmp(saved, data, size) != 0) {
+            fprintf(stderr, "saved data differs\n");
+            exit(1);
+        }
+        free(saved);
+        fclose(out);
+    }
+    return best;
+}
+
+
+int main(int argc, char **argv) {
+    long size = (argc > 1 ? atol(argv[1]) : 32) * 1024 * 1024;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+
+    // Random data, with CRLFs and partial boundaries sprinkled in so the
+    // matchers can't skip them trivially.
+    char *data = malloc(size);
+    srand(1);
+    for (long i = 0; i < size; i++) {
+        data[i] = rand();
+    }
+    for (long i = 4093; i + 64 < size; i += 4093) {
+        memcpy(data + i, "\r\n--" BOUNDARY, 4 + (i / 4093) % 30);
+    }
+    // As uploaded, the data doesn't start with a bitmap header, so it is
+    // streamed and searched for the delimiter.
+    data[0] = 'X';
+    long data_start, body_size;
+    int body_fd = make_body(data, size, NULL, &data_start, &body_size);
+
+    double best_legacy = 0;
+    for (int r = 0; r < rounds; r++) {
+        FILE *out = temp_file();
+        lseek(body_fd, data_start, SEEK_SET);
+        double start = now();
+        legacy_save_file_upload(body_fd, "--" BOUNDARY, fileno(out));
+        double secs = now() - start;
+        if (best_legacy == 0 || secs < best_legacy) {
+            best_legacy = secs;
+        }
+        fclose(out);
+    }
+    double best_stream = time_upload(body_fd, body_size, data, size, rounds);
+
+    // A bitmap is saved in full whatever size its header gives, and
+    // whether or not the request says how long the body is.
+    long wrong_sizes[] = {8, size / 2, size * 2};
+    for (int i = 0; i < sizeof(wrong_sizes) / sizeof(wrong_sizes[0]); i++) {
+        set_bitmap_size(data, wrong_sizes[i]);
+        body_fd = make_body(data, size, NULL, &data_start, &body_size);
+        time_upload(body_fd, body_size, data, size, 1);
+        time_upload(body_fd, -1, data, size, 1);
+    }
+
+    // Only one part is supported, whether the bitmap is spliced (its header
+    // gives the size of the body's first part) or searched.
+    set_bitmap_size(data, size);
+    body_fd = make_body(data, size, "Content-Disposition: form-data; name=\"note\"\r\n\r\nhi",
+                        &data_start, &body_size);
+    check_rejected(body_fd, body_size);
+    check_rejected(body_fd, -1);
+
+    // With a bitmap header that agrees with the Content-Length, the data is
+    // spliced instead (a Content-Length that doesn't agree gets it searched).
+    set_bitmap_size(data, size);
+    body_fd = make_body(data, size, NULL, &data_start, &body_size);
+    time_upload(body_fd, body_size - 10, data, size, 1);
+    double best_splice = time_upload(body_fd, body_size, data, size, rounds);
+
+    printf("upload: %ld MiB, best of %d\n", size >> 20, rounds);
+    printf("legacy (byte matcher, 1 KiB reads) %8.1f MB/s\n", size / best_legacy / 1e6);
+    printf("streamed (delimiter search)        %8.1f MB/s\n", size / best_stream / 1e6);
+    printf("bitmap (preallocated, spliced)     %8.1f MB/s\n", size / best_splice / 1e6);
+    return 0;
+}
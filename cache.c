@@ -0,0 +1,909 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "cache.h"
+#include "request.h"
+#include "socket.h"
+
+#define MB (1024L * 1024)
+
+int cache_memory_mb = CACHE_MEMORY_MB;
+int cache_disk_mb = CACHE_DISK_MB;
+
+
+/******************************************************************************
+ * State shared by all processes
+ *****************************************************************************/
+
+typedef struct {
+    unsigned long memory_hits;
+    unsigned long disk_hits;
+    unsigned long misses;
+    unsigned long coalesced;       // Misses that followed a flight.
+    unsigned long evictions;       // From the memory tiers.
+    unsigned long disk_evictions;
+    long disk_bytes;               // Size of the entries in CACHE_DIR.
+    uint64_t seed;                 // Hash seed, random; kept in CACHE_DIR
+                                   // with the disk tier.
+} CacheShared;
+
+// Until cache_init maps a shared copy, counters are kept per process.
+static CacheShared local_shared;
+static CacheShared *shared = &local_shared;
+
+#define COUNT(counter) __atomic_add_fetch(&shared->counter, 1, __ATOMIC_RELAXED)
+
+// Where the hash seed is kept. A random seed keeps hash collisions from
+// being precomputed; keeping it keeps CACHE_DIR valid across restarts.
+#define SEED_FILE CACHE_DIR ".seed"
+
+// A file in CACHE_DIR, as found by scan_disk.
+typedef struct {
+    char name[64];
+    time_t mtime;
+    off_t size;
+} DiskFile;
+
+/*
+ * List the entries in CACHE_DIR (every file but the hidden ones) into a
+ * malloc'd array, and store their number in num_files. Return their total
+ * size, or -1 if the directory can't be read.
+ */
+static long scan_disk(DIR *d, DiskFile **files, int *num_files) {
+    int n = 0, size = 64;
+    long total = 0;
+    *files = malloc(size * sizeof(DiskFile));
+    struct dirent *dir;
+    struct stat st;
+    while (*files != NULL && (dir = readdir(d)) != NULL) {
+        if (dir->d_name[0] == '.' || strlen(dir->d_name) >= sizeof((*files)->name) ||
+                fstatat(dirfd(d), dir->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (n == size) {
+            size *= 2;
+            DiskFile *bigger = realloc(*files, size * sizeof(DiskFile));
+            if (bigger == NULL) {
+                free(*files);
+            }
+            *files = bigger;
+            if (bigger == NULL) {
+                break;
+            }
+        }
+        strcpy((*files)[n].name, dir->d_name);
+        (*files)[n].mtime = st.st_mtime;
+        (*files)[n].size = st.st_size;
+        total += st.st_size;
+        n++;
+    }
+    *num_files = n;
+    return *files != NULL ? total : -1;
+}
+
+// Whether CACHE_DIR is there for flights.
+static int flights = 0;
+
+/*
+ * Remove the partial files (of flights and of disk_insert) left behind
+ * by processes that died. No flights have started yet.
+ */
+static void remove_partial_files(void) {
+    DIR *d = opendir(CACHE_DIR);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *dir;
+    while ((dir = readdir(d)) != NULL) {
+        if (strncmp(dir->d_name, ".tmp-", 5) == 0 ||
+                strncmp(dir->d_name, ".flight-", 8) == 0 ||
+                (dir->d_name[0] == '.' && strstr(dir->d_name, ".part") != NULL)) {
+            unlinkat(dirfd(d), dir->d_name, 0);
+        }
+    }
+    closedir(d);
+}
+
+void cache_init(void) {
+    shared = mmap(NULL, sizeof(CacheShared), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        shared = &local_shared;
+    }
+    // Every run hashes with a random seed, even without the disk tier;
+    // only the disk tier keeps it (in SEED_FILE) from one run to the next.
+    if (getrandom(&shared->seed, sizeof(shared->seed), 0) != sizeof(shared->seed)) {
+        perror("getrandom");
+    }
+    // The directory is needed for flights even without the disk tier.
+    if (mkdir(CACHE_DIR, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir " CACHE_DIR);
+        cache_disk_mb = 0;
+        return;
+    }
+    flights = 1;
+    remove_partial_files();
+    if (cache_disk_mb == 0) {
+        return;
+    }
+
+    uint64_t seed;
+    int fd = open(SEED_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && read(fd, &seed, sizeof(seed)) == sizeof(seed)) {
+        shared->seed = seed;
+    } else {
+        if (fd >= 0) {
+            close(fd);
+        }
+        // Results hashed with another seed are no use any more.
+        DIR *d = opendir(CACHE_DIR);
+        DiskFile *files;
+        int n;
+        if (d != NULL && scan_disk(d, &files, &n) >= 0) {
+            for (int i = 0; i < n; i++) {
+                unlinkat(dirfd(d), files[i].name, 0);
+            }
+            free(files);
+        }
+        if (d != NULL) {
+            closedir(d);
+        }
+        fd = open(SEED_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || write_all(fd, &shared->seed, sizeof(shared->seed)) < 0) {
+            perror(SEED_FILE);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    DIR *d = opendir(CACHE_DIR);
+    DiskFile *files;
+    int n;
+    if (d != NULL && (shared->disk_bytes = scan_disk(d, &files, &n)) >= 0) {
+        free(files);
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+}
+
+
+void print_cache_stats(void) {
+    fprintf(stderr, "Cache: %lu hits (%lu from disk), %lu misses (%lu coalesced), "
+            "%lu evictions (%lu from disk), %ld KiB on disk\n",
+            __atomic_load_n(&shared->memory_hits, __ATOMIC_RELAXED) +
+            __atomic_load_n(&shared->disk_hits, __ATOMIC_RELAXED),
+            __atomic_load_n(&shared->disk_hits, __ATOMIC_RELAXED),
+            __atomic_load_n(&shared->misses, __ATOMIC_RELAXED),
+            __atomic_load_n(&shared->coalesced, __ATOMIC_RELAXED),
+            __atomic_load_n(&shared->evictions, __ATOMIC_RELAXED) +
+            __atomic_load_n(&shared->disk_evictions, __ATOMIC_RELAXED),
+            __atomic_load_n(&shared->disk_evictions, __ATOMIC_RELAXED),
+            __atomic_load_n(&shared->disk_bytes, __ATOMIC_RELAXED) / 1024);
+}
+
+
+/******************************************************************************
+ * Keys
+ *****************************************************************************/
+
+/*
+ * Hash len bytes, eight at a time, and finish with the splitmix64 mixer.
+ * This isn't a cryptographic hash; the seed is what keeps collisions
+ * from being crafted.
+ */
+static uint64_t hash_bytes(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t h = shared->seed ^ (0x9e3779b97f4a7c15ULL * (len + 1));
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        h = (h ^ word) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    for (; i < len; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+void make_cache_key(CacheKey *key, uint64_t image, const ChainStep *steps,
+                    int num_steps) {
+    char chain[512];
+    int len = format_chain(steps, num_steps, chain, sizeof(chain));
+    key->image = image;
+    key->chain = hash_bytes(chain, len > 0 ? len : 0);
+}
+
+static void entry_path(char *path, const CacheKey *key) {
+    sprintf(path, CACHE_DIR "%016" PRIx64 "-%016" PRIx64 ".bmp", key->image, key->chain);
+}
+
+
+/******************************************************************************
+ * The memory tier
+ *****************************************************************************/
+
+#define CACHE_SHARDS 8
+#define SHARD_BUCKETS 64
+
+typedef struct entry {
+    CacheKey key;
+    unsigned char *data;
+    size_t len;
+    int refs;                     // Hits being sent, plus 1 while cached.
+    struct entry *bucket_next;
+    struct entry *prev, *next;    // LRU order, most recent first.
+} Entry;
+
+// Entries are spread over shards by key, each with its own lock, list and
+// share of the byte budget, so that threads rarely contend for a lock.
+typedef struct {
+    pthread_mutex_t lock;
+    Entry *buckets[SHARD_BUCKETS];
+    Entry *head, *tail;
+    size_t bytes;
+} Shard;
+
+static Shard shards[CACHE_SHARDS] = {
+    [0 ... CACHE_SHARDS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}
+};
+
+static size_t shard_budget(void) {
+    return cache_memory_mb * MB / CACHE_SHARDS;
+}
+
+static uint64_t key_hash(const CacheKey *key) {
+    return key->image ^ key->chain;
+}
+
+static Shard *key_shard(const CacheKey *key) {
+    return &shards[key_hash(key) % CACHE_SHARDS];
+}
+
+static Entry **key_bucket(Shard *shard, const CacheKey *key) {
+    return &shard->buckets[key_hash(key) / CACHE_SHARDS % SHARD_BUCKETS];
+}
+
+static void put_entry(Entry *entry) {
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(entry->data);
+        free(entry);
+    }
+}
+
+static void lru_unlink(Shard *shard, Entry *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        shard->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        shard->tail = entry->prev;
+    }
+}
+
+static void lru_push(Shard *shard, Entry *entry) {
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head) {
+        shard->head->prev = entry;
+    } else {
+        shard->tail = entry;
+    }
+    shard->head = entry;
+}
+
+/*
+ * Take an entry out of its shard (whose lock is held). It is freed once
+ * the hits being sent from it are done.
+ */
+static void remove_entry(Shard *shard, Entry *entry) {
+    Entry **p = key_bucket(shard, &entry->key);
+    while (*p != entry) {
+        p = &(*p)->bucket_next;
+    }
+    *p = entry->bucket_next;
+    lru_unlink(shard, entry);
+    shard->bytes -= entry->len;
+    put_entry(entry);
+}
+
+static Entry *find_entry(Shard *shard, const CacheKey *key) {
+    Entry *entry = *key_bucket(shard, key);
+    while (entry != NULL && (entry->key.image != key->image ||
+                             entry->key.chain != key->chain)) {
+        entry = entry->bucket_next;
+    }
+    return entry;
+}
+
+/*
+ * Keep a result in memory, evicting the least recently used entries of
+ * its shard to make room. Return 0 if it is too large to keep.
+ */
+static int memory_insert(const CacheKey *key, unsigned char *data, size_t len) {
+    size_t budget = shard_budget();
+    Entry *entry;
+    if (len > budget || (entry = malloc(sizeof(Entry))) == NULL) {
+        return 0;
+    }
+    entry->key = *key;
+    entry->data = data;
+    entry->len = len;
+    entry->refs = 1;
+
+    Shard *shard = key_shard(key);
+    pthread_mutex_lock(&shard->lock);
+    Entry *old = find_entry(shard, key);
+    if (old != NULL) {
+        remove_entry(shard, old);
+    }
+    while (shard->bytes + len > budget) {
+        remove_entry(shard, shard->tail);
+        COUNT(evictions);
+    }
+    Entry **bucket = key_bucket(shard, key);
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    lru_push(shard, entry);
+    shard->bytes += len;
+    pthread_mutex_unlock(&shard->lock);
+    return 1;
+}
+
+
+/******************************************************************************
+ * The disk tier
+ *****************************************************************************/
+
+static int compare_mtime(const void *a, const void *b) {
+    time_t ta = ((const DiskFile *)a)->mtime, tb = ((const DiskFile *)b)->mtime;
+    return (ta > tb) - (ta < tb);
+}
+
+/*
+ * Remove the least recently used entries from CACHE_DIR until it is at
+ * three quarters of its budget. Only one process trims at a time.
+ */
+static void trim_disk(void) {
+    DIR *d = opendir(CACHE_DIR);
+    if (d == NULL) {
+        perror("opendir " CACHE_DIR);
+        return;
+    }
+    if (flock(dirfd(d), LOCK_EX | LOCK_NB) < 0) {
+        closedir(d);
+        return;
+    }
+    DiskFile *files;
+    int n;
+    long total = scan_disk(d, &files, &n);
+    if (total >= 0) {
+        // Hits touch their file, so the oldest ones are the least recently used.
+        qsort(files, n, sizeof(DiskFile), compare_mtime);
+        long target = cache_disk_mb * MB / 4 * 3;
+        for (int i = 0; i < n && total > target; i++) {
+            if (unlinkat(dirfd(d), files[i].name, 0) == 0) {
+                total -= files[i].size;
+                COUNT(disk_evictions);
+            }
+        }
+        free(files);
+        __atomic_store_n(&shared->disk_bytes, total, __ATOMIC_RELAXED);
+    }
+    closedir(d);
+}
+
+/*
+ * Write a result to CACHE_DIR. It is written under a temporary name and
+ * then linked into place, so other processes never see part of it.
+ */
+static void disk_insert(const CacheKey *key, const unsigned char *data, size_t len) {
+    if (len > cache_disk_mb * MB) {
+        return;
+    }
+    char path[64], tmp[64];
+    entry_path(path, key);
+    snprintf(tmp, sizeof(tmp), CACHE_DIR ".tmp-%d", getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(tmp);
+        return;
+    }
+    int written = write_all(fd, data, len) == 0;
+    close(fd);
+    if (written && link(tmp, path) == 0 &&
+            __atomic_add_fetch(&shared->disk_bytes, len, __ATOMIC_RELAXED) >
+            cache_disk_mb * MB) {
+        trim_disk();
+    }
+    unlink(tmp);
+}
+
+/*
+ * Remove every entry for the image with the given hash, from this
+ * process's memory tier and from CACHE_DIR.
+ */
+static void purge_image(uint64_t image) {
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        Shard *shard = &shards[s];
+        pthread_mutex_lock(&shard->lock);
+        Entry *entry = shard->head;
+        while (entry != NULL) {
+            Entry *next = entry->next;
+            if (entry->key.image == image) {
+                remove_entry(shard, entry);
+            }
+            entry = next;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    char prefix[20];
+    snprintf(prefix, sizeof(prefix), "%016" PRIx64 "-", image);
+    DIR *d = cache_disk_mb > 0 ? opendir(CACHE_DIR) : NULL;
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *dir;
+    struct stat st;
+    while ((dir = readdir(d)) != NULL) {
+        if (strncmp(dir->d_name, prefix, strlen(prefix)) == 0 &&
+                fstatat(dirfd(d), dir->d_name, &st, 0) == 0 &&
+                unlinkat(dirfd(d), dir->d_name, 0) == 0) {
+            __atomic_sub_fetch(&shared->disk_bytes, st.st_size, __ATOMIC_RELAXED);
+        }
+    }
+    closedir(d);
+}
+
+
+/******************************************************************************
+ * Lookups
+ *****************************************************************************/
+
+int cache_lookup(const CacheKey *key, CacheHit *hit) {
+    hit->data = NULL;
+    hit->fd = -1;
+    hit->entry = NULL;
+
+    Shard *shard = key_shard(key);
+    pthread_mutex_lock(&shard->lock);
+    Entry *entry = find_entry(shard, key);
+    if (entry != NULL) {
+        lru_unlink(shard, entry);
+        lru_push(shard, entry);
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (entry != NULL) {
+        COUNT(memory_hits);
+        hit->data = entry->data;
+        hit->len = entry->len;
+        hit->entry = entry;
+        return 1;
+    }
+
+    char path[64];
+    entry_path(path, key);
+    struct stat st;
+    int fd = cache_disk_mb > 0 ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        // Mark it recently used, for trim_disk.
+        futimens(fd, NULL);
+        COUNT(disk_hits);
+        hit->fd = fd;
+        hit->len = st.st_size;
+        return 1;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    COUNT(misses);
+    return 0;
+}
+
+void cache_release(CacheHit *hit) {
+    if (hit->entry != NULL) {
+        put_entry(hit->entry);
+    }
+    if (hit->fd >= 0) {
+        close(hit->fd);
+    }
+}
+
+int cache_fits(size_t len) {
+    return len <= shard_budget() || len <= cache_disk_mb * MB;
+}
+
+void cache_insert(const CacheKey *key, unsigned char *data, size_t len) {
+    if (cache_disk_mb > 0) {
+        disk_insert(key, data, len);
+    }
+    if (cache_memory_mb == 0 || !memory_insert(key, data, len)) {
+        free(data);
+    }
+}
+
+
+/******************************************************************************
+ * Flights
+ *****************************************************************************/
+
+// A partial file starts with the size of the result, as a uint64_t.
+#define FLIGHT_PREFIX sizeof(uint64_t)
+
+// How often a follower checks on its leader if no inotify event comes.
+#define FLIGHT_POLL_MS 50
+
+// Whether fd is still the file at path.
+static int same_file(int fd, const char *path) {
+    struct stat a, b;
+    return fstat(fd, &a) == 0 && stat(path, &b) == 0 &&
+           a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+// Whether the flight in fd has its whole result.
+static int flight_complete(int fd) {
+    uint64_t len;
+    struct stat st;
+    return pread(fd, &len, sizeof(len), 0) == sizeof(len) && fstat(fd, &st) == 0 &&
+           st.st_size == FLIGHT_PREFIX + len;
+}
+
+int cache_join(const CacheKey *key, Flight *flight) {
+    if (!flights) {
+        return -1;
+    }
+    flight->watch = -1;
+    sprintf(flight->path, CACHE_DIR ".%016" PRIx64 "-%016" PRIx64 ".part",
+            key->image, key->chain);
+    snprintf(flight->tmp, sizeof(flight->tmp), CACHE_DIR ".flight-%d", getpid());
+
+    // Two tries: the second after taking a flight over from a dead leader.
+    for (int attempt = 0; attempt < 2; attempt++) {
+        // The file is locked before it is linked into place, so a follower
+        // that finds it unlocked knows the leader is done or gone.
+        int fd = open(flight->tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || flock(fd, LOCK_EX) < 0) {
+            perror(flight->tmp);
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        int linked = link(flight->tmp, flight->path);
+        int err = errno;
+        unlink(flight->tmp);
+        if (linked == 0) {
+            flight->fd = fd;
+            return 1;
+        }
+        close(fd);
+        if (err != EEXIST) {
+            errno = err;
+            perror(flight->path);
+            return -1;
+        }
+
+        if ((fd = open(flight->path, O_RDONLY | O_CLOEXEC)) < 0) {
+            // The leader has just finished; its result may be cached now,
+            // but it is simplest to lead a flight of our own.
+            continue;
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0 && !flight_complete(fd)) {
+            if (same_file(fd, flight->path)) {
+                unlink(flight->path);
+            }
+            close(fd);
+            continue;
+        }
+        flock(fd, LOCK_UN);
+        flight->watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (flight->watch >= 0 && inotify_add_watch(flight->watch, flight->path,
+                IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+            // Without the watch, flight_wait polls.
+            close(flight->watch);
+            flight->watch = -1;
+        }
+        flight->fd = fd;
+        COUNT(coalesced);
+        return 0;
+    }
+    return -1;
+}
+
+void flight_size(Flight *flight, size_t len) {
+    uint64_t size = len;
+    flight_write(flight, &size, sizeof(size));
+}
+
+void flight_write(Flight *flight, const void *data, size_t len) {
+    // If the disk is full, the followers see the leader stop and run the
+    // filters themselves.
+    if (flight->fd >= 0 && write_all(flight->fd, data, len) < 0) {
+        perror(flight->path);
+        if (same_file(flight->fd, flight->path)) {
+            unlink(flight->path);
+        }
+        close(flight->fd);
+        flight->fd = -1;
+    }
+}
+
+void cache_finish(const CacheKey *key, Flight *flight, unsigned char *data,
+                  size_t len) {
+    // Cache the result before unlocking, so that a process that misses on
+    // the key after the flight ends finds it.
+    if (data != NULL) {
+        cache_insert(key, data, len);
+    }
+    if (flight != NULL && flight->fd >= 0) {
+        if (same_file(flight->fd, flight->path)) {
+            unlink(flight->path);
+        }
+        close(flight->fd);
+    }
+}
+
+/*
+ * Wait for the partial file to change, or for FLIGHT_POLL_MS, and drain
+ * the events.
+ */
+static void flight_sleep(Flight *flight) {
+    struct pollfd pfd = {.fd = flight->watch, .events = POLLIN};
+    if (poll(&pfd, flight->watch >= 0, FLIGHT_POLL_MS) > 0) {
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        while (read(flight->watch, events, sizeof(events)) > 0) {
+        }
+    }
+}
+
+/*
+ * Return the size of the partial file, once it is larger than size or
+ * its leader is gone.
+ */
+static off_t flight_grow(Flight *flight, off_t size) {
+    struct stat st;
+    while (1) {
+        if (fstat(flight->fd, &st) < 0) {
+            return -1;
+        }
+        if (st.st_size > size) {
+            return st.st_size;
+        }
+        if (flock(flight->fd, LOCK_SH | LOCK_NB) == 0) {
+            // The leader is gone, so the file is as large as it will get.
+            flock(flight->fd, LOCK_UN);
+            return fstat(flight->fd, &st) == 0 ? st.st_size : -1;
+        }
+        flight_sleep(flight);
+    }
+}
+
+long flight_length(Flight *flight) {
+    uint64_t len;
+    off_t size = 0;
+    while (size < FLIGHT_PREFIX) {
+        off_t grown = flight_grow(flight, size);
+        if (grown <= size) {
+            return -1;
+        }
+        size = grown;
+    }
+    if (pread(flight->fd, &len, sizeof(len), 0) != sizeof(len) ||
+            lseek(flight->fd, FLIGHT_PREFIX, SEEK_SET) < 0) {
+        return -1;
+    }
+    return len;
+}
+
+long flight_wait(Flight *flight, long offset) {
+    off_t size = flight_grow(flight, FLIGHT_PREFIX + offset);
+    return size < 0 ? -1 : size - (off_t)FLIGHT_PREFIX;
+}
+
+void flight_leave(Flight *flight) {
+    close(flight->fd);
+    if (flight->watch >= 0) {
+        close(flight->watch);
+    }
+}
+
+
+/******************************************************************************
+ * Image hashes and mappings
+ *****************************************************************************/
+
+// The hashes this process has computed, by image name.
+typedef struct image_hash {
+    char *name;
+    uint64_t hash;
+    struct image_hash *next;
+} ImageHash;
+
+// The images this process has mapped, by name.
+typedef struct image_map {
+    char *name;
+    unsigned char *data;
+    size_t len;
+    int refs;            // The requests holding it, and 1 while it's listed.
+    struct image_map *next;
+} ImageMap;
+
+static ImageHash *image_hashes = NULL;
+static ImageMap *image_maps = NULL;
+static int image_watch = -1;     // inotify fd on IMAGE_DIR; -1 if none.
+static int image_watched = 0;    // 1 once the watch has been attempted.
+
+static void unref_map(ImageMap *map) {
+    if (--map->refs > 0) {
+        return;
+    }
+    if (map->len > 0) {
+        munmap(map->data, map->len);
+    }
+    free(map->name);
+    free(map);
+}
+
+/*
+ * Forget the hash and mapping of the named image (or of every image, if
+ * name is NULL), along with its cached results.
+ */
+static void forget_image(const char *name) {
+    ImageHash **p = &image_hashes;
+    while (*p != NULL) {
+        ImageHash *h = *p;
+        if (name == NULL || strcmp(h->name, name) == 0) {
+            purge_image(h->hash);
+            *p = h->next;
+            free(h->name);
+            free(h);
+        } else {
+            p = &h->next;
+        }
+    }
+    ImageMap **m = &image_maps;
+    while (*m != NULL) {
+        ImageMap *map = *m;
+        if (name == NULL || strcmp(map->name, name) == 0) {
+            *m = map->next;
+            unref_map(map);
+        } else {
+            m = &map->next;
+        }
+    }
+}
+
+/*
+ * Drain pending inotify events on IMAGE_DIR, forgetting the images they
+ * are about. Without a watch, nothing is remembered.
+ */
+static void check_images(void) {
+    if (!image_watched) {
+        image_watched = 1;
+        image_watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (image_watch >= 0 && inotify_add_watch(image_watch, IMAGE_DIR,
+                IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+            close(image_watch);
+            image_watch = -1;
+        }
+        if (image_watch < 0) {
+            perror("inotify " IMAGE_DIR);
+        }
+    }
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while (image_watch >= 0 && (n = read(image_watch, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            forget_image(ev->len > 0 ? ev->name : NULL);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+int lookup_image_hash(const char *name, uint64_t *hash) {
+    check_images();
+    for (ImageHash *h = image_hashes; h != NULL; h = h->next) {
+        if (strcmp(h->name, name) == 0) {
+            *hash = h->hash;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+uint64_t hash_image(const char *name, const unsigned char *data, size_t len) {
+    uint64_t hash = hash_bytes(data, len);
+    ImageHash *h;
+    if (image_watch >= 0 && (h = malloc(sizeof(ImageHash))) != NULL) {
+        h->name = strdup(name);
+        h->hash = hash;
+        h->next = image_hashes;
+        image_hashes = h;
+    }
+    return hash;
+}
+
+
+/*
+ * A mapping is populated up front, so the filters don't fault on its
+ * pages, and read in order. A file in IMAGE_DIR is replaced rather than
+ * rewritten (uploads create new files), so the pages of a mapping stay
+ * valid for the requests holding it.
+ */
+int map_image(const char *name, ImageSource *source) {
+    check_images();
+    ImageMap *map = image_maps;
+    while (map != NULL && strcmp(map->name, name) != 0) {
+        map = map->next;
+    }
+
+    if (map == NULL) {
+        char path[MAXLINE];
+        snprintf(path, sizeof(path), IMAGE_DIR "%s", name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0 || (map = calloc(1, sizeof(ImageMap))) == NULL) {
+            perror("Failed to open image file");
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        map->len = st.st_size;
+        if (map->len > 0) {
+            map->data = mmap(NULL, map->len, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+            if (map->data == MAP_FAILED) {
+                perror("Failed to map image file");
+                close(fd);
+                free(map);
+                return -1;
+            }
+            madvise(map->data, map->len, MADV_SEQUENTIAL);
+        }
+        close(fd);
+        if (image_watch >= 0 && (map->name = strdup(name)) != NULL) {
+            map->refs = 1;
+            map->next = image_maps;
+            image_maps = map;
+        }
+    }
+
+    map->refs++;
+    source->data = map->data;
+    source->len = map->len;
+    source->map = map;
+    return 0;
+}
+
+void release_image(ImageSource *source) {
+    unref_map(source->map);
+}
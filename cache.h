@@ -0,0 +1,159 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "filters/bitmap.h"
+
+/*
+ * The image-filter result cache.
+ *
+ * Results are keyed by a hash of the source bitmap's contents and of the
+ * canonical filter chain (format_chain), so the same image under another
+ * name, or a chain written differently, hits the same entry. Each process
+ * keeps recent results in a sharded in-memory LRU; every result is also
+ * written to CACHE_DIR, which all processes share and which outlives the
+ * server. Both tiers have a byte budget.
+ */
+#define CACHE_DIR "cache/"
+
+// Default budgets, in MiB: for the memory tier of each process, and for
+// CACHE_DIR. Both can be changed from the command line; 0 turns a tier off.
+#define CACHE_MEMORY_MB 64
+#define CACHE_DISK_MB 256
+
+extern int cache_memory_mb, cache_disk_mb;
+
+typedef struct {
+    uint64_t image;     // Hash of the source bitmap.
+    uint64_t chain;     // Hash of the canonical chain.
+} CacheKey;
+
+// A cached result, found by cache_lookup.
+typedef struct {
+    const unsigned char *data;  // The bitmap, if it is in memory; else NULL.
+    int fd;                     // Otherwise, its file in CACHE_DIR.
+    size_t len;
+    void *entry;                // The memory entry held for the hit.
+} CacheHit;
+
+
+/*
+ * Set up the state the server's processes share (the counters and the
+ * size of CACHE_DIR). Call this before starting any workers.
+ */
+void cache_init(void);
+
+/*
+ * Look up the hash of the contents of the image with the given name in
+ * IMAGE_DIR, as last computed by hash_image in this process. The hashes
+ * are forgotten when their file changes. Return 1 if it is known.
+ */
+int lookup_image_hash(const char *name, uint64_t *hash);
+
+/*
+ * Hash the contents of the image with the given name, remember the hash,
+ * and return it.
+ */
+uint64_t hash_image(const char *name, const unsigned char *data, size_t len);
+
+/*
+ * A source image in IMAGE_DIR, mapped read-only. Each process keeps the
+ * mappings of the images it has used, so a request on one of them reads
+ * and copies nothing before the filters run. A mapping is dropped (as the
+ * hashes are) when its file changes, and unmapped once the last request
+ * holding it has released it. Without a watch on IMAGE_DIR, every request
+ * maps the image afresh.
+ */
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    void *map;          // The mapping held for the request.
+} ImageSource;
+
+/*
+ * Map the image with the given name, or find its mapping, and hold it in
+ * source. Return -1 if it can't be opened or mapped.
+ */
+int map_image(const char *name, ImageSource *source);
+void release_image(ImageSource *source);
+
+void make_cache_key(CacheKey *key, uint64_t image, const ChainStep *steps,
+                    int num_steps);
+
+/*
+ * Look up a result. Return 1 and fill in hit if it is cached; the caller
+ * sends it and then calls cache_release.
+ */
+int cache_lookup(const CacheKey *key, CacheHit *hit);
+void cache_release(CacheHit *hit);
+
+/*
+ * Add a result, of len bytes in a malloc'd buffer that the cache takes
+ * over (and frees if it doesn't keep it in memory).
+ */
+void cache_insert(const CacheKey *key, unsigned char *data, size_t len);
+
+/*
+ * Return whether a result of len bytes fits in a tier of the cache, and
+ * so is worth collecting for cache_insert.
+ */
+int cache_fits(size_t len);
+
+/*
+ * Misses are computed once however many processes want the result at
+ * the same time. The first process to miss on a key leads a flight: it
+ * writes the result, as it is produced, to a partial file in CACHE_DIR,
+ * which it keeps locked until it is done. Processes that miss on the key
+ * meanwhile follow the flight, sending the file to their clients as it
+ * grows, and run nothing themselves.
+ */
+typedef struct {
+    int fd;             // The partial file.
+    int watch;          // Follower: inotify fd on the file, or -1.
+    char path[64];
+    char tmp[64];       // Leader: the name it was created under.
+} Flight;
+
+/*
+ * Join the flight for a key that cache_lookup missed. Return 1 if this
+ * process leads it: pass the size of the result to flight_size and then
+ * the result to flight_write as it is produced, and finish with
+ * cache_finish. Return 0 if it follows another process: read the result
+ * with flight_length and flight_wait, and finish with flight_leave.
+ * Return -1 if there is no flight to join; run the filters and call
+ * cache_insert as usual.
+ */
+int cache_join(const CacheKey *key, Flight *flight);
+
+void flight_size(Flight *flight, size_t len);
+void flight_write(Flight *flight, const void *data, size_t len);
+
+/*
+ * Add the result of a miss to the cache, as cache_insert does, and end
+ * the flight this process leads, if flight isn't NULL. data is NULL if
+ * the filters failed, or if the result wasn't collected (see cache_fits).
+ */
+void cache_finish(const CacheKey *key, Flight *flight, unsigned char *data,
+                  size_t len);
+
+/*
+ * Wait for the leader of a flight to give the size of the result, and
+ * return it, or -1 if the leader failed.
+ */
+long flight_length(Flight *flight);
+
+/*
+ * Wait until more than offset bytes of the result are in the partial
+ * file, or the leader is gone, and return how many there are. flight->fd
+ * is positioned at the start of the result.
+ */
+long flight_wait(Flight *flight, long offset);
+void flight_leave(Flight *flight);
+
+/*
+ * Print the cache counters (of all processes) to stderr.
+ */
+void print_cache_stats(void);
+
+#endif /* CACHE_H_ */
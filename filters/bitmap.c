@@ -1,94 +1,62 @@
+#include <limits.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include "bitmap.h"
 
 
 /*
- * Read in bitmap header data from stdin, and return a pointer to
- * a new Bitmap struct containing the important metadata for the image file.
+ * Parse the bitmap header at the start of the len bytes in src, and return
+ * a pointer to a new Bitmap struct containing the important metadata for
+ * the image file (with its own copy of the header), or NULL if src doesn't
+ * hold a complete header.
  *
- * TODO: complete this function.
- *
- * Notes:
- *   1. Store header data in an array of unsigned char (essentially
- *      an array of bytes). Examples:
- *      on the stack,
- *          unsigned char data[10];
- *      on the heap,
- *          unsigned char *data = malloc(10);
- *
- *   2. Don't make any assumptions about the header size. You should read in
- *      BMP_HEADER_SIZE_OFFSET bytes first, and then the header size,
- *      and then use this to allocate enough space for the actual header.
- *
- *   3. You can use memcpy to transfer bytes to and from the Bitmap "header" field.
- *      You can even write these bytes to memory allocated for variables of other types!
- *      For example:
- *          unsigned char bytes[4];
- *          int x = 10;
- *          int y;
- *          memcpy(bytes, &x, 4);  // Copy the int x into bytes.
- *          memcpy(&y, bytes, 4);  // Copy the contents of bytes into y.
- *
- *   4. You can use either fread/fwrite or read/write to perform I/O operations here.
- *
- *   5. Make good use of the provided macros in bitmap.h to index into the "header" array.
+ * Don't make any assumptions about the header size: it is read from the
+ * BMP_HEADER_SIZE_OFFSET field.
  */
-Bitmap *read_header() {
-    Bitmap *bmp = malloc(sizeof(Bitmap));
-    if (!bmp) {
-        fprintf(stderr, "Not enough space for Bitmap\n");
+static Bitmap *parse_header(const unsigned char *src, size_t len) {
+    int header_size;
+    if (len < BMP_HEIGHT_OFFSET + sizeof(int)) {
+        fprintf(stderr, "Failed to read the header size\n");
         return NULL;
     }
-      
-    unsigned char buffer[BMP_HEADER_SIZE_OFFSET];
-    if (fread(&buffer, BMP_HEADER_SIZE_OFFSET, 1, stdin) != 1) {
-        fprintf(stderr, "Failed to read things before header size\n");
-        free(bmp);
+    memcpy(&header_size, src + BMP_HEADER_SIZE_OFFSET, sizeof(header_size));
+    if (header_size < BMP_HEIGHT_OFFSET + (int)sizeof(int) || header_size > len) {
+        fprintf(stderr, "Failed to read the complete header\n");
         return NULL;
     }
-    
-    if (fread(&bmp->headerSize, sizeof(bmp->headerSize), 1, stdin) != 1) {
-        fprintf(stderr, "Failed to read the header size\n");
-        free(bmp);
+
+    Bitmap *bmp = malloc(sizeof(Bitmap));
+    if (!bmp) {
+        fprintf(stderr, "Not enough space for Bitmap\n");
         return NULL;
     }
-
+    bmp->headerSize = header_size;
     bmp->header = malloc(bmp->headerSize);
     if (!bmp->header) {
         fprintf(stderr, "Not enough space for header\n");
         free(bmp);
         return NULL;
     }
-
-    memcpy(bmp->header, buffer, BMP_HEADER_SIZE_OFFSET);
-    memcpy(bmp->header + BMP_HEADER_SIZE_OFFSET, &bmp->headerSize, sizeof(bmp->headerSize));
-    
-    int size_rest = bmp->headerSize - BMP_HEADER_SIZE_OFFSET - sizeof(bmp->headerSize);
-    if (fread(bmp->header + BMP_HEADER_SIZE_OFFSET + sizeof(bmp->headerSize), size_rest, 1, stdin) != 1) {
-        fprintf(stderr, "Failed to read the complete header\n");
-        free(bmp->header);
-        free(bmp);
-        return NULL;
-    }
+    memcpy(bmp->header, src, bmp->headerSize);
 
     memcpy(&bmp->width, bmp->header + BMP_WIDTH_OFFSET, sizeof(bmp->width));
     memcpy(&bmp->height, bmp->header + BMP_HEIGHT_OFFSET, sizeof(bmp->height));
+    bmp->topDown = bmp->height < 0 && bmp->height != INT_MIN;
+    if (bmp->topDown) {
+        bmp->height = -bmp->height;
+    }
+    bmp->inWidth = bmp->width;
+    bmp->inHeight = bmp->height;
 
     return bmp;
 }
 
 
-/*
- * Write out bitmap metadata to stdout.
- * You may add extra fprintf calls to *stderr* here for debugging purposes.
- */
-void write_header(const Bitmap *bmp) {
-    fwrite(bmp->header, bmp->headerSize, 1, stdout);
-}
-
 /*
  * Free the given Bitmap struct.
  */
@@ -98,51 +66,471 @@ void free_bitmap(Bitmap *bmp) {
 }
 
 /*
- * Update the bitmap header to record a resizing of the image.
- *
- * TODO: complete this function when working on the "scale" filter.
- *
- * Notes:
- *   1. As with read_header, use memcpy and the provided macros in bitmap.h.
- *
- *   2. bmp->header *must* be updated, as this is what's written out
- *      in write_header.
- *
- *   3. You may choose whether or not to also update bmp->width and bmp->height.
- *      This choice may depend on how you implement the scale filter.
+ * Update the bitmap header to record a resizing of the image to width by
+ * height pixels. bmp->width and bmp->height are updated too: the filter
+ * kernels see the dimensions of the image they write.
  */
-void scale(Bitmap *bmp, int scale_factor) {
-    bmp->width = bmp->width * scale_factor;
-    bmp->height = bmp->height * scale_factor;
-    bmp->scaleFactor = scale_factor;
-    
-    int fileSize = bmp->height * bmp->width + bmp->headerSize; 
-    memcpy(bmp->header + BMP_FILE_SIZE_OFFSET, &fileSize, BMP_HEADER_SIZE_OFFSET - BMP_FILE_SIZE_OFFSET);
-    memcpy(bmp->header + BMP_WIDTH_OFFSET, &(bmp->width), sizeof(bmp->width));
-    memcpy(bmp->header + BMP_HEIGHT_OFFSET, &(bmp->height), sizeof(bmp->height));
+static void scale(Bitmap *bmp, int width, int height) {
+    bmp->width = width;
+    bmp->height = height;
+
+    // The sizes count the padding of the rows. The image size may be 0
+    // for an uncompressed image, and is left so.
+    int image_size = BMP_ROW_SIZE(width) * height;
+    int file_size = bmp->headerSize + image_size;
+    int old_image_size;
+    memcpy(bmp->header + BMP_FILE_SIZE_OFFSET, &file_size, sizeof(file_size));
+    memcpy(bmp->header + BMP_WIDTH_OFFSET, &width, sizeof(width));
+    height = bmp->topDown ? -height : height;
+    memcpy(bmp->header + BMP_HEIGHT_OFFSET, &height, sizeof(height));
+    if (bmp->headerSize >= BMP_IMAGE_SIZE_OFFSET + (int)sizeof(int)) {
+        memcpy(&old_image_size, bmp->header + BMP_IMAGE_SIZE_OFFSET, sizeof(old_image_size));
+        if (old_image_size != 0) {
+            memcpy(bmp->header + BMP_IMAGE_SIZE_OFFSET, &image_size, sizeof(image_size));
+        }
+    }
+}
+
+
+enum simd_level simd_level = SIMD_NONE;
+
+__attribute__((constructor))
+static void choose_simd_level(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        simd_level = SIMD_AVX2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        simd_level = SIMD_SSSE3;
+    } else if (__builtin_cpu_supports("sse2")) {
+        simd_level = SIMD_SSE2;
+    }
+#endif
+    const char *wanted = getenv("FILTER_SIMD");
+    if (wanted != NULL) {
+        enum simd_level level = strcmp(wanted, "avx2") == 0 ? SIMD_AVX2 :
+                                strcmp(wanted, "ssse3") == 0 ? SIMD_SSSE3 :
+                                strcmp(wanted, "sse2") == 0 ? SIMD_SSE2 : SIMD_NONE;
+        simd_level = min(simd_level, level);
+    }
 }
 
 
 /*
- * The "main" function.
- *
- * Run a given filter function, and apply a scale factor if necessary.
- * You don't need to modify this function to make it work with any of
- * the filters for this assignment.
+ * The filter registry, for looking filters up by name.
  */
-void run_filter(void (*filter)(Bitmap *), int scale_factor) {
-    Bitmap *bmp = read_header();
+static const Filter filters[] = {
+    {"copy", copy_filter, 1, FILTER_POINT, copy_row},
+    {"greyscale", greyscale_filter, 1, FILTER_POINT, greyscale_row},
+    {"luma", luma_filter, 1, FILTER_POINT, luma_row},
+    {"threshold", threshold_filter, 1, FILTER_POINT, threshold_row},
+    {"invert", invert_filter, 1, FILTER_POINT, invert_row},
+    {"brightness", brightness_filter, 1, FILTER_POINT, brightness_row},
+    {"contrast", contrast_filter, 1, FILTER_POINT, contrast_row},
+    {"gamma", gamma_filter, 1, FILTER_POINT, gamma_row},
+    {"gaussian_blur", gaussian_blur_filter, 1, FILTER_STENCIL, gaussian_blur_row},
+    {"edge_detection", edge_detection_filter, 1, FILTER_STENCIL, edge_detection_row},
+    {"scale", scale_filter, 2, FILTER_SCALE, NULL, RESAMPLE_BOX},
+    {"bilinear", bilinear_filter, 2, FILTER_SCALE, NULL, RESAMPLE_BILINEAR},
+    {"lanczos", lanczos_filter, 2, FILTER_SCALE, NULL, RESAMPLE_LANCZOS},
+};
 
-    if (scale_factor > 1) {
-        scale(bmp, scale_factor);
+#define NUM_FILTERS (sizeof(filters) / sizeof(filters[0]))
+
+const Filter *find_filter(const char *name) {
+    for (int i = 0; i < NUM_FILTERS; i++) {
+        if (strcmp(filters[i].name, name) == 0) {
+            return &filters[i];
+        }
+    }
+    return NULL;
+}
+
+
+int scaled_size(int size, Scale scale) {
+    long long scaled = ((long long)size * scale.num + scale.den / 2) / scale.den;
+    return scaled > INT_MAX ? -1 : max(scaled, 1);
+}
+
+
+/*
+ * Check the header in bmp for a chain of num_steps filters, given that
+ * pixel_len bytes of pixels follow it, and update it for the scaling they
+ * do. Return bmp, or free it and return NULL.
+ */
+static Bitmap *check_bitmap(Bitmap *bmp, size_t pixel_len,
+                            const ChainStep *steps, int num_steps) {
+    // The rows must all be there, and the image must fit in an int size
+    // (the header's file size field) after each step.
+    size_t max_size = INT_MAX - bmp->headerSize;
+    int width = bmp->width, height = bmp->height;
+    int fits = width > 0 && height > 0 && height <= pixel_len / BMP_ROW_SIZE(width);
+    for (int s = 0; s < num_steps && fits; s++) {
+        if (steps[s].filter->kind == FILTER_SCALE) {
+            width = scaled_size(width, steps[s].scale);
+            height = scaled_size(height, steps[s].scale);
+        }
+        fits = width > 0 && height > 0 && width <= max_size / sizeof(Pixel) &&
+               height <= max_size / BMP_ROW_SIZE(width);
+    }
+    if (!fits) {
+        fprintf(stderr, "Failed to read pixels\n");
+        free_bitmap(bmp);
+        return NULL;
+    }
+
+    if (width != bmp->width || height != bmp->height) {
+        scale(bmp, width, height);
+    }
+    return bmp;
+}
+
+
+Bitmap *prepare_bitmap(const unsigned char *src, size_t len,
+                       const ChainStep *steps, int num_steps) {
+    Bitmap *bmp = parse_header(src, len);
+    if (bmp == NULL) {
+        return NULL;
     }
+    return check_bitmap(bmp, len - bmp->headerSize, steps, num_steps);
+}
+
 
-    write_header(bmp);
+size_t bitmap_size(const unsigned char *src, size_t len) {
+    Bitmap *bmp = parse_header(src, len);
+    if (bmp == NULL || (bmp = check_bitmap(bmp, SIZE_MAX, NULL, 0)) == NULL) {
+        return 0;
+    }
+    size_t size = bmp->headerSize + BMP_ROW_SIZE(bmp->width) * bmp->height;
+    free_bitmap(bmp);
+    return size;
+}
+
+
+unsigned char *apply_filter(const Filter *filter, Scale scale,
+                            const unsigned char *src, size_t len,
+                            size_t *out_len) {
+    ChainStep step = {filter, scale};
+    Bitmap *bmp = prepare_bitmap(src, len, &step, 1);
+    if (bmp == NULL) {
+        return NULL;
+    }
+    int width = bmp->width, height = bmp->height;
+    int in_width = bmp->inWidth, in_height = bmp->inHeight;
+
+    // The kernels work on aligned images: the rows are read into one, and
+    // the filter's output written from another.
+    *out_len = bmp->headerSize + BMP_ROW_SIZE(width) * height;
+    unsigned char *out = malloc(*out_len);
+    ImageBuf in_image, out_image;
+    int in_ok = image_alloc(&in_image, in_width, in_height, IMAGE_INTERLEAVED) == 0;
+    int out_ok = image_alloc(&out_image, width, height, IMAGE_INTERLEAVED) == 0;
+    if (out == NULL || !in_ok || !out_ok) {
+        perror("Failed to allocate memory for the image");
+        free(out);
+        image_free(&in_image);
+        image_free(&out_image);
+        free_bitmap(bmp);
+        return NULL;
+    }
+    memcpy(out, bmp->header, bmp->headerSize);
+
+    BmpIO io;
+    bmp_open_memory(&io, (unsigned char *)src + bmp->headerSize, len - bmp->headerSize);
+    io.width = in_width;
+    bmp_read_image(&io, &in_image, 0, in_height);
 
     // Note: here is where we call the filter function.
-    filter(bmp);
+    filter->apply(&in_image, &out_image);
 
+    bmp_open_memory(&io, out + bmp->headerSize, *out_len - bmp->headerSize);
+    io.width = width;
+    bmp_write_image(&io, &out_image, 0, height);
+    image_free(&in_image);
+    image_free(&out_image);
     free_bitmap(bmp);
+    return out;
+}
+
+
+void stencil_border_row(const Pixel *in, Pixel *out, int width) {
+    out[0] = in[1];
+    memcpy(out + 1, in + 1, (width - 2) * sizeof(Pixel));
+    out[width - 1] = in[width - 2];
+}
+
+
+void apply_stencil(const ImageBuf *in, ImageBuf *out, row_fn row) {
+    int width = in->width, height = in->height;
+    if (width < 3 || height < 3) {
+        for (int i = 0; i < height; i++) {
+            memcpy(image_row(out, i), image_row(in, i), width * sizeof(Pixel));
+        }
+        return;
+    }
+
+    stencil_border_row(image_row(in, 1), image_row(out, 0), width);
+    for (int i = 1; i < height - 1; i++) {
+        const Pixel *rows[3] = {image_row(in, i - 1), image_row(in, i), image_row(in, i + 1)};
+        row(rows, image_row(out, i), width);
+    }
+    stencil_border_row(image_row(in, height - 2), image_row(out, height - 1), width);
+}
+
+
+/******************************************************************************
+ * Row I/O
+ *****************************************************************************/
+
+static int bmp_open(BmpIO *io, int fd, size_t end) {
+    io->fd = fd;
+    io->pos = 0;
+    io->end = end;
+    io->width = 0;
+    io->buf = NULL;
+    if ((io->ring = ring_attach(fd, end > 0)) != NULL) {
+        return 0;
+    }
+    if (posix_memalign((void **)&io->buf, 64, BMP_IO_SIZE) != 0) {
+        fprintf(stderr, "Not enough space for the I/O buffer\n");
+        io->buf = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int bmp_open_reader(BmpIO *io, int fd) {
+    return bmp_open(io, fd, 0);
+}
+
+int bmp_open_writer(BmpIO *io, int fd) {
+    return bmp_open(io, fd, BMP_IO_SIZE);
+}
+
+void bmp_open_memory(BmpIO *io, unsigned char *buf, size_t len) {
+    io->fd = -1;
+    io->ring = NULL;
+    io->buf = buf;
+    io->pos = 0;
+    io->end = len;
+    io->width = 0;
+}
+
+void bmp_close(BmpIO *io) {
+    if (io->ring != NULL) {
+        ring_detach(io->ring);
+    } else if (io->fd >= 0) {
+        free(io->buf);
+    }
+}
+
+/*
+ * Read len bytes into dst, or skip them if dst is NULL. The buffer is
+ * refilled with whatever the input has ready, so nothing past what is
+ * asked for is waited for; reads of a buffer or more go straight to dst.
+ */
+static int read_bytes(BmpIO *io, unsigned char *dst, size_t len) {
+    if (io->ring != NULL) {
+        return ring_read(io->ring, dst, len);
+    }
+    while (len > 0) {
+        if (io->pos == io->end && io->fd >= 0 && dst != NULL && len >= BMP_IO_SIZE) {
+            ssize_t n = read(io->fd, dst, len);
+            if (n > 0) {
+                dst += n;
+                len -= n;
+            } else if (n == 0 || errno != EINTR) {
+                fprintf(stderr, "Failed to read the image: it ends early\n");
+                return -1;
+            }
+            continue;
+        }
+        if (io->pos == io->end) {
+            ssize_t n = -1;
+            if (io->fd >= 0) {
+                do {
+                    n = read(io->fd, io->buf, BMP_IO_SIZE);
+                } while (n < 0 && errno == EINTR);
+            }
+            if (n <= 0) {
+                fprintf(stderr, "Failed to read the image: it ends early\n");
+                return -1;
+            }
+            io->pos = 0;
+            io->end = n;
+        }
+        size_t n = min(len, io->end - io->pos);
+        if (dst != NULL) {
+            memcpy(dst, io->buf + io->pos, n);
+            dst += n;
+        }
+        io->pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int bmp_flush(BmpIO *io) {
+    size_t done = 0;
+    while (io->fd >= 0 && done < io->pos) {
+        ssize_t n = write(io->fd, io->buf + done, io->pos - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("Failed to write the image");
+            return -1;
+        }
+        done += n;
+    }
+    if (io->fd >= 0) {
+        io->pos = 0;
+    }
+    return 0;
+}
+
+// Write len bytes from src, or zeros if src is NULL. Writes of a buffer
+// or more go straight out once the buffer is flushed.
+static int write_bytes(BmpIO *io, const unsigned char *src, size_t len) {
+    if (io->ring != NULL) {
+        return ring_write(io->ring, src, len);
+    }
+    if (io->fd >= 0 && src != NULL && len >= BMP_IO_SIZE) {
+        if (bmp_flush(io) < 0) {
+            return -1;
+        }
+        while (len > 0) {
+            ssize_t n = write(io->fd, src, len);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                perror("Failed to write the image");
+                return -1;
+            }
+            src += n;
+            len -= n;
+        }
+        return 0;
+    }
+    while (len > 0) {
+        if (io->pos == io->end) {
+            if (io->fd < 0) {
+                fprintf(stderr, "The image doesn't fit its buffer\n");
+                return -1;
+            }
+            if (bmp_flush(io) < 0) {
+                return -1;
+            }
+        }
+        size_t n = min(len, io->end - io->pos);
+        if (src != NULL) {
+            memcpy(io->buf + io->pos, src, n);
+            src += n;
+        } else {
+            memset(io->buf + io->pos, 0, n);
+        }
+        io->pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int bmp_read(BmpIO *io, void *dst, size_t len) {
+    return read_bytes(io, dst, len);
+}
+
+int bmp_write(BmpIO *io, const void *src, size_t len) {
+    return write_bytes(io, src, len);
+}
+
+int bmp_read_rows(BmpIO *io, Pixel *dst, int n) {
+    size_t row_size = io->width * sizeof(Pixel);
+    size_t padding = BMP_ROW_SIZE(io->width) - row_size;
+    if (padding == 0) {
+        return read_bytes(io, (unsigned char *)dst, row_size * n);
+    }
+    for (int i = 0; i < n; i++) {
+        if (read_bytes(io, (unsigned char *)(dst + (size_t)i * io->width), row_size) < 0 ||
+                read_bytes(io, NULL, padding) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int bmp_write_rows(BmpIO *io, const Pixel *src, int n) {
+    size_t row_size = io->width * sizeof(Pixel);
+    size_t padding = BMP_ROW_SIZE(io->width) - row_size;
+    if (padding == 0) {
+        return write_bytes(io, (const unsigned char *)src, row_size * n);
+    }
+    for (int i = 0; i < n; i++) {
+        if (write_bytes(io, (const unsigned char *)(src + (size_t)i * io->width), row_size) < 0 ||
+                write_bytes(io, NULL, padding) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// When the rows of the image are as long as those of the file (and so
+// have no padding), they are all read or written at once.
+int bmp_read_image(BmpIO *io, ImageBuf *image, int first, int n) {
+    if (image->stride == io->width * sizeof(Pixel)) {
+        return read_bytes(io, (unsigned char *)image_row(image, first), image->stride * n);
+    }
+    for (int i = first; i < first + n; i++) {
+        if (bmp_read_rows(io, image_row(image, i), 1) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int bmp_write_image(BmpIO *io, const ImageBuf *image, int first, int n) {
+    if (image->stride == io->width * sizeof(Pixel)) {
+        return write_bytes(io, (const unsigned char *)image_row(image, first), image->stride * n);
+    }
+    for (int i = first; i < first + n; i++) {
+        if (bmp_write_rows(io, image_row(image, i), 1) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+Bitmap *read_bitmap_header(BmpIO *in, const ChainStep *steps, int num_steps) {
+    unsigned char start[BMP_HEIGHT_OFFSET + sizeof(int)];
+    int header_size;
+    if (bmp_read(in, start, sizeof(start)) < 0) {
+        return NULL;
+    }
+    memcpy(&header_size, start + BMP_HEADER_SIZE_OFFSET, sizeof(header_size));
+    if (header_size < (int)sizeof(start)) {
+        fprintf(stderr, "Failed to read the complete header\n");
+        return NULL;
+    }
+    unsigned char *header = malloc(header_size);
+    if (header == NULL) {
+        fprintf(stderr, "Not enough space for header\n");
+        return NULL;
+    }
+    memcpy(header, start, sizeof(start));
+    Bitmap *bmp = NULL;
+    if (bmp_read(in, header + sizeof(start), header_size - sizeof(start)) == 0 &&
+            (bmp = parse_header(header, header_size)) != NULL) {
+        bmp = check_bitmap(bmp, SIZE_MAX, steps, num_steps);
+    }
+    free(header);
+    return bmp;
+}
+
+
+int run_filter(const Filter *filter, Scale scale) {
+    ChainStep step = {filter, scale};
+    return pipe_chain(&step, 1, STDIN_FILENO, STDOUT_FILENO, filter_threads);
 }
 
 
@@ -1,12 +1,17 @@
 #ifndef BITMAP_H_
 #define BITMAP_H_
 
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
 // Use the following offsets to index into the `header`
 // field of the Bitmap struct.
 #define BMP_FILE_SIZE_OFFSET 2
 #define BMP_HEADER_SIZE_OFFSET 10
 #define BMP_WIDTH_OFFSET 18
 #define BMP_HEIGHT_OFFSET 22
+#define BMP_IMAGE_SIZE_OFFSET 34
 
 typedef struct {
     unsigned char blue;
@@ -19,18 +24,551 @@ typedef struct {
     unsigned char *header;   // The contents of the image header.
     int width;               // The width of the image, in pixels.
     int height;              // The height of the image, in pixels.
-    int scaleFactor;         // The scale factor for the image.
+    int topDown;             // 1 if the rows are stored top row first (the
+                             // header's height is negative), else 0.
+    int inWidth;             // The size of the image the filters read:
+    int inHeight;            // different from width and height for the
+                             // filters that resize it.
 } Bitmap;
 
+// The size of a row of width pixels in a bitmap file: each row is padded
+// to a multiple of 4 bytes.
+#define BMP_ROW_SIZE(width) (((size_t)(width) * sizeof(Pixel) + 3) & ~(size_t)3)
+
+
+/*
+ * Image buffers
+ * -------------
+ *
+ * An image (or some rows of one) in a single allocation aligned to
+ * IMAGE_ALIGN bytes, with each row starting stride bytes after the one
+ * before it. The stride is a multiple of IMAGE_ALIGN, so every row starts
+ * on a cache line. An interleaved image stores each row as Pixels; a
+ * planar one stores three planes of height rows of bytes, the blue, green
+ * and red channels, one after another.
+ */
+#define IMAGE_ALIGN 64
+
+enum image_layout {
+    IMAGE_INTERLEAVED,
+    IMAGE_PLANAR,
+};
+
+typedef struct {
+    unsigned char *data;
+    int width, height;
+    size_t stride;
+    enum image_layout layout;
+} ImageBuf;
+
+/*
+ * Allocate an image of the given size and layout (its pixels aren't
+ * set). Return -1 if memory runs out. Free it with image_free, which
+ * does nothing for an image whose allocation failed.
+ */
+int image_alloc(ImageBuf *image, int width, int height, enum image_layout layout);
+void image_free(ImageBuf *image);
+
+// Row y of an interleaved image, or of plane c of a planar one.
+static inline Pixel *image_row(const ImageBuf *image, int y) {
+    return (Pixel *)(image->data + (size_t)y * image->stride);
+}
+
+static inline unsigned char *image_plane_row(const ImageBuf *image, int c, int y) {
+    return image->data + ((size_t)c * image->height + y) * image->stride;
+}
+
+/*
+ * Copy the pixels of in to out, an image of the same size, converting
+ * them to the layout of out.
+ */
+void image_convert(const ImageBuf *in, ImageBuf *out);
+
+/*
+ * A filter kernel. It writes the pixels of the image out, computed from
+ * the pixels of the input image in, both interleaved. Rows are in the
+ * order of the file. (Every filter gives the same result on an image
+ * turned upside down, so the kernels don't need to know the order.) The
+ * two are the same size, except for the filters that resize the image.
+ */
+typedef void (*filter_fn)(const ImageBuf *in, ImageBuf *out);
+
+// How a filter computes its output, for running it a row at a time.
+enum filter_kind {
+    FILTER_POINT,    // Each pixel depends only on the same input pixel.
+    FILTER_STENCIL,  // Each pixel depends on the 3-by-3 grid around it.
+    FILTER_SCALE,    // The image is resampled to a new size.
+};
+
+// How a filter that resizes the image computes each output pixel from
+// the input pixels around it (see scale.c).
+enum resample_mode {
+    RESAMPLE_BOX,       // Nearest neighbour when enlarging, the average of
+                        // the pixels it covers when shrinking.
+    RESAMPLE_BILINEAR,  // A triangle filter, widened when shrinking.
+    RESAMPLE_LANCZOS,   // A Lanczos-3 filter, widened when shrinking.
+};
+
+/*
+ * A row kernel. For a point filter, it maps the row in[1] to out, which
+ * may be the same row. For a stencil filter, it computes an interior row
+ * of the image (neither the first nor the last) from the rows below it,
+ * itself and above it, in[0..2]; the first and last pixels of the row
+ * take the value of their inner neighbour. Scaling has no row kernel.
+ */
+typedef void (*row_fn)(const Pixel *in[3], Pixel *out, int width);
+
+/*
+ * An entry in the filter registry: the filter's name (as used by the
+ * image-filter route and by its program), its kernel, the scale factor
+ * it applies by default (1 for filters that don't resize the image),
+ * how to run it a row at a time, and for a filter that resizes the
+ * image, how it resamples it.
+ */
+typedef struct {
+    const char *name;
+    filter_fn apply;
+    int scale_factor;
+    enum filter_kind kind;
+    row_fn row;
+    enum resample_mode resample;
+} Filter;
+
+/*
+ * A scale factor, num / den. An image is scaled to scaled_size of its
+ * width and height, rounded to the nearest pixel.
+ */
+typedef struct {
+    int num, den;
+} Scale;
+
+/*
+ * Parse a scale factor: a whole number, a fraction ("3/4") or a decimal
+ * ("0.25"), in lowest terms in scale. Return -1 if it isn't one, or
+ * isn't positive.
+ */
+int parse_scale(const char *arg, Scale *scale);
+
+/*
+ * Return size scaled by scale, at least 1, or -1 if it doesn't fit in
+ * an int.
+ */
+int scaled_size(int size, Scale scale);
+
+// The most steps in a filter chain.
+#define MAX_CHAIN 16
+
+// A step of a filter chain: a filter, and the scale factor it applies.
+typedef struct {
+    const Filter *filter;
+    Scale scale;
+} ChainStep;
+
+/*
+ * Return the filter with the given name, or NULL if there is none.
+ */
+const Filter *find_filter(const char *name);
 
 /*
- * The "main" function.
+ * Apply a filter to the bitmap file in src[0, len), scaling it by scale
+ * (see Filter). Return the resulting bitmap file in a malloc'd buffer
+ * and store its size in out_len, or return NULL if src isn't a complete
+ * bitmap or memory runs out.
+ */
+unsigned char *apply_filter(const Filter *filter, Scale scale,
+                            const unsigned char *src, size_t len,
+                            size_t *out_len);
+
+/*
+ * Parse a filter chain of the form "name[:factor],name[:factor],...", for
+ * example "gaussian_blur,greyscale,scale:2" or "lanczos:1/4", into steps
+ * (of MAX_CHAIN entries). Only filters that resize the image take a
+ * factor (see parse_scale); without one, a filter applies its default.
+ * Return the number of steps, or -1 if the chain is empty, too long, or
+ * names an unknown filter.
+ */
+int parse_chain(const char *spec, ChainStep *steps);
+
+/*
+ * Write the canonical form of a chain of num_steps filters to buf (of
+ * size bytes): steps that leave the image as it is (copy, scale:1) are
+ * dropped and consecutive whole-number scale steps are merged, so chains
+ * that give the same result have the same form. Return its length, or -1
+ * if it doesn't fit.
+ */
+int format_chain(const ChainStep *steps, int num_steps, char *buf, size_t size);
+
+/*
+ * Write a single step to buf (of size bytes) as parse_chain reads it
+ * ("gaussian_blur", "scale:2", "lanczos:1/4"). Return its length, or -1
+ * if it doesn't fit.
+ */
+int format_step(const ChainStep *step, char *buf, size_t size);
+
+/*
+ * Chain planning
+ * --------------
  *
- * Run a given filter function, and apply a scale factor if necessary.
- * You don't need to modify this function to make it work with any of
- * the filters for this assignment.
+ * plan_chain rewrites a chain into one that costs less to run, with
+ * rules that each either give exactly the same image, or change no
+ * channel of it by more than the rule's tolerance (see plan.c). It drops
+ * steps that leave the image as it is (copy, scale:1, a second greyscale,
+ * an invert undoing an invert), multiplies out whole-number
+ * nearest-neighbour scalings, and moves point filters to whichever side
+ * of a scaling has fewer pixels. A rule with a tolerance is only used if
+ * the tolerances of the rules used add up to no more than the one asked
+ * for, and the filters after it can't widen the difference. Each rule
+ * used is noted in the plan, for explain_plan.
+ */
+#define MAX_PLAN_NOTES 32
+
+typedef struct {
+    const char *rule;    // The rule's name.
+    int tolerance;       // What it can change a channel by; 0 if exact.
+    char change[96];     // The steps it replaced, and with what.
+} PlanNote;
+
+typedef struct {
+    ChainStep steps[MAX_CHAIN];
+    int num_steps;
+    int error;           // The most a channel of its output can differ
+                         // from the chain's: 0 if they are the same.
+    PlanNote notes[MAX_PLAN_NOTES];
+    int num_notes;       // The rules used (the first MAX_PLAN_NOTES).
+} Plan;
+
+/*
+ * Plan a chain of num_steps filters, with the given tolerance (0 for
+ * the same image exactly). The plan has at least one step (copy, if
+ * nothing else is left). Return its number of steps.
+ */
+int plan_chain(const ChainStep *steps, int num_steps, int tolerance, Plan *plan);
+
+/*
+ * Return an estimate of the time, in seconds, a chain takes on an image
+ * of the given size as a single pass (see apply_chain) on one thread.
+ */
+double chain_cost(const ChainStep *steps, int num_steps, int width, int height);
+
+/*
+ * Print the chain, the rules the plan used on it, and the plan, with the
+ * estimated cost of each step and of the whole chain before and after,
+ * for an image of the given size.
+ */
+void explain_plan(FILE *out, const ChainStep *steps, int num_steps, const Plan *plan,
+                  int width, int height);
+
+/*
+ * Apply a chain of num_steps filters to the bitmap file in src[0, len),
+ * as a single pass: rows are pulled through the chain one at a time,
+ * with point filters applied in place to the rows of the step before
+ * them, so no intermediate image is stored. The result is the same as
+ * applying the filters one after another with apply_filter. It runs on
+ * filter_threads threads. Return it in a malloc'd buffer and store its
+ * size in out_len, or return NULL as apply_filter does.
+ */
+unsigned char *apply_chain(const ChainStep *steps, int num_steps,
+                           const unsigned char *src, size_t len,
+                           size_t *out_len);
+
+/*
+ * Where stream_chain sends its result: first the header, then the rows
+ * of pixels in order, in calls of len bytes. Return -1 to stop the chain.
+ */
+typedef int (*output_fn)(void *arg, const void *data, size_t len);
+
+/*
+ * Apply a chain as apply_chain does, but pass the result to output as it
+ * is produced rather than storing it, running it on the given number of
+ * threads (see run_parallel). The size of the whole result is stored in
+ * out_len before output is first called. Return 0, or -1 if src isn't a
+ * valid bitmap (out_len is then left as it is), memory runs out, or
+ * output returns -1.
+ */
+int stream_chain(const ChainStep *steps, int num_steps,
+                 const unsigned char *src, size_t len, size_t *out_len,
+                 int threads, output_fn output, void *arg);
+
+/*
+ * Apply a chain to the bitmap file read from in_fd, and write the result
+ * to out_fd. Only the rows the chain needs at a time are kept (three per
+ * stencil filter), so memory use grows with the width of the image, not
+ * its size, and each output row is written (through the BmpIO buffer) as
+ * soon as the input rows it depends on have been read. The input is read
+ * no further than the end of the pixels. If in_fd is a regular file, it
+ * is mapped read-only instead and run with stream_chain, which reads the
+ * rows in the file's pages without a read call or a copy; its offset is
+ * then moved to the end of the pixels, as if they had been read. Return
+ * 0, or -1 on failure, after printing an error message.
+ */
+int pipe_chain(const ChainStep *steps, int num_steps, int in_fd, int out_fd,
+               int threads);
+
+/*
+ * Band-parallel execution
+ * -----------------------
+ *
+ * With more than one thread, stream_chain and pipe_chain split the
+ * output into horizontal bands of about BAND_PIXELS pixels, and run the
+ * whole chain on a round of bands at a time, one band per thread, each
+ * with its own rows. A band starts from the input rows it needs, one more
+ * row on either side (a halo) for each stencil filter, so the bands
+ * don't depend on one another. Each round's bands are output in order.
+ */
+#define BAND_PIXELS (1 << 18)
+
+// The most threads a chain can run on.
+#define MAX_FILTER_THREADS 64
+
+/*
+ * The number of threads chains run on unless they are asked for
+ * another: 1, or the FILTER_THREADS environment variable.
+ */
+extern int filter_threads;
+
+/*
+ * Run task(arg, i) for each i in [0, n), on up to the given number of
+ * threads: the calling thread, and threads of a pool started as they
+ * are needed. Return when every task is done.
+ */
+typedef void (*task_fn)(void *arg, int i);
+void run_parallel(int threads, int n, task_fn task, void *arg);
+
+/*
+ * Parse and check the header of the bitmap file in src[0, len) for a
+ * chain of num_steps filters, and return it, already updated for the
+ * scaling they do. Return NULL if src isn't a complete bitmap, or the
+ * image would be too large at some step. Free it with free_bitmap.
+ */
+Bitmap *prepare_bitmap(const unsigned char *src, size_t len,
+                       const ChainStep *steps, int num_steps);
+void free_bitmap(Bitmap *bmp);
+
+/*
+ * Return the size of the bitmap file whose header is at the start of
+ * src[0, len): its header and pixels, which is also the size of the copy
+ * filter's output. Return 0 if src doesn't hold a valid header.
+ */
+size_t bitmap_size(const unsigned char *src, size_t len);
+
+/*
+ * Shared-memory rings
+ * -------------------
+ *
+ * A ring connects two processes as a pipe does, through a memfd holding a
+ * header and RING_SIZE bytes of data, which one side writes and the other
+ * reads: each byte is copied once on either side, rather than through the
+ * kernel, and neither side makes a system call unless the ring is full or
+ * empty and it has to wait. It then sleeps on a futex, which the other
+ * side wakes. Each side notices if the other exits without closing its
+ * end. image_filter connects its stages with rings; a BmpIO opened on a
+ * ring's fd reads or writes it.
+ */
+#define RING_SIZE (1024 * 1024)  // A power of two.
+
+typedef struct ring Ring;
+
+/*
+ * Create a ring, and return its fd, or -1. Once the processes that write
+ * and read it have started, pass their pids to ring_set_pids.
+ */
+int ring_create(void);
+int ring_set_pids(int fd, pid_t writer, pid_t reader);
+
+// Whether fd is a ring's.
+int is_ring(int fd);
+
+/*
+ * Map the ring fd is open on, to write it or to read it, or return NULL
+ * if it isn't a ring or can't be mapped. Reads and writes wait until
+ * they are done, and return -1 if the other side has closed the ring (or
+ * exited) first; a NULL src writes zeros, and a NULL dst skips bytes.
+ * Each write is passed on to the reader as soon as it is done. Closing
+ * the writing end ends the data, as closing a pipe does.
+ */
+Ring *ring_attach(int fd, int writer);
+int ring_read(Ring *ring, void *dst, size_t len);
+int ring_write(Ring *ring, const void *src, size_t len);
+void ring_detach(Ring *ring);
+
+/*
+ * Row I/O: read or write the rows of a bitmap file in the order the file
+ * stores them, turning the padded rows of the file into tightly packed
+ * Pixel arrays and back. A BmpIO works on a file descriptor, through a
+ * buffer of BMP_IO_SIZE bytes, directly on a ring if the descriptor is a
+ * ring's, or directly on a buffer in memory.
+ */
+#define BMP_IO_SIZE (256 * 1024)
+
+typedef struct {
+    int fd;                  // -1 for a buffer in memory.
+    Ring *ring;              // The ring fd is open on, if it is one.
+    unsigned char *buf;
+    size_t pos;              // The next byte of buf to read or write.
+    size_t end;              // The end of the bytes to read, or of the
+                             // space to write to.
+    int width;               // The width of the rows, in pixels. Set it
+                             // before reading or writing rows.
+} BmpIO;
+
+/*
+ * Start reading from or writing to fd, or working on the len bytes at
+ * buf. Return -1 if memory runs out.
+ */
+int bmp_open_reader(BmpIO *io, int fd);
+int bmp_open_writer(BmpIO *io, int fd);
+void bmp_open_memory(BmpIO *io, unsigned char *buf, size_t len);
+
+/*
+ * Read or write len bytes (such as the header), or n rows. Return 0, or
+ * -1 if the input ends or the output fails, after printing an error.
+ */
+int bmp_read(BmpIO *io, void *dst, size_t len);
+int bmp_write(BmpIO *io, const void *src, size_t len);
+int bmp_read_rows(BmpIO *io, Pixel *dst, int n);
+int bmp_write_rows(BmpIO *io, const Pixel *src, int n);
+
+/*
+ * Read or write the rows [first, first + n) of an interleaved image.
+ */
+int bmp_read_image(BmpIO *io, ImageBuf *image, int first, int n);
+int bmp_write_image(BmpIO *io, const ImageBuf *image, int first, int n);
+
+/*
+ * Write out what is left in a writer's buffer. Return 0, or -1 if the
+ * output fails.
+ */
+int bmp_flush(BmpIO *io);
+void bmp_close(BmpIO *io);
+
+/*
+ * Read the header of a bitmap file from in, and prepare it as
+ * prepare_bitmap does; the rows are checked as they are read.
+ */
+Bitmap *read_bitmap_header(BmpIO *in, const ChainStep *steps, int num_steps);
+
+/*
+ * The "main" function of the filter programs.
+ *
+ * Read a bitmap from stdin, apply the given filter with the given scale
+ * factor, and write the result to stdout, a few rows at a time (see
+ * pipe_chain), on filter_threads threads. Return 0 on success, or -1 on
+ * failure, after printing an error message.
+ */
+int run_filter(const Filter *filter, Scale scale);
+
+// The filter kernels.
+void copy_filter(const ImageBuf *in, ImageBuf *out);
+void greyscale_filter(const ImageBuf *in, ImageBuf *out);
+void luma_filter(const ImageBuf *in, ImageBuf *out);
+void threshold_filter(const ImageBuf *in, ImageBuf *out);
+void invert_filter(const ImageBuf *in, ImageBuf *out);
+void brightness_filter(const ImageBuf *in, ImageBuf *out);
+void contrast_filter(const ImageBuf *in, ImageBuf *out);
+void gamma_filter(const ImageBuf *in, ImageBuf *out);
+void gaussian_blur_filter(const ImageBuf *in, ImageBuf *out);
+void edge_detection_filter(const ImageBuf *in, ImageBuf *out);
+void scale_filter(const ImageBuf *in, ImageBuf *out);
+void bilinear_filter(const ImageBuf *in, ImageBuf *out);
+void lanczos_filter(const ImageBuf *in, ImageBuf *out);
+
+// The row kernels.
+void copy_row(const Pixel *in[3], Pixel *out, int width);
+void greyscale_row(const Pixel *in[3], Pixel *out, int width);
+void luma_row(const Pixel *in[3], Pixel *out, int width);
+void threshold_row(const Pixel *in[3], Pixel *out, int width);
+void invert_row(const Pixel *in[3], Pixel *out, int width);
+void brightness_row(const Pixel *in[3], Pixel *out, int width);
+void contrast_row(const Pixel *in[3], Pixel *out, int width);
+void gamma_row(const Pixel *in[3], Pixel *out, int width);
+void gaussian_blur_row(const Pixel *in[3], Pixel *out, int width);
+void edge_detection_row(const Pixel *in[3], Pixel *out, int width);
+
+/*
+ * Apply a point filter, given its row kernel, to a whole image.
+ */
+void apply_point(const ImageBuf *in, ImageBuf *out, row_fn row);
+
+/*
+ * The point-operation engine (point.c), which the point filters are
+ * built on. mix_row gives every channel of each pixel the same value,
+ * computed from all three of its channels. tone_row maps every channel v
+ * to (v * gain + bias) / 128, rounded down and clamped to [0, 255]; gain
+ * and bias must fit in a short. map_row maps every channel through a
+ * table. Each may work in place (out == in).
+ */
+enum pixel_mix {
+    MIX_AVERAGE,     // The mean of the channels, rounded down.
+    MIX_LUMA,        // The Rec. 709 luminance, in 8.8 fixed point.
+    MIX_THRESHOLD,   // White if the luminance is at least 128, else black.
+};
+
+void mix_row(enum pixel_mix mix, const Pixel *in, Pixel *out, int width);
+void tone_row(int gain, int bias, const Pixel *in, Pixel *out, int width);
+void map_row(const unsigned char table[256], const Pixel *in, Pixel *out, int width);
+
+// Split a row of pixels into a row of each channel, or put them back.
+void deinterleave_row(const Pixel *in, unsigned char *blue, unsigned char *green,
+                      unsigned char *red, int width);
+void interleave_row(const unsigned char *blue, const unsigned char *green,
+                    const unsigned char *red, Pixel *out, int width);
+
+/*
+ * The resampling engine (scale.c), which the filters that resize the
+ * image are built on. Resampling is separable: an image is scaled along
+ * its rows, and then its columns, with the same weight table for every
+ * row (or column). Each output pixel is computed from taps consecutive
+ * input pixels, from first[i] on for pixel i, with the weights
+ * weights[i * taps, (i + 1) * taps), which add up to 1 << RESAMPLE_BITS
+ * (some are 0 if it needs fewer than taps). With one tap, the scaling is
+ * nearest neighbour.
+ */
+#define RESAMPLE_BITS 14
+
+typedef struct {
+    int taps;
+    int *first;
+    short *weights;
+} ResampleAxis;
+
+/*
+ * Make the table for resampling in_size pixels to out_size ones. Return
+ * -1 if memory runs out.
+ */
+int resample_axis(ResampleAxis *axis, enum resample_mode mode, int in_size, int out_size);
+void free_resample_axis(ResampleAxis *axis);
+
+/*
+ * Resample the row in to the row out, of the axis's output width. Or
+ * compute row i of a column resampling: pixel j of out (of width pixels)
+ * from pixel j of each of the taps input rows it needs, where input row r
+ * is row r % axis->taps of the image rows.
+ */
+void resample_row(const ResampleAxis *axis, const Pixel *in, Pixel *out, int out_width);
+void resample_column(const ResampleAxis *axis, int i, const ImageBuf *rows, Pixel *out,
+                     int width);
+
+/*
+ * Apply a stencil filter, given its row kernel, to a whole image. The
+ * first and last rows take the values of the row next to them (with
+ * their first and last pixels taking the value of their inner
+ * neighbour); an image with no interior pixels is copied.
+ */
+void apply_stencil(const ImageBuf *in, ImageBuf *out, row_fn row);
+
+// Write the first or last row of a stencil filter's output, from the
+// input row next to it.
+void stencil_border_row(const Pixel *in, Pixel *out, int width);
+
+/*
+ * The vector instructions the row kernels use, chosen when the program
+ * starts: the widest ones the CPU supports (found with CPUID), or
+ * narrower ones if the FILTER_SIMD environment variable asks for them
+ * ("none", "sse2", "ssse3" or "avx2"). Every level gives the same output;
+ * a kernel without a version for a level uses the next one down.
  */
-void run_filter(void (*filter)(Bitmap *), int scale_factor);
+enum simd_level {SIMD_NONE, SIMD_SSE2, SIMD_SSSE3, SIMD_AVX2};
+extern enum simd_level simd_level;
 
 // Macros and functions for performing the two multi-row filters.
 #define max(a,b) ((a) > (b) ? (a) : (b))
@@ -53,8 +591,7 @@ void run_filter(void (*filter)(Bitmap *), int scale_factor);
  * You aren't responsible for the calculations themselves, only for calling
  * these functions properly on pointers representing the 3-by-3 grids.
  *
- * Note that these functions should be called *once per pixel in the image*;
- * the returned Pixel values can be immediately written to stdout.
+ * Note that these functions should be called *once per pixel in the image*.
  */
 Pixel apply_gaussian_kernel(Pixel *row0, Pixel *row1, Pixel *row2);
 Pixel apply_edge_detection_kernel(Pixel *row0, Pixel *row1, Pixel *row2);
@@ -0,0 +1,698 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bitmap.h"
+
+
+/*
+ * A stage of a fused chain: the source image, or a stencil or scale step,
+ * followed by the point filters after it in the chain, which are applied
+ * in place to each row the stage produces. Rows are pulled through the
+ * stages one at a time, and a stage keeps only the input rows its next
+ * output row needs.
+ */
+typedef struct {
+    enum filter_kind kind;     // FILTER_POINT for the source.
+    row_fn row;
+    ResampleAxis cols, rows;   // Scale: how it resamples along the rows,
+                               // and down the columns.
+    int nearest;               // Scale: 1 if both are nearest neighbour.
+    row_fn points[MAX_CHAIN];  // The point filters after the step.
+    int num_points;
+    int width, height;         // The size of the stage's output.
+    int next;                  // The next output row.
+    int fetched;               // The next input row to pull from the stage
+                               // before.
+    ImageBuf ring;             // The rows the stage keeps, then its
+    int num_ring;              // output row. Stencil: input row r is ring
+                               // row r % 3. Scale: input row r, resampled
+                               // along the row, is ring row r % rows.taps;
+                               // for nearest neighbour, ring row 0 holds
+                               // the input row.
+    Pixel *out;                // The output row, ring row num_ring.
+} Stage;
+
+typedef struct {
+    const unsigned char *pixels;  // The rows of the source image from row
+    int base;                     // base on, each stride bytes long (with
+    size_t stride;                // any padding).
+    BmpIO *in;                    // Or the file they are read from.
+    Stage stages[MAX_CHAIN + 1];
+    int num_stages;
+} Chain;
+
+
+int parse_scale(const char *arg, Scale *scale) {
+    // The digits before and after any decimal point or slash.
+    long long num = 0, den = 1;
+    const char *p = arg;
+    for (; *p >= '0' && *p <= '9' && num <= INT_MAX; p++) {
+        num = num * 10 + *p - '0';
+    }
+    if (p == arg) {
+        return -1;
+    }
+    if (*p == '.') {
+        for (p++; *p >= '0' && *p <= '9' && num <= INT_MAX && den <= INT_MAX; p++) {
+            num = num * 10 + *p - '0';
+            den *= 10;
+        }
+    } else if (*p == '/' && p[1] != '\0') {
+        for (den = 0, p++; *p >= '0' && *p <= '9' && den <= INT_MAX; p++) {
+            den = den * 10 + *p - '0';
+        }
+    }
+    if (*p != '\0' || num < 1 || den < 1) {
+        return -1;
+    }
+
+    long long a = num, b = den;
+    while (b != 0) {
+        long long r = a % b;
+        a = b;
+        b = r;
+    }
+    if (num / a > INT_MAX || den / a > INT_MAX) {
+        return -1;
+    }
+    scale->num = num / a;
+    scale->den = den / a;
+    return 0;
+}
+
+
+int parse_chain(const char *spec, ChainStep *steps) {
+    int n = 0;
+    while (1) {
+        const char *end = strchr(spec, ',');
+        int len = end ? end - spec : strlen(spec);
+        char name[32];
+        if (n == MAX_CHAIN || len == 0 || len >= sizeof(name)) {
+            return -1;
+        }
+        memcpy(name, spec, len);
+        name[len] = '\0';
+
+        char *arg = strchr(name, ':');
+        if (arg != NULL) {
+            *arg++ = '\0';
+        }
+        const Filter *filter = find_filter(name);
+        if (filter == NULL) {
+            return -1;
+        }
+        steps[n].filter = filter;
+        steps[n].scale = (Scale){filter->scale_factor, 1};
+        if (arg != NULL && (filter->kind != FILTER_SCALE ||
+                            parse_scale(arg, &steps[n].scale) < 0)) {
+            return -1;
+        }
+        n++;
+
+        if (end == NULL) {
+            return n;
+        }
+        spec = end + 1;
+    }
+}
+
+
+int format_step(const ChainStep *step, char *buf, size_t size) {
+    int n;
+    if (step->filter->kind == FILTER_SCALE && step->scale.den == 1) {
+        n = snprintf(buf, size, "%s:%d", step->filter->name, step->scale.num);
+    } else if (step->filter->kind == FILTER_SCALE) {
+        n = snprintf(buf, size, "%s:%d/%d", step->filter->name, step->scale.num,
+                     step->scale.den);
+    } else {
+        n = snprintf(buf, size, "%s", step->filter->name);
+    }
+    return n < size ? n : -1;
+}
+
+int format_chain(const ChainStep *steps, int num_steps, char *buf, size_t size) {
+    int len = 0;
+    for (int s = 0; s < num_steps; s++) {
+        const Filter *filter = steps[s].filter;
+        Scale scale = steps[s].scale;
+        if (filter->kind == FILTER_SCALE) {
+            // Whole-number nearest-neighbour scalings add up; the others
+            // round the size (and blend pixels) at each step.
+            while (filter->resample == RESAMPLE_BOX && scale.den == 1 &&
+                    s + 1 < num_steps && steps[s + 1].filter == filter &&
+                    steps[s + 1].scale.den == 1 &&
+                    steps[s + 1].scale.num <= INT_MAX / scale.num) {
+                scale.num *= steps[++s].scale.num;
+            }
+            if (scale.num == scale.den) {
+                continue;
+            }
+        } else if (filter->row == copy_row) {
+            continue;
+        }
+
+        // Without room for the comma, there is none for the step.
+        if (len > 0 && len + 1 < size) {
+            buf[len++] = ',';
+        }
+        ChainStep step = {filter, scale};
+        int n = format_step(&step, buf + len, size - len);
+        if (n < 0) {
+            return -1;
+        }
+        len += n;
+    }
+    if (len == 0) {
+        len = snprintf(buf, size, "copy");
+    }
+    return len < size ? len : -1;
+}
+
+
+static void apply_points(const Stage *stage, Pixel *row, int width) {
+    const Pixel *rows[3] = {NULL, row, NULL};
+    for (int i = 0; i < stage->num_points; i++) {
+        stage->points[i](rows, row, width);
+    }
+}
+
+/*
+ * Return the next output row of stage k. It stays valid until the next
+ * call for the same stage. Return NULL if the source can't be read.
+ */
+static const Pixel *next_row(Chain *chain, int k) {
+    Stage *stage = &chain->stages[k];
+    int width = stage->width, height = stage->height;
+    int i = stage->next++;
+    size_t row_size = width * sizeof(Pixel);
+
+    if (k == 0 && chain->in != NULL) {
+        if (bmp_read_rows(chain->in, stage->out, 1) < 0) {
+            return NULL;
+        }
+    } else if (k == 0) {
+        const Pixel *row = (const Pixel *)(chain->pixels + (size_t)(i - chain->base) *
+                                           chain->stride);
+        if (stage->num_points == 0) {
+            return row;
+        }
+        memcpy(stage->out, row, row_size);
+    } else if (stage->kind == FILTER_SCALE) {
+        // The input rows are resampled along the row as they are pulled,
+        // and then down the column. A nearest-neighbour row from the same
+        // input row as the one before it is the same row, and the point
+        // filters commute with it, so they are applied to the input.
+        const ResampleAxis *rows = &stage->rows;
+        int first = rows->first[i], in_width = chain->stages[k - 1].width;
+        if (stage->nearest && stage->fetched > first) {
+            return stage->out;
+        }
+        while (stage->fetched < first + rows->taps) {
+            const Pixel *row = next_row(chain, k - 1);
+            if (row == NULL) {
+                return NULL;
+            }
+            if (stage->fetched++ < first) {
+                continue;
+            }
+            if (stage->nearest) {
+                Pixel *input = image_row(&stage->ring, 0);
+                memcpy(input, row, in_width * sizeof(Pixel));
+                apply_points(stage, input, in_width);
+                resample_row(&stage->cols, input, stage->out, width);
+                return stage->out;
+            }
+            resample_row(&stage->cols, row,
+                         image_row(&stage->ring, (stage->fetched - 1) % rows->taps), width);
+        }
+        if (rows->taps == 1) {
+            memcpy(stage->out, image_row(&stage->ring, 0), row_size);
+        } else {
+            resample_column(rows, i, &stage->ring, stage->out, width);
+        }
+    } else if (width < 3 || height < 3) {
+        // No interior pixels: the stencil copies its input.
+        const Pixel *row = next_row(chain, k - 1);
+        if (row == NULL) {
+            return NULL;
+        }
+        memcpy(stage->out, row, row_size);
+    } else {
+        // Row i needs input rows i - 1 to i + 1, so it is ready as soon
+        // as the row after it has been pulled; the first row needs input
+        // row 1.
+        int needed = min(i + 2, height);
+        while (stage->fetched < needed) {
+            const Pixel *row = next_row(chain, k - 1);
+            if (row == NULL) {
+                return NULL;
+            }
+            memcpy(image_row(&stage->ring, stage->fetched % 3), row, row_size);
+            stage->fetched++;
+        }
+        if (i == 0 || i == height - 1) {
+            stencil_border_row(image_row(&stage->ring, (i == 0 ? 1 : height - 2) % 3),
+                               stage->out, width);
+        } else {
+            const Pixel *rows[3] = {
+                image_row(&stage->ring, (i - 1) % 3), image_row(&stage->ring, i % 3),
+                image_row(&stage->ring, (i + 1) % 3)
+            };
+            stage->row(rows, stage->out, width);
+        }
+    }
+    apply_points(stage, stage->out, width);
+    return stage->out;
+}
+
+/*
+ * Make row the next output row of the last stage, and each stage before
+ * it start from the first input row the stage after it needs. For the
+ * rows [first, last) of the last stage, store in first and last the rows
+ * of the source they need.
+ */
+static void seek_chain(Chain *chain, int *first, int *last) {
+    for (int k = chain->num_stages - 1; k > 0; k--) {
+        Stage *stage = &chain->stages[k];
+        stage->next = *first;
+        if (stage->kind == FILTER_SCALE) {
+            *last = stage->rows.first[*last - 1] + stage->rows.taps;
+            *first = stage->rows.first[*first];
+            stage->fetched = *first;
+        } else if (stage->width >= 3 && stage->height >= 3) {
+            *first = max(*first - 1, 0);
+            *last = min(*last + 1, stage->height);
+            stage->fetched = *first;
+        }
+    }
+    chain->stages[0].next = *first;
+}
+
+static void free_chain(Chain *chain) {
+    for (int k = 0; k < chain->num_stages; k++) {
+        Stage *stage = &chain->stages[k];
+        image_free(&stage->ring);
+        free_resample_axis(&stage->cols);
+        free_resample_axis(&stage->rows);
+    }
+}
+
+/*
+ * Set up the stages for the given steps, on a source image of the given
+ * size, read from in if it isn't NULL. Return -1 if memory runs out.
+ */
+static int build_chain(Chain *chain, const ChainStep *steps, int num_steps,
+                       int width, int height, BmpIO *in) {
+    memset(chain, 0, sizeof(*chain));
+    chain->in = in;
+    Stage *stage = &chain->stages[0];
+    stage->kind = FILTER_POINT;
+    stage->width = width;
+    stage->height = height;
+    chain->num_stages = 1;
+
+    for (int s = 0; s < num_steps; s++) {
+        const Filter *filter = steps[s].filter;
+        if (filter->kind == FILTER_POINT) {
+            stage->points[stage->num_points++] = filter->row;
+            continue;
+        }
+        if (filter->kind == FILTER_SCALE && steps[s].scale.num == steps[s].scale.den) {
+            continue;
+        }
+        int in_width = stage->width, in_height = stage->height;
+        stage = &chain->stages[chain->num_stages++];
+        stage->kind = filter->kind;
+        stage->row = filter->row;
+        stage->width = in_width;
+        stage->height = in_height;
+        stage->num_ring = 3;
+        if (filter->kind == FILTER_SCALE) {
+            stage->width = scaled_size(in_width, steps[s].scale);
+            stage->height = scaled_size(in_height, steps[s].scale);
+            if (resample_axis(&stage->cols, filter->resample, in_width, stage->width) < 0 ||
+                    resample_axis(&stage->rows, filter->resample, in_height,
+                                  stage->height) < 0) {
+                return -1;
+            }
+            stage->nearest = stage->cols.taps == 1 && stage->rows.taps == 1;
+            stage->num_ring = stage->rows.taps;
+        }
+    }
+
+    // The source needs an output row only to apply points or read into.
+    for (int k = 0; k < chain->num_stages; k++) {
+        stage = &chain->stages[k];
+        if (k == 0 && stage->num_points == 0 && in == NULL) {
+            continue;
+        }
+        int ring_width = stage->nearest ? max(chain->stages[k - 1].width, stage->width)
+                                        : stage->width;
+        if (image_alloc(&stage->ring, ring_width, stage->num_ring + 1, IMAGE_INTERLEAVED) < 0) {
+            return -1;
+        }
+        stage->out = image_row(&stage->ring, stage->num_ring);
+    }
+    return 0;
+}
+
+
+/*
+ * A band of a chain's output rows, and a chain of its own to compute
+ * them with, reading the source from memory.
+ */
+typedef struct {
+    Chain chain;
+    int first, last;   // The output rows [first, last).
+    ImageBuf rows;
+} Band;
+
+static void run_band(void *arg, int b) {
+    Band *band = (Band *)arg + b;
+    Chain *chain = &band->chain;
+    int first = band->first, last = band->last;
+    int width = chain->stages[chain->num_stages - 1].width;
+    seek_chain(chain, &first, &last);
+    for (int i = 0; i < band->last - band->first; i++) {
+        const Pixel *row = next_row(chain, chain->num_stages - 1);
+        memcpy(image_row(&band->rows, i), row, width * sizeof(Pixel));
+    }
+}
+
+static void free_bands(Band *bands, int num_bands) {
+    for (int b = 0; b < num_bands && bands != NULL; b++) {
+        free_chain(&bands[b].chain);
+        image_free(&bands[b].rows);
+    }
+    free(bands);
+}
+
+/*
+ * Return num_bands bands for running the steps on a source image of the
+ * given size, each with room for band_rows rows of out_width pixels, or
+ * NULL if memory runs out.
+ */
+static Band *make_bands(const ChainStep *steps, int num_steps, int width, int height,
+                        int num_bands, int band_rows, int out_width) {
+    Band *bands = calloc(num_bands, sizeof(Band));
+    for (int b = 0; b < num_bands && bands != NULL; b++) {
+        if (build_chain(&bands[b].chain, steps, num_steps, width, height, NULL) < 0 ||
+                image_alloc(&bands[b].rows, out_width, band_rows, IMAGE_INTERLEAVED) < 0) {
+            free_bands(bands, b + 1);
+            return NULL;
+        }
+    }
+    return bands;
+}
+
+/*
+ * Set up the bands of the round of output rows that starts at row first,
+ * out of height, and return how many there are.
+ */
+static int plan_round(Band *bands, int num_bands, int band_rows, int first, int height) {
+    int n = 0;
+    for (; n < num_bands && first < height; n++, first += band_rows) {
+        bands[n].first = first;
+        bands[n].last = min(first + band_rows, height);
+    }
+    return n;
+}
+
+/*
+ * Pass a row to output, copied into padded first if it isn't NULL (for
+ * rows that need padding).
+ */
+static int output_row(output_fn output, void *arg, const Pixel *row, int width,
+                      unsigned char *padded, size_t padded_size) {
+    size_t row_size = width * sizeof(Pixel);
+    if (padded == NULL) {
+        return output(arg, row, row_size);
+    }
+    memcpy(padded, row, row_size);
+    return output(arg, padded, padded_size);
+}
+
+
+int stream_chain(const ChainStep *steps, int num_steps,
+                 const unsigned char *src, size_t len, size_t *out_len,
+                 int threads, output_fn output, void *arg) {
+    Bitmap *bmp = prepare_bitmap(src, len, steps, num_steps);
+    if (bmp == NULL) {
+        return -1;
+    }
+    int width = bmp->width, height = bmp->height;
+    int in_width = bmp->inWidth, in_height = bmp->inHeight;
+    int band_rows = max(1, BAND_PIXELS / width);
+    if (height <= band_rows) {
+        threads = 1;
+    }
+
+    // Rows with padding are copied out with it, zeroed. With one thread,
+    // the chain runs a row at a time; with more, a round of bands at a
+    // time.
+    Chain chain;
+    Band *bands = NULL;
+    size_t row_size = width * sizeof(Pixel);
+    size_t padded_size = BMP_ROW_SIZE(width);
+    unsigned char *padded = NULL;
+    *out_len = bmp->headerSize + padded_size * height;
+    int built = threads > 1 ?
+        (bands = make_bands(steps, num_steps, in_width, in_height, threads, band_rows,
+                            width)) != NULL :
+        build_chain(&chain, steps, num_steps, in_width, in_height, NULL) == 0;
+    if (!built || (padded_size > row_size && (padded = calloc(1, padded_size)) == NULL)) {
+        perror("Failed to allocate memory for the image");
+        if (threads == 1) {
+            free_chain(&chain);
+        }
+        free_bands(bands, threads);
+        free_bitmap(bmp);
+        return -1;
+    }
+
+    int result = output(arg, bmp->header, bmp->headerSize);
+    if (threads == 1) {
+        chain.pixels = src + bmp->headerSize;
+        chain.stride = BMP_ROW_SIZE(in_width);
+        for (int i = 0; i < height && result == 0; i++) {
+            const Pixel *row = next_row(&chain, chain.num_stages - 1);
+            result = output_row(output, arg, row, width, padded, padded_size);
+        }
+        free_chain(&chain);
+    } else {
+        for (int b = 0; b < threads; b++) {
+            bands[b].chain.pixels = src + bmp->headerSize;
+            bands[b].chain.stride = BMP_ROW_SIZE(in_width);
+        }
+        for (int first = 0; first < height && result == 0; first += threads * band_rows) {
+            int n = plan_round(bands, threads, band_rows, first, height);
+            run_parallel(threads, n, run_band, bands);
+            for (int b = 0; b < n && result == 0; b++) {
+                for (int i = 0; i < bands[b].last - bands[b].first && result == 0; i++) {
+                    result = output_row(output, arg, image_row(&bands[b].rows, i), width,
+                                        padded, padded_size);
+                }
+            }
+        }
+        free_bands(bands, threads);
+    }
+
+    free(padded);
+    free_bitmap(bmp);
+    return result;
+}
+
+
+/*
+ * Run a chain on the file in, a round of bands at a time, writing the
+ * output to out. The source rows each round needs are read into a window,
+ * which keeps those the next round needs too.
+ */
+static int pipe_bands(const ChainStep *steps, int num_steps, BmpIO *in, BmpIO *out,
+                      int height, int in_height, int threads) {
+    int width = out->width, in_width = in->width;
+    int band_rows = max(1, BAND_PIXELS / width);
+    Band *bands = make_bands(steps, num_steps, in_width, in_height, threads, band_rows, width);
+    if (bands == NULL) {
+        perror("Failed to allocate memory for the image");
+        return -1;
+    }
+
+    ImageBuf window = {NULL};
+    int base = 0, count = 0;
+    int result = 0;
+    for (int first = 0; first < height && result == 0; first += threads * band_rows) {
+        int n = plan_round(bands, threads, band_rows, first, height);
+        int lo = first, hi = bands[n - 1].last;
+        seek_chain(&bands[0].chain, &lo, &hi);
+
+        // Drop the rows before lo, and read up to hi.
+        if (lo > base) {
+            memmove(window.data, image_row(&window, lo - base),
+                    (size_t)(base + count - lo) * window.stride);
+            count -= lo - base;
+            base = lo;
+        }
+        if (window.data == NULL || hi - base > window.height) {
+            ImageBuf bigger;
+            if (image_alloc(&bigger, in_width, hi - base, IMAGE_INTERLEAVED) < 0) {
+                perror("Failed to allocate memory for the image");
+                result = -1;
+                break;
+            }
+            if (count > 0) {
+                memcpy(bigger.data, window.data, (size_t)count * window.stride);
+            }
+            image_free(&window);
+            window = bigger;
+        }
+        if (bmp_read_image(in, &window, count, hi - base - count) < 0) {
+            result = -1;
+            break;
+        }
+        count = hi - base;
+
+        for (int b = 0; b < n; b++) {
+            bands[b].chain.pixels = window.data;
+            bands[b].chain.base = base;
+            bands[b].chain.stride = window.stride;
+        }
+        run_parallel(threads, n, run_band, bands);
+        for (int b = 0; b < n && result == 0; b++) {
+            result = bmp_write_image(out, &bands[b].rows, 0, bands[b].last - bands[b].first);
+        }
+    }
+    image_free(&window);
+    free_bands(bands, threads);
+    return result;
+}
+
+
+static int write_output(void *arg, const void *data, size_t len) {
+    return bmp_write(arg, data, len);
+}
+
+/*
+ * Run a chain on the file in_fd, from its offset on, mapped into memory.
+ * Return 1, having read nothing, if it isn't a regular file that can be
+ * mapped (or is a ring's); else 0, or -1 on failure.
+ */
+static int map_chain(const ChainStep *steps, int num_steps, int in_fd, int out_fd,
+                     int threads) {
+    struct stat st;
+    off_t offset = lseek(in_fd, 0, SEEK_CUR);
+    if (offset < 0 || fstat(in_fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+            st.st_size <= offset || is_ring(in_fd)) {
+        return 1;
+    }
+    unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                              in_fd, 0);
+    if (map == MAP_FAILED) {
+        return 1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    BmpIO out;
+    if (bmp_open_writer(&out, out_fd) < 0) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    const unsigned char *src = map + offset;
+    size_t len = st.st_size - offset, out_len;
+    int result = stream_chain(steps, num_steps, src, len, &out_len, threads,
+                              write_output, &out);
+    if (result == 0) {
+        result = bmp_flush(&out);
+        lseek(in_fd, offset + bitmap_size(src, len), SEEK_SET);
+    }
+    bmp_close(&out);
+    munmap(map, st.st_size);
+    return result;
+}
+
+int pipe_chain(const ChainStep *steps, int num_steps, int in_fd, int out_fd,
+               int threads) {
+    int mapped = map_chain(steps, num_steps, in_fd, out_fd, threads);
+    if (mapped <= 0) {
+        return mapped;
+    }
+
+    BmpIO in, out;
+    if (bmp_open_reader(&in, in_fd) < 0) {
+        return -1;
+    }
+    Bitmap *bmp = read_bitmap_header(&in, steps, num_steps);
+    if (bmp == NULL) {
+        bmp_close(&in);
+        return -1;
+    }
+    if (bmp_open_writer(&out, out_fd) < 0) {
+        free_bitmap(bmp);
+        bmp_close(&in);
+        return -1;
+    }
+    in.width = bmp->inWidth;
+    out.width = bmp->width;
+
+    Chain chain;
+    int result = bmp_write(&out, bmp->header, bmp->headerSize);
+    if (result < 0) {
+        // The header couldn't be written.
+    } else if (threads > 1 && bmp->height > max(1, BAND_PIXELS / bmp->width)) {
+        result = pipe_bands(steps, num_steps, &in, &out, bmp->height, bmp->inHeight,
+                            threads);
+    } else if (build_chain(&chain, steps, num_steps, in.width, bmp->inHeight, &in) < 0) {
+        perror("Failed to allocate memory for the image");
+        free_chain(&chain);
+        result = -1;
+    } else {
+        for (int i = 0; i < bmp->height && result == 0; i++) {
+            const Pixel *row = next_row(&chain, chain.num_stages - 1);
+            result = row != NULL ? bmp_write_rows(&out, row, 1) : -1;
+        }
+        free_chain(&chain);
+    }
+    if (result == 0) {
+        result = bmp_flush(&out);
+    }
+
+    free_bitmap(bmp);
+    bmp_close(&in);
+    bmp_close(&out);
+    return result;
+}
+
+
+// The output of apply_chain: a buffer of the whole result.
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    const size_t *size;
+} Output;
+
+static int store_output(void *arg, const void *data, size_t len) {
+    Output *out = arg;
+    if (out->data == NULL && (out->data = malloc(*out->size)) == NULL) {
+        perror("Failed to allocate memory for the image");
+        return -1;
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    return 0;
+}
+
+unsigned char *apply_chain(const ChainStep *steps, int num_steps,
+                           const unsigned char *src, size_t len,
+                           size_t *out_len) {
+    Output out = {NULL, 0, out_len};
+    if (stream_chain(steps, num_steps, src, len, out_len, filter_threads, store_output,
+                     &out) < 0) {
+        free(out.data);
+        return NULL;
+    }
+    return out.data;
+}
@@ -1,86 +1,275 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <sys/wait.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
 #include "bitmap.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+
 /*
- * Main filter loop.
- * This function is responsible for doing the following:
- *   1. Read all pixels into a 2D array.
- *   2. Process bundary pixels and Apply edge detection kernel for non-boundary pixels
- *   3. Write out 3*3 pixels at a time.
+ * The Sobel kernels are separable too: dx is [1 2 1] down the columns and
+ * [1 0 -1] along the row, and dy is [1 0 -1] down and [1 2 1] along. So
+ * the vertical pass makes two sums of the three input rows for each byte
+ * (a + 2b + c, and a - c), and the horizontal pass combines those three
+ * bytes (one pixel) apart. Every gradient is at most 4 * 255 in size, so
+ * all of this fits in 16-bit lanes.
+ *
+ * The magnitude of a channel is the floor of the square root of
+ * dx^2 + dy^2, which is at most 2 * 1020^2. That is exact in a float, and
+ * the float square root rounded towards zero is either the floor or one
+ * more than it, so one comparison of its square with the sum makes it
+ * exact. The pixel gets the largest of its three channels' magnitudes,
+ * cut to a byte (as apply_edge_detection_kernel's int to unsigned char
+ * conversion does for magnitudes over 255).
  *
+ * Each function computes the output bytes [start, end) of the row, which
+ * are whole pixels with one pixel of input on either side.
  */
+#define EDGE_CHUNK 960
 
-void edge_detection_filter(Bitmap *bmp) {
-    Pixel **rows = malloc(bmp->height * sizeof(Pixel *));
-    if (!rows) {
-        perror("Failed to allocate memory for rows");
-        return;
+typedef void (*edge_fn)(const unsigned char *in[3], unsigned char *out,
+                        int start, int end);
+
+static inline int edge_magnitude(int dx, int dy) {
+    int sum = dx * dx + dy * dy;
+    int root = sqrtf(sum);
+    return root * root > sum ? root - 1 : root;
+}
+
+static void edge_scalar(const unsigned char *in[3], unsigned char *out,
+                        int start, int end) {
+    const unsigned char *a = in[0], *b = in[1], *c = in[2];
+    for (int i = start; i < end; i += 3) {
+        int edge = 0;
+        for (int k = i; k < i + 3; k++) {
+            int dx = (a[k - 3] + 2 * b[k - 3] + c[k - 3]) - (a[k + 3] + 2 * b[k + 3] + c[k + 3]);
+            int dy = (a[k - 3] - c[k - 3]) + 2 * (a[k] - c[k]) + (a[k + 3] - c[k + 3]);
+            edge = max(edge, edge_magnitude(dx, dy));
+        }
+        memset(out + i, (unsigned char)edge, 3);
     }
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * For the vector versions, the magnitudes of a chunk's bytes go into an
+ * array with two spare entries on either side, and each output byte is
+ * the largest of the three that make up its pixel: the next three for
+ * the first byte of a pixel, the three around it for the second and the
+ * previous three for the third. Masks pick among those for each lane,
+ * and are rotated as the lanes move along by a vector's length.
+ */
+__attribute__((target("sse2")))
+static void edge_sse2(const unsigned char *in[3], unsigned char *out,
+                      int start, int end) {
+    int16_t sums[EDGE_CHUNK + 6], diffs[EDGE_CHUNK + 6];
+    uint16_t mags[EDGE_CHUNK + 4 + 16] = {0};
+    const __m128i zero = _mm_setzero_si128();
+    for (int s = start; s < end; s += EDGE_CHUNK) {
+        int n = min(EDGE_CHUNK, end - s);
 
-    for (int i = 0; i < bmp->height; i++) {
-        rows[i] = malloc(bmp->width * sizeof(Pixel));
-        if (!rows[i]) {
-            perror("Failed to allocate memory for a row");
-            for (int k = 0; k < i; k++) {
-                free(rows[k]);
+        // Vertical pass over the bytes [s - 3, s + n + 3).
+        const unsigned char *a = in[0] + s - 3, *b = in[1] + s - 3, *c = in[2] + s - 3;
+        int i = 0;
+        for (; i + 16 <= n + 6; i += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+            __m128i vc = _mm_loadu_si128((const __m128i *)(c + i));
+            for (int k = 0; k < 2; k++) {
+                __m128i wa = k ? _mm_unpackhi_epi8(va, zero) : _mm_unpacklo_epi8(va, zero);
+                __m128i wb = k ? _mm_unpackhi_epi8(vb, zero) : _mm_unpacklo_epi8(vb, zero);
+                __m128i wc = k ? _mm_unpackhi_epi8(vc, zero) : _mm_unpacklo_epi8(vc, zero);
+                _mm_storeu_si128((__m128i *)(sums + i + 8 * k),
+                                 _mm_add_epi16(_mm_add_epi16(wa, wc), _mm_slli_epi16(wb, 1)));
+                _mm_storeu_si128((__m128i *)(diffs + i + 8 * k), _mm_sub_epi16(wa, wc));
             }
-            free(rows);
-            return;
+        }
+        for (; i < n + 6; i++) {
+            sums[i] = a[i] + 2 * b[i] + c[i];
+            diffs[i] = a[i] - c[i];
         }
 
-        if (fread(rows[i], sizeof(Pixel), bmp->width, stdin) != bmp->width) {
-            perror("Failed to read pixels");
-            for (int k = 0; k <= i; k++) {
-                free(rows[k]);
+        // Horizontal pass: the magnitude of byte s + j goes in mags[j + 2].
+        int j = 0;
+        for (; j + 8 <= n; j += 8) {
+            __m128i dx = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(sums + j)),
+                                       _mm_loadu_si128((const __m128i *)(sums + j + 6)));
+            __m128i dy = _mm_add_epi16(
+                _mm_add_epi16(_mm_loadu_si128((const __m128i *)(diffs + j)),
+                              _mm_loadu_si128((const __m128i *)(diffs + j + 6))),
+                _mm_slli_epi16(_mm_loadu_si128((const __m128i *)(diffs + j + 3)), 1));
+            __m128i root[2];
+            for (int k = 0; k < 2; k++) {
+                __m128i pairs = k ? _mm_unpackhi_epi16(dx, dy) : _mm_unpacklo_epi16(dx, dy);
+                __m128i sum = _mm_madd_epi16(pairs, pairs);
+                __m128i r = _mm_cvttps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(sum)));
+                // r is below 2^16, so madd squares it.
+                r = _mm_add_epi32(r, _mm_cmpgt_epi32(_mm_madd_epi16(r, r), sum));
+                root[k] = r;
+            }
+            _mm_storeu_si128((__m128i *)(mags + j + 2), _mm_packs_epi32(root[0], root[1]));
+        }
+        for (; j < n; j++) {
+            mags[j + 2] = edge_magnitude(sums[j] - sums[j + 6],
+                                         diffs[j] + 2 * diffs[j + 3] + diffs[j + 6]);
+        }
+
+        // Pixel pass: output byte s + j is at mags[j + 2].
+        __m128i first = _mm_setr_epi16(-1, 0, 0, -1, 0, 0, -1, 0);
+        __m128i second = _mm_setr_epi16(0, -1, 0, 0, -1, 0, 0, -1);
+        __m128i third = _mm_setr_epi16(0, 0, -1, 0, 0, -1, 0, 0);
+        const __m128i low = _mm_set1_epi16(0xff);
+        for (j = 0; j < n; j += 16) {
+            __m128i edge[2];
+            for (int k = 0; k < 2; k++) {
+                const uint16_t *p = mags + j + 8 * k;
+                __m128i l2 = _mm_loadu_si128((const __m128i *)p);
+                __m128i l1 = _mm_loadu_si128((const __m128i *)(p + 1));
+                __m128i m = _mm_loadu_si128((const __m128i *)(p + 2));
+                __m128i r1 = _mm_loadu_si128((const __m128i *)(p + 3));
+                __m128i r2 = _mm_loadu_si128((const __m128i *)(p + 4));
+                __m128i left = _mm_max_epi16(l1, m), right = _mm_max_epi16(m, r1);
+                __m128i e = _mm_or_si128(
+                    _mm_or_si128(_mm_and_si128(first, _mm_max_epi16(right, r2)),
+                                 _mm_and_si128(second, _mm_max_epi16(left, r1))),
+                    _mm_and_si128(third, _mm_max_epi16(left, l2)));
+                edge[k] = _mm_and_si128(e, low);
+                // Eight lanes on, a lane's byte is two further into its pixel.
+                __m128i t = first;
+                first = second;
+                second = third;
+                third = t;
+            }
+            __m128i bytes = _mm_packus_epi16(edge[0], edge[1]);
+            if (j + 16 <= n) {
+                _mm_storeu_si128((__m128i *)(out + s + j), bytes);
+            } else {
+                unsigned char tail[16];
+                _mm_storeu_si128((__m128i *)tail, bytes);
+                memcpy(out + s + j, tail, n - j);
             }
-            free(rows);
-            return;
-        }        
+        }
     }
+}
 
-    for (int i = 0; i < bmp->height; i++) {
-        for (int j = 0; j < bmp->width; j++) {
-            Pixel new_pixel;
+__attribute__((target("avx2")))
+static void edge_avx2(const unsigned char *in[3], unsigned char *out,
+                      int start, int end) {
+    int16_t sums[EDGE_CHUNK + 6], diffs[EDGE_CHUNK + 6];
+    uint16_t mags[EDGE_CHUNK + 4 + 32] = {0};
+    for (int s = start; s < end; s += EDGE_CHUNK) {
+        int n = min(EDGE_CHUNK, end - s);
 
-            if (i == 0 || i == bmp->height - 1 || j == 0 || j == bmp->width - 1) {
-                // Use the pixel from the inner adjacent position for boundary pixels
-                int inner_i = (i == 0) ? 1 : (i == bmp->height - 1) ? bmp->height - 2 : i;
-                int inner_j = (j == 0) ? 1 : (j == bmp->width - 1) ? bmp->width - 2 : j;
-                new_pixel = rows[inner_i][inner_j];
-            } else {
-                // Apply edge detection kernel for non-boundary pixels
-                Pixel window[3][3];
-                for (int y = -1; y <= 1; y++) {
-                    for (int x = -1; x <= 1; x++) {
-                        window[y + 1][x + 1] = rows[i + y][j + x];
-                    }
-                }
-                new_pixel = apply_edge_detection_kernel(window[0], window[1], window[2]);
+        // Vertical pass over the bytes [s - 3, s + n + 3).
+        const unsigned char *a = in[0] + s - 3, *b = in[1] + s - 3, *c = in[2] + s - 3;
+        int i = 0;
+        for (; i + 16 <= n + 6; i += 16) {
+            __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(a + i)));
+            __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(b + i)));
+            __m256i vc = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(c + i)));
+            _mm256_storeu_si256((__m256i *)(sums + i),
+                                _mm256_add_epi16(_mm256_add_epi16(va, vc),
+                                                 _mm256_slli_epi16(vb, 1)));
+            _mm256_storeu_si256((__m256i *)(diffs + i), _mm256_sub_epi16(va, vc));
+        }
+        for (; i < n + 6; i++) {
+            sums[i] = a[i] + 2 * b[i] + c[i];
+            diffs[i] = a[i] - c[i];
+        }
+
+        // Horizontal pass: the magnitude of byte s + j goes in mags[j + 2].
+        int j = 0;
+        for (; j + 16 <= n; j += 16) {
+            __m256i dx = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(sums + j)),
+                                          _mm256_loadu_si256((const __m256i *)(sums + j + 6)));
+            __m256i dy = _mm256_add_epi16(
+                _mm256_add_epi16(_mm256_loadu_si256((const __m256i *)(diffs + j)),
+                                 _mm256_loadu_si256((const __m256i *)(diffs + j + 6))),
+                _mm256_slli_epi16(_mm256_loadu_si256((const __m256i *)(diffs + j + 3)), 1));
+            __m256i root[2];
+            for (int k = 0; k < 2; k++) {
+                __m256i pairs = k ? _mm256_unpackhi_epi16(dx, dy) : _mm256_unpacklo_epi16(dx, dy);
+                __m256i sum = _mm256_madd_epi16(pairs, pairs);
+                __m256i r = _mm256_cvttps_epi32(_mm256_sqrt_ps(_mm256_cvtepi32_ps(sum)));
+                r = _mm256_add_epi32(r, _mm256_cmpgt_epi32(_mm256_madd_epi16(r, r), sum));
+                root[k] = r;
             }
+            // The unpacks and the pack both work within 128-bit lanes, so
+            // the pack puts the roots back in order.
+            _mm256_storeu_si256((__m256i *)(mags + j + 2), _mm256_packs_epi32(root[0], root[1]));
+        }
+        for (; j < n; j++) {
+            mags[j + 2] = edge_magnitude(sums[j] - sums[j + 6],
+                                         diffs[j] + 2 * diffs[j + 3] + diffs[j + 6]);
+        }
 
-            if (fwrite(&new_pixel, sizeof(Pixel), 1, stdout) != 1) {
-                perror("Failed to write pixel");
-                for (int k = 0; k < bmp->height; k++) {
-                    free(rows[k]);
-                }
-                free(rows);
-                return;
+        // Pixel pass: output byte s + j is at mags[j + 2].
+        __m256i first = _mm256_setr_epi16(-1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1);
+        __m256i second = _mm256_setr_epi16(0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0);
+        __m256i third = _mm256_setr_epi16(0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0);
+        const __m256i low = _mm256_set1_epi16(0xff);
+        for (j = 0; j < n; j += 32) {
+            __m256i edge[2];
+            for (int k = 0; k < 2; k++) {
+                const uint16_t *p = mags + j + 16 * k;
+                __m256i l2 = _mm256_loadu_si256((const __m256i *)p);
+                __m256i l1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+                __m256i m = _mm256_loadu_si256((const __m256i *)(p + 2));
+                __m256i r1 = _mm256_loadu_si256((const __m256i *)(p + 3));
+                __m256i r2 = _mm256_loadu_si256((const __m256i *)(p + 4));
+                __m256i left = _mm256_max_epi16(l1, m), right = _mm256_max_epi16(m, r1);
+                __m256i e = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_and_si256(first, _mm256_max_epi16(right, r2)),
+                                    _mm256_and_si256(second, _mm256_max_epi16(left, r1))),
+                    _mm256_and_si256(third, _mm256_max_epi16(left, l2)));
+                edge[k] = _mm256_and_si256(e, low);
+                // Sixteen lanes on, a lane's byte is one further into its pixel.
+                __m256i t = third;
+                third = second;
+                second = first;
+                first = t;
+            }
+            __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(edge[0], edge[1]),
+                                                     _MM_SHUFFLE(3, 1, 2, 0));
+            if (j + 32 <= n) {
+                _mm256_storeu_si256((__m256i *)(out + s + j), bytes);
+            } else {
+                unsigned char tail[32];
+                _mm256_storeu_si256((__m256i *)tail, bytes);
+                memcpy(out + s + j, tail, n - j);
             }
         }
     }
-    
-    for (int i = 0; i < bmp->height; i++) {
-        free(rows[i]);
+}
+#endif
+
+
+/*
+ * Apply the edge detection kernel to an interior row, taking the 3-by-3 grid
+ * around each pixel from the rows in[0..2].
+ */
+void edge_detection_row(const Pixel *in[3], Pixel *out, int width) {
+    edge_fn edge = edge_scalar;
+#ifdef HAVE_X86_SIMD
+    if (simd_level == SIMD_AVX2) {
+        edge = edge_avx2;
+    } else if (simd_level >= SIMD_SSE2) {
+        edge = edge_sse2;
     }
-    free(rows);
+#endif
+    const unsigned char *rows[3] = {
+        (const unsigned char *)in[0], (const unsigned char *)in[1],
+        (const unsigned char *)in[2]
+    };
+    edge(rows, (unsigned char *)out, sizeof(Pixel), (width - 1) * sizeof(Pixel));
+    out[0] = in[1][1];
+    out[width - 1] = in[1][width - 2];
 }
 
-int main() {
-    // Run the filter program with copy_filter to process the pixels.
-    // You shouldn't need to change this implementation.
-    run_filter(edge_detection_filter, 1);
-    return 0;
-}
\ No newline at end of file
+
+void edge_detection_filter(const ImageBuf *in, ImageBuf *out) {
+    apply_stencil(in, out, edge_detection_row);
+}
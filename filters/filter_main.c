@@ -0,0 +1,19 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "bitmap.h"
+
+/*
+ * The filter programs: each one is this wrapper, compiled with FILTER_NAME
+ * set to the name of its filter in the registry. A filter that resizes
+ * the image takes its scale factor as an optional argument: a whole
+ * number, a fraction or a decimal ("2", "3/4", "0.25").
+ */
+int main(int argc, char **argv) {
+    const Filter *filter = find_filter(FILTER_NAME);
+    Scale scale = {filter->scale_factor, 1};
+    if (filter->kind == FILTER_SCALE && argc > 1 && parse_scale(argv[1], &scale) < 0) {
+        fprintf(stderr, "Usage: %s [scale factor]\n", argv[0]);
+        return 1;
+    }
+    return run_filter(filter, scale) < 0 ? 1 : 0;
+}
@@ -1,87 +1,160 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <sys/wait.h>
+#include <stdint.h>
+#include <string.h>
 #include "bitmap.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
 
 /*
- * Main filter loop.
- * This function is responsible for doing the following:
- *   1. Read all pixels into a 2D array.
- *   2. Process bundary pixels and Apply Gaussian kernel for non-boundary pixels
- *   3. Write out 3*3 pixels at a time.
+ * The Gaussian kernel is the outer product of [1 2 1] with itself, so it
+ * is applied as two passes over the bytes of a row: a vertical pass that
+ * sums the three input rows into 16-bit lanes (at most 4 * 255), and a
+ * horizontal pass that sums those three pixels (three bytes) apart. The
+ * total is at most 16 * 255, and dividing it by 16 gives exactly what the
+ * 3-by-3 kernel does.
  *
+ * Each pass runs over a chunk of the row at a time, and each function
+ * computes the output bytes [start, end) of the row, which must have
+ * three bytes of input on either side.
  */
+#define BLUR_CHUNK 1024
+
+typedef void (*blur_fn)(const unsigned char *in[3], unsigned char *out,
+                        int start, int end);
 
-void gaussian_blur_filter(Bitmap *bmp) {
-    Pixel **rows = malloc(bmp->height * sizeof(Pixel *));
-    if (!rows) {
-        perror("Failed to allocate memory for rows");
-        return;
+static void blur_scalar(const unsigned char *in[3], unsigned char *out,
+                        int start, int end) {
+    const unsigned char *a = in[0], *b = in[1], *c = in[2];
+    for (int i = start; i < end; i++) {
+        int left = a[i - 3] + 2 * b[i - 3] + c[i - 3];
+        int middle = a[i] + 2 * b[i] + c[i];
+        int right = a[i + 3] + 2 * b[i + 3] + c[i + 3];
+        out[i] = (left + 2 * middle + right) >> 4;
     }
+}
 
-    for (int i = 0; i < bmp->height; i++) {
-        rows[i] = malloc(bmp->width * sizeof(Pixel));
-        if (!rows[i]) {
-            perror("Failed to allocate memory for a row");
-            for (int k = 0; k < i; k++) {
-                free(rows[k]);
-            }
-            free(rows);
-            return;
-        }      
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void blur_sse2(const unsigned char *in[3], unsigned char *out,
+                      int start, int end) {
+    uint16_t sums[BLUR_CHUNK + 6];
+    const __m128i zero = _mm_setzero_si128();
+    for (int s = start; s < end; s += BLUR_CHUNK) {
+        int n = min(BLUR_CHUNK, end - s);
 
-        if (fread(rows[i], sizeof(Pixel), bmp->width, stdin) != bmp->width) {
-            perror("Failed to read pixels");
-            for (int k = 0; k <= i; k++) {
-                free(rows[k]);
+        // Vertical pass over the bytes [s - 3, s + n + 3).
+        const unsigned char *a = in[0] + s - 3, *b = in[1] + s - 3, *c = in[2] + s - 3;
+        int i = 0;
+        for (; i + 16 <= n + 6; i += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+            __m128i vc = _mm_loadu_si128((const __m128i *)(c + i));
+            __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(va, zero),
+                                                     _mm_unpacklo_epi8(vc, zero)),
+                                       _mm_slli_epi16(_mm_unpacklo_epi8(vb, zero), 1));
+            __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(va, zero),
+                                                     _mm_unpackhi_epi8(vc, zero)),
+                                       _mm_slli_epi16(_mm_unpackhi_epi8(vb, zero), 1));
+            _mm_storeu_si128((__m128i *)(sums + i), lo);
+            _mm_storeu_si128((__m128i *)(sums + i + 8), hi);
+        }
+        for (; i < n + 6; i++) {
+            sums[i] = a[i] + 2 * b[i] + c[i];
+        }
+
+        // Horizontal pass: output byte s + j is at sums[j + 3].
+        int j = 0;
+        for (; j + 16 <= n; j += 16) {
+            __m128i h[2];
+            for (int k = 0; k < 2; k++) {
+                const uint16_t *p = sums + j + 8 * k;
+                __m128i left = _mm_loadu_si128((const __m128i *)p);
+                __m128i middle = _mm_loadu_si128((const __m128i *)(p + 3));
+                __m128i right = _mm_loadu_si128((const __m128i *)(p + 6));
+                h[k] = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(left, right),
+                                                    _mm_slli_epi16(middle, 1)), 4);
             }
-            free(rows);
-            return;
-        }  
+            _mm_storeu_si128((__m128i *)(out + s + j), _mm_packus_epi16(h[0], h[1]));
+        }
+        for (; j < n; j++) {
+            out[s + j] = (sums[j] + 2 * sums[j + 3] + sums[j + 6]) >> 4;
+        }
     }
+}
 
-    for (int i = 0; i < bmp->height; i++) {
-        for (int j = 0; j < bmp->width; j++) {
-            Pixel blurred_pixel;
+__attribute__((target("avx2")))
+static void blur_avx2(const unsigned char *in[3], unsigned char *out,
+                      int start, int end) {
+    uint16_t sums[BLUR_CHUNK + 6];
+    for (int s = start; s < end; s += BLUR_CHUNK) {
+        int n = min(BLUR_CHUNK, end - s);
 
-            if (i == 0 || i == bmp->height - 1 || j == 0 || j == bmp->width - 1) {
-                // Use the pixel from the inner adjacent position for boundary pixels
-                int inner_i = (i == 0) ? 1 : (i == bmp->height - 1) ? bmp->height - 2 : i;
-                int inner_j = (j == 0) ? 1 : (j == bmp->width - 1) ? bmp->width - 2 : j;
-                blurred_pixel = rows[inner_i][inner_j];
-            } else {
-                // Apply Gaussian kernel for non-boundary pixels
-                Pixel window[3][3];
-                for (int y = -1; y <= 1; y++) {
-                    for (int x = -1; x <= 1; x++) {
-                        window[y + 1][x + 1] = rows[i + y][j + x];
-                    }
-                }
-                blurred_pixel = apply_gaussian_kernel(window[0], window[1], window[2]);
-            }
+        // Vertical pass over the bytes [s - 3, s + n + 3).
+        const unsigned char *a = in[0] + s - 3, *b = in[1] + s - 3, *c = in[2] + s - 3;
+        int i = 0;
+        for (; i + 16 <= n + 6; i += 16) {
+            __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(a + i)));
+            __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(b + i)));
+            __m256i vc = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(c + i)));
+            _mm256_storeu_si256((__m256i *)(sums + i),
+                                _mm256_add_epi16(_mm256_add_epi16(va, vc),
+                                                 _mm256_slli_epi16(vb, 1)));
+        }
+        for (; i < n + 6; i++) {
+            sums[i] = a[i] + 2 * b[i] + c[i];
+        }
 
-            if (fwrite(&blurred_pixel, sizeof(Pixel), 1, stdout) != 1) {
-                perror("Failed to write pixel");
-                for (int k = 0; k < bmp->height; k++) {
-                    free(rows[k]);
-                }
-                free(rows);
-                return;
+        // Horizontal pass: output byte s + j is at sums[j + 3].
+        int j = 0;
+        for (; j + 32 <= n; j += 32) {
+            __m256i h[2];
+            for (int k = 0; k < 2; k++) {
+                const uint16_t *p = sums + j + 16 * k;
+                __m256i left = _mm256_loadu_si256((const __m256i *)p);
+                __m256i middle = _mm256_loadu_si256((const __m256i *)(p + 3));
+                __m256i right = _mm256_loadu_si256((const __m256i *)(p + 6));
+                h[k] = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(left, right),
+                                                          _mm256_slli_epi16(middle, 1)), 4);
             }
+            // packus works within 128-bit lanes; put the quarters back in order.
+            __m256i packed = _mm256_packus_epi16(h[0], h[1]);
+            _mm256_storeu_si256((__m256i *)(out + s + j),
+                                _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+        }
+        for (; j < n; j++) {
+            out[s + j] = (sums[j] + 2 * sums[j + 3] + sums[j + 6]) >> 4;
         }
     }
-    
-    for (int i = 0; i < bmp->height; i++) {
-        free(rows[i]);
+}
+#endif
+
+
+/*
+ * Apply the Gaussian kernel to an interior row, taking the 3-by-3 grid
+ * around each pixel from the rows in[0..2].
+ */
+void gaussian_blur_row(const Pixel *in[3], Pixel *out, int width) {
+    blur_fn blur = blur_scalar;
+#ifdef HAVE_X86_SIMD
+    if (simd_level == SIMD_AVX2) {
+        blur = blur_avx2;
+    } else if (simd_level >= SIMD_SSE2) {
+        blur = blur_sse2;
     }
-    free(rows);
+#endif
+    const unsigned char *rows[3] = {
+        (const unsigned char *)in[0], (const unsigned char *)in[1],
+        (const unsigned char *)in[2]
+    };
+    blur(rows, (unsigned char *)out, sizeof(Pixel), (width - 1) * sizeof(Pixel));
+    out[0] = in[1][1];
+    out[width - 1] = in[1][width - 2];
 }
 
-int main() {
-    // Run the filter program with gaussian_blur_filter to process the pixels.
-    // You shouldn't need to change this implementation.
-    run_filter(gaussian_blur_filter, 1);
-    return 0;
-}
\ No newline at end of file
+
+void gaussian_blur_filter(const ImageBuf *in, ImageBuf *out) {
+    apply_stencil(in, out, gaussian_blur_row);
+}
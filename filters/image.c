@@ -0,0 +1,44 @@
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+
+
+int image_alloc(ImageBuf *image, int width, int height, enum image_layout layout) {
+    size_t row_size = layout == IMAGE_PLANAR ? (size_t)width : (size_t)width * sizeof(Pixel);
+    size_t planes = layout == IMAGE_PLANAR ? 3 : 1;
+    image->width = width;
+    image->height = height;
+    image->layout = layout;
+    image->stride = (row_size + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+    size_t size = max(image->stride * height * planes, 1);
+    if (posix_memalign((void **)&image->data, IMAGE_ALIGN, size) != 0) {
+        image->data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void image_free(ImageBuf *image) {
+    free(image->data);
+    image->data = NULL;
+}
+
+
+void image_convert(const ImageBuf *in, ImageBuf *out) {
+    int planes = in->layout == IMAGE_PLANAR ? 3 : 1;
+    for (int i = 0; i < in->height; i++) {
+        if (in->layout == out->layout) {
+            size_t row_size = in->layout == IMAGE_PLANAR ? (size_t)in->width
+                                                         : (size_t)in->width * sizeof(Pixel);
+            for (int c = 0; c < planes; c++) {
+                memcpy(image_plane_row(out, c, i), image_plane_row(in, c, i), row_size);
+            }
+        } else if (in->layout == IMAGE_INTERLEAVED) {
+            deinterleave_row(image_row(in, i), image_plane_row(out, 0, i),
+                             image_plane_row(out, 1, i), image_plane_row(out, 2, i), in->width);
+        } else {
+            interleave_row(image_plane_row(in, 0, i), image_plane_row(in, 1, i),
+                           image_plane_row(in, 2, i), image_row(out, i), in->width);
+        }
+    }
+}
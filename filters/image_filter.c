@@ -13,35 +13,155 @@
 
 
 /*
- * Check whether the given command is a valid image filter, and if so,
- * run the process.
+ * Parse a command into the step of a chain it runs, storing the program
+ * to run in program (of 64 bytes). Return 0, or -1 if it isn't a valid
+ * image filter.
  *
- * We've given you this function to illustrate the expected command-line
- * arguments for image_filter. No further error-checking is required for
- * the child processes.
+ * A command is the name of a filter in the registry, as a program in
+ * this directory ("greyscale" or "./greyscale"), followed for a filter
+ * that resizes the image by an optional scale factor after a space
+ * ("./scale 2", "lanczos 0.25").
+ */
+int parse_command(const char *cmd, ChainStep *step, char *program) {
+    const char *arg = strchr(cmd, ' ');
+    size_t len = arg != NULL ? arg - cmd : strlen(cmd);
+    const char *name = strncmp(cmd, "./", 2) == 0 ? program + 2 : program;
+    if (len >= 64) {
+        return -1;
+    }
+    memcpy(program, cmd, len);
+    program[len] = '\0';
+    step->filter = find_filter(name);
+    if (step->filter == NULL) {
+        return -1;
+    }
+    step->scale = (Scale){step->filter->scale_factor, 1};
+    if (arg != NULL && (step->filter->kind != FILTER_SCALE ||
+                        parse_scale(arg + 1, &step->scale) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Check whether the given command is a valid image filter, and if so,
+ * run the process. No further error-checking is required for the child
+ * processes.
  */
 void run_command(const char *cmd) {
-    if (strcmp(cmd, "copy") == 0 || strcmp(cmd, "./copy") == 0 ||
-        strcmp(cmd, "greyscale") == 0 || strcmp(cmd, "./greyscale") == 0 ||
-        strcmp(cmd, "gaussian_blur") == 0 || strcmp(cmd, "./gaussian_blur") == 0 ||
-        strcmp(cmd, "edge_detection") == 0 || strcmp(cmd, "./edge_detection") == 0) {
-        execl(cmd, cmd, NULL);
-    } else if (strncmp(cmd, "scale", 5) == 0) {
-        // Note: the numeric argument starts at cmd[6]
-        execl("scale", "scale", cmd + 6, NULL);
-    } else if (strncmp(cmd, "./scale", 7) == 0) {
-        // Note: the numeric argument starts at cmd[8]
-        execl("./scale", "./scale", cmd + 8, NULL);
-    } else {
+    char program[64];
+    ChainStep step;
+    if (parse_command(cmd, &step, program) < 0) {
         fprintf(stderr, "Invalid command '%s'\n", cmd);
         exit(1);
     }
+    const char *arg = strchr(cmd, ' ');
+    if (arg != NULL) {
+        execl(program, program, arg + 1, NULL);
+    } else {
+        execl(program, program, NULL);
+    }
+}
+
+
+/*
+ * Plan the chain the commands run (see plan_chain), with the given
+ * tolerance, storing its steps in steps (of MAX_CHAIN), and replace the
+ * commands with the ones that run the plan, written to buf. Return the
+ * number of commands, or -1, leaving them as they are, if one of them
+ * isn't valid (it fails when it runs) or there are too many.
+ */
+int plan_commands(char **cmds, int num_cmds, int tolerance, ChainStep *steps,
+                  char buf[][64], Plan *plan) {
+    char program[64];
+    if (num_cmds > MAX_CHAIN) {
+        return -1;
+    }
+    for (int i = 0; i < num_cmds; i++) {
+        if (parse_command(cmds[i], &steps[i], program) < 0) {
+            return -1;
+        }
+    }
+    plan_chain(steps, num_cmds, tolerance, plan);
+    for (int i = 0; i < plan->num_steps; i++) {
+        const ChainStep *step = &plan->steps[i];
+        if (step->filter->kind != FILTER_SCALE) {
+            snprintf(buf[i], 64, "./%s", step->filter->name);
+        } else if (step->scale.den == 1) {
+            snprintf(buf[i], 64, "./%s %d", step->filter->name, step->scale.num);
+        } else {
+            snprintf(buf[i], 64, "./%s %d/%d", step->filter->name, step->scale.num,
+                     step->scale.den);
+        }
+        cmds[i] = buf[i];
+    }
+    return plan->num_steps;
 }
 
+/*
+ * Print the plan for the commands, and its estimated cost on the input
+ * image. Return 0, or -1 if they can't be planned or the input can't be
+ * read.
+ */
+int explain_commands(const char *input, char **cmds, int num_cmds, int tolerance) {
+    ChainStep steps[MAX_CHAIN];
+    char buf[MAX_CHAIN][64];
+    Plan plan;
+    if (plan_commands(cmds, num_cmds, tolerance, steps, buf, &plan) < 0) {
+        fprintf(stderr, "Invalid commands: a filter isn't valid, or there are more than %d\n",
+                MAX_CHAIN);
+        return -1;
+    }
 
+    BmpIO in;
+    int fd = open(input, O_RDONLY);
+    if (fd < 0) {
+        perror("open input file");
+        return -1;
+    }
+    if (bmp_open_reader(&in, fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    Bitmap *bmp = read_bitmap_header(&in, NULL, 0);
+    if (bmp != NULL) {
+        explain_plan(stdout, steps, num_cmds, &plan, bmp->width, bmp->height);
+        free_bitmap(bmp);
+    }
+    bmp_close(&in);
+    close(fd);
+    return bmp != NULL ? 0 : -1;
+}
+
+
+/*
+ * The filters run as planned, with the given tolerance (-t, by default 0:
+ * the same image exactly); --explain prints the plan instead. The stages
+ * are connected by shared-memory rings (see ring_create), or with -p, or
+ * if a ring can't be made, by pipes.
+ */
 int main(int argc, char **argv) {
+    int use_pipes = 0, explain = 0, tolerance = 0;
+    while (argc > 1 && argv[1][0] == '-') {
+        char *end;
+        if (strcmp(argv[1], "-p") == 0) {
+            use_pipes = 1;
+        } else if (strcmp(argv[1], "--explain") == 0) {
+            explain = 1;
+        } else if (strcmp(argv[1], "-t") == 0 && argc > 2 &&
+                   (tolerance = strtol(argv[2], &end, 10)) >= 0 && *end == '\0' &&
+                   end != argv[2]) {
+            argv++;
+            argc--;
+        } else {
+            argc = 0;
+            break;
+        }
+        argv++;
+        argc--;
+    }
     if (argc < 3) {
-        printf("Usage: image_filter input output [filters...]\n");
+        printf("Usage: image_filter [-p] [-t tolerance] [--explain] input output [filters...]\n");
         exit(1);
     }
 
@@ -50,11 +170,32 @@ int main(int argc, char **argv) {
         argv[3] = "copy";
         num_filters = 1;
     }
+    if (explain) {
+        return explain_commands(argv[1], argv + 3, num_filters, tolerance) < 0 ? 1 : 0;
+    }
+    ChainStep steps[MAX_CHAIN];
+    char planned[MAX_CHAIN][64];
+    Plan plan;
+    int num_planned = plan_commands(argv + 3, num_filters, tolerance, steps, planned, &plan);
+    if (num_planned > 0) {
+        num_filters = num_planned;
+    }
 
     int pipefds[num_filters - 1][2];
+    int rings[num_filters - 1];
+    pid_t pids[num_filters];
 
-    // Create pipes
-    for (int i = 0; i < num_filters - 1; i++) {
+    // Create rings, or pipes
+    for (int i = 0; i < num_filters - 1 && !use_pipes; i++) {
+        if ((rings[i] = ring_create()) < 0) {
+            perror("ring_create");
+            while (i-- > 0) {
+                close(rings[i]);
+            }
+            use_pipes = 1;
+        }
+    }
+    for (int i = 0; i < num_filters - 1 && use_pipes; i++) {
         if (pipe(pipefds[i]) == -1) {
             perror("pipe");
             exit(1);
@@ -67,7 +208,9 @@ int main(int argc, char **argv) {
             perror("fork");
             exit(1);
         } else if (pid == 0) {
-            if (i > 0) {
+            if (i > 0 && !use_pipes) {
+                dup2(rings[i - 1], STDIN_FILENO);
+            } else if (i > 0) {
                 dup2(pipefds[i - 1][0], STDIN_FILENO);
                 close(pipefds[i - 1][1]);
             } else {
@@ -80,7 +223,9 @@ int main(int argc, char **argv) {
                 close(input_fd);
             }
 
-            if (i < num_filters - 1) {
+            if (i < num_filters - 1 && !use_pipes) {
+                dup2(rings[i], STDOUT_FILENO);
+            } else if (i < num_filters - 1) {
                 dup2(pipefds[i][1], STDOUT_FILENO);
                 close(pipefds[i][0]);
             } else {
@@ -97,11 +242,18 @@ int main(int argc, char **argv) {
             perror("run_command");
             exit(1);
         } 
+        pids[i] = pid;
     }
 
+    // Each side of a ring watches for the other exiting early.
     for (int i = 0; i < num_filters - 1; i++) {
-        close(pipefds[i][0]);
-        close(pipefds[i][1]);
+        if (!use_pipes) {
+            ring_set_pids(rings[i], pids[i], pids[i + 1]);
+            close(rings[i]);
+        } else {
+            close(pipefds[i][0]);
+            close(pipefds[i][1]);
+        }
     }
 
     int count_error = 0;
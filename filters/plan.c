@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include "bitmap.h"
+
+
+/*
+ * What the planner knows of each filter. The costs are rough times per
+ * pixel, in nanoseconds, as measured in a single pass on one thread with
+ * AVX2 (on a 1920x1080 image); only how they compare matters. A scaling's
+ * cost is per pixel and tap (see step_cost).
+ */
+enum {
+    GREY_OUT = 1,       // Every pixel it outputs is grey (its channels
+                        // are equal).
+    KEEPS_GREY = 2,     // It leaves grey pixels as they are.
+    IDEMPOTENT = 4,     // Applying it twice is the same as once.
+    SELF_INVERSE = 8,   // Applying it twice leaves the image as it is.
+    LINEAR = 16,        // It commutes with a resampling whose weights
+                        // aren't negative, up to the rounding of each.
+    NONEXPANSIVE = 32,  // Two images whose channels differ by at most d
+                        // give two that differ by at most d.
+};
+
+typedef struct {
+    const char *name;
+    double cost;
+    int flags;
+} FilterInfo;
+
+static const FilterInfo filter_info[] = {
+    {"copy", 0, KEEPS_GREY | NONEXPANSIVE},
+    {"greyscale", 0.7, GREY_OUT | KEEPS_GREY | LINEAR | NONEXPANSIVE},
+    {"luma", 0.8, GREY_OUT | KEEPS_GREY | LINEAR | NONEXPANSIVE},
+    {"threshold", 0.8, GREY_OUT | IDEMPOTENT},
+    {"invert", 0.35, SELF_INVERSE | LINEAR | NONEXPANSIVE},
+    {"brightness", 0.35, NONEXPANSIVE},
+    {"contrast", 0.35, 0},
+    {"gamma", 1.3, 0},
+    {"gaussian_blur", 0.6, NONEXPANSIVE},
+    {"edge_detection", 1.7, 0},
+    {"scale", 1.0, NONEXPANSIVE},
+    {"bilinear", 1.0, NONEXPANSIVE},
+    {"lanczos", 0.8, 0},
+};
+
+// For a filter missing from the table: no properties, at a middling cost.
+static const FilterInfo unknown_info = {NULL, 1.0, 0};
+
+static const FilterInfo *info(const Filter *filter) {
+    for (int i = 0; i < sizeof(filter_info) / sizeof(filter_info[0]); i++) {
+        if (strcmp(filter_info[i].name, filter->name) == 0) {
+            return &filter_info[i];
+        }
+    }
+    return &unknown_info;
+}
+
+static int has(const ChainStep *step, int flags) {
+    return (info(step->filter)->flags & flags) == flags;
+}
+
+static int is_point(const ChainStep *step) {
+    return step->filter->kind == FILTER_POINT;
+}
+
+// Whether a step scales the image with the given resampling, making it
+// larger (dir > 0) or smaller (dir < 0).
+static int is_scale(const ChainStep *step, enum resample_mode mode, int dir) {
+    return step->filter->kind == FILTER_SCALE && step->filter->resample == mode &&
+           (dir > 0 ? step->scale.num > step->scale.den : step->scale.num < step->scale.den);
+}
+
+
+/*
+ * The rewrite rules. A rule looks at the steps from steps[0] on (there
+ * are num_steps of them). If it applies there, it stores the number of
+ * steps it replaces in len, writes the steps to put in their place to
+ * out (at most two), and returns how many there are; else it returns -1.
+ */
+typedef int (*rewrite_fn)(const ChainStep *steps, int num_steps, int *len, ChainStep *out);
+
+// copy, or a scaling by 1, leaves the image as it is.
+static int drop_identity(const ChainStep *steps, int num_steps, int *len, ChainStep *out) {
+    *len = 1;
+    return steps[0].filter->row == copy_row ||
+           (steps[0].filter->kind == FILTER_SCALE && steps[0].scale.num == steps[0].scale.den)
+           ? 0 : -1;
+}
+
+// greyscale or luma after a filter whose output is already grey leaves it
+// as it is (luma's weights add up to 256), as does threshold after
+// threshold.
+static int drop_repeat(const ChainStep *steps, int num_steps, int *len, ChainStep *out) {
+    if (num_steps < 2 || !((has(&steps[0], GREY_OUT) && has(&steps[1], KEEPS_GREY)) ||
+                           (steps[1].filter == steps[0].filter && has(&steps[0], IDEMPOTENT)))) {
+        return -1;
+    }
+    *len = 2;
+    out[0] = steps[0];
+    return 1;
+}
+
+// invert twice gives back the image: 255 - (255 - v) = v.
+static int cancel_inverse(const ChainStep *steps, int num_steps, int *len, ChainStep *out) {
+    if (num_steps < 2 || steps[1].filter != steps[0].filter || !has(&steps[0], SELF_INVERSE)) {
+        return -1;
+    }
+    *len = 2;
+    return 0;
+}
+
+// Whole-number nearest-neighbour scalings multiply: pixel i of a scaling
+// by a, then b, is pixel i / b / a = i / (a * b) of the image.
+static int merge_scales(const ChainStep *steps, int num_steps, int *len, ChainStep *out) {
+    if (num_steps < 2 || !is_scale(&steps[0], RESAMPLE_BOX, 1) ||
+            steps[1].filter != steps[0].filter || steps[0].scale.den != 1 ||
+            steps[1].scale.den != 1 || steps[1].scale.num > INT_MAX / steps[0].scale.num) {
+        return -1;
+    }
+    *len = 2;
+    out[0] = steps[0];
+    out[0].scale.num *= steps[1].scale.num;
+    return 1;
+}
+
+/*
+ * Enlarging with nearest neighbour copies pixels, so a point filter after
+ * it gives the same pixels before it, where there are fewer.
+ */
+static int hoist_nearest(const ChainStep *steps, int num_steps, int *len, ChainStep *out) {
+    if (num_steps < 2 || !is_scale(&steps[0], RESAMPLE_BOX, 1) || !is_point(&steps[1])) {
+        return -1;
+    }
+    *len = 2;
+    out[0] = steps[1];
+    out[1] = steps[0];
+    return 2;
+}
+
+/*
+ * A linear point filter commutes with a bilinear enlargement, or with a
+ * box or bilinear reduction, whose weights are never negative (so never
+ * clamp), save for rounding: either way, the exact value is rounded up to
+ * three times (by the filter, and by the scaling along the rows and then
+ * down the columns), each time by less than 1, in a way that leaves the
+ * two no more than 2 apart. The filter goes to the side with fewer
+ * pixels.
+ */
+static int hoist_linear(const ChainStep *steps, int num_steps, int *len, ChainStep *out) {
+    if (num_steps < 2 || !is_scale(&steps[0], RESAMPLE_BILINEAR, 1) ||
+            !is_point(&steps[1]) || !has(&steps[1], LINEAR)) {
+        return -1;
+    }
+    *len = 2;
+    out[0] = steps[1];
+    out[1] = steps[0];
+    return 2;
+}
+
+static int sink_linear(const ChainStep *steps, int num_steps, int *len, ChainStep *out) {
+    if (num_steps < 2 || !is_point(&steps[0]) || !has(&steps[0], LINEAR) ||
+            !(is_scale(&steps[1], RESAMPLE_BOX, -1) ||
+              is_scale(&steps[1], RESAMPLE_BILINEAR, -1))) {
+        return -1;
+    }
+    *len = 2;
+    out[0] = steps[1];
+    out[1] = steps[0];
+    return 2;
+}
+
+/*
+ * The rules, in the order they are tried, each with the most it can
+ * change any channel of the image by. (Merging runs of Gaussian blurs into
+ * a single wider kernel isn't one of them: each 3-by-3 blur rounds down,
+ * so the result would differ, and the wider kernel costs more per pixel
+ * than the blurs it replaces, which take only two passes of 3 taps each.)
+ */
+typedef struct {
+    const char *name;
+    int tolerance;
+    rewrite_fn rewrite;
+} Rule;
+
+static const Rule rules[] = {
+    {"identity", 0, drop_identity},
+    {"idempotent", 0, drop_repeat},
+    {"inverse", 0, cancel_inverse},
+    {"merge_scales", 0, merge_scales},
+    {"hoist_nearest", 0, hoist_nearest},
+    {"hoist_linear", 2, hoist_linear},
+    {"sink_linear", 2, sink_linear},
+};
+
+#define NUM_RULES (sizeof(rules) / sizeof(rules[0]))
+
+// Write steps to buf, as parse_chain reads them, or "(nothing)".
+static void format_steps(const ChainStep *steps, int num_steps, char *buf, size_t size) {
+    int len = snprintf(buf, size, "%s", num_steps == 0 ? "(nothing)" : "");
+    for (int s = 0; s < num_steps && len >= 0; s++) {
+        // What doesn't fit is cut off.
+        if (s > 0 && len + 1 < size) {
+            buf[len++] = ',';
+            buf[len] = '\0';
+        }
+        int n = format_step(&steps[s], buf + len, size - len);
+        len = n < 0 ? -1 : len + n;
+    }
+}
+
+static void note_rule(Plan *plan, const Rule *rule, const ChainStep *steps, int len,
+                      const ChainStep *out, int n) {
+    if (plan->num_notes == MAX_PLAN_NOTES) {
+        return;
+    }
+    PlanNote *note = &plan->notes[plan->num_notes++];
+    char before[44], after[44];
+    format_steps(steps, len, before, sizeof(before));
+    format_steps(out, n, after, sizeof(after));
+    note->rule = rule->name;
+    note->tolerance = rule->tolerance;
+    snprintf(note->change, sizeof(note->change), "%s -> %s", before, after);
+}
+
+int plan_chain(const ChainStep *steps, int num_steps, int tolerance, Plan *plan) {
+    memcpy(plan->steps, steps, num_steps * sizeof(ChainStep));
+    plan->num_steps = num_steps;
+    plan->error = 0;
+    plan->num_notes = 0;
+
+    // The rules are tried at each step in turn, going back a step after a
+    // rewrite, which may let a rule apply to the step before it. Every
+    // rewrite shortens the chain, or moves a point filter to fewer pixels,
+    // so this ends. A rule that changes the image is only used if the
+    // filters after it keep its changes as small.
+    int s = 0;
+    while (s < plan->num_steps) {
+        const ChainStep *rest = plan->steps + s;
+        int num_rest = plan->num_steps - s;
+        ChainStep out[2];
+        int r, len, n = -1;
+        for (r = 0; r < NUM_RULES && n < 0; r++) {
+            if (plan->error + rules[r].tolerance > tolerance) {
+                continue;
+            }
+            n = rules[r].rewrite(rest, num_rest, &len, out);
+            for (int t = len; n >= 0 && rules[r].tolerance > 0 && t < num_rest; t++) {
+                if (!has(&rest[t], NONEXPANSIVE)) {
+                    n = -1;
+                }
+            }
+        }
+        if (n < 0) {
+            s++;
+            continue;
+        }
+        const Rule *rule = &rules[r - 1];
+        note_rule(plan, rule, rest, len, out, n);
+        memmove(plan->steps + s + n, rest + len, (num_rest - len) * sizeof(ChainStep));
+        memcpy(plan->steps + s, out, n * sizeof(ChainStep));
+        plan->num_steps += n - len;
+        plan->error += rule->tolerance;
+        s = max(s - 1, 0);
+    }
+
+    if (plan->num_steps == 0) {
+        plan->steps[0].filter = find_filter("copy");
+        plan->steps[0].scale = (Scale){1, 1};
+        plan->num_steps = 1;
+    }
+    return plan->num_steps;
+}
+
+
+// Roughly how many input pixels each output pixel of a resampling from
+// in_size to out_size pixels is computed from (see weigh in scale.c).
+static double taps(enum resample_mode mode, int in_size, int out_size) {
+    double stretch = max((double)in_size / out_size, 1.0);
+    switch (mode) {
+    case RESAMPLE_BOX:
+        return in_size < out_size ? 1 : ceil(stretch) + 1;
+    case RESAMPLE_BILINEAR:
+        return ceil(2 * stretch);
+    default:
+        return ceil(6 * stretch);
+    }
+}
+
+/*
+ * Return the estimated time, in seconds, a step takes on an image of the
+ * given size, and store the size of its output there. A scaling resamples
+ * each input row along the row, and then each output row down the column;
+ * for nearest neighbour, an output row is the row it copies.
+ */
+static double step_cost(const ChainStep *step, int *width, int *height) {
+    const Filter *filter = step->filter;
+    double cost = info(filter)->cost * 1e-9;
+    if (filter->kind != FILTER_SCALE || step->scale.num == step->scale.den) {
+        return cost * *width * *height;
+    }
+    int out_width = scaled_size(*width, step->scale);
+    int out_height = scaled_size(*height, step->scale);
+    if (out_width < 0 || out_height < 0) {
+        return HUGE_VAL;
+    }
+    double across = taps(filter->resample, *width, out_width);
+    double down = taps(filter->resample, *height, out_height);
+    cost *= (double)out_width * *height * across +
+            (across == 1 && down == 1 ? 0 : (double)out_width * out_height * down);
+    *width = out_width;
+    *height = out_height;
+    return cost;
+}
+
+double chain_cost(const ChainStep *steps, int num_steps, int width, int height) {
+    double cost = 0;
+    for (int s = 0; s < num_steps; s++) {
+        cost += step_cost(&steps[s], &width, &height);
+    }
+    return cost;
+}
+
+
+void explain_plan(FILE *out, const ChainStep *steps, int num_steps, const Plan *plan,
+                  int width, int height) {
+    char buf[MAX_CHAIN * 32];
+    format_steps(steps, num_steps, buf, sizeof(buf));
+    fprintf(out, "chain: %s\n", buf);
+    for (int i = 0; i < plan->num_notes; i++) {
+        const PlanNote *note = &plan->notes[i];
+        char tolerance[24] = "exact";
+        if (note->tolerance > 0) {
+            snprintf(tolerance, sizeof(tolerance), "within %d", note->tolerance);
+        }
+        fprintf(out, "  %-14s %-10s %s\n", note->rule, tolerance, note->change);
+    }
+    format_steps(plan->steps, plan->num_steps, buf, sizeof(buf));
+    fprintf(out, "plan: %s\n", buf);
+    if (plan->error == 0) {
+        fprintf(out, "  the same image exactly\n");
+    } else {
+        fprintf(out, "  each channel within %d of the chain's\n", plan->error);
+    }
+
+    fprintf(out, "  %-20s %11s %11s %10s\n", "step", "input", "output", "cost");
+    int w = width, h = height;
+    for (int s = 0; s < plan->num_steps; s++) {
+        int in_w = w, in_h = h;
+        double cost = step_cost(&plan->steps[s], &w, &h);
+        char in[24], output[24];
+        snprintf(in, sizeof(in), "%dx%d", in_w, in_h);
+        snprintf(output, sizeof(output), "%dx%d", w, h);
+        format_step(&plan->steps[s], buf, sizeof(buf));
+        fprintf(out, "  %-20s %11s %11s %7.2f ms\n", buf, in, output, cost * 1e3);
+    }
+    fprintf(out, "estimated cost: %.2f ms, from %.2f ms\n",
+            chain_cost(plan->steps, plan->num_steps, width, height) * 1e3,
+            chain_cost(steps, num_steps, width, height) * 1e3);
+}
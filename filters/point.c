@@ -0,0 +1,457 @@
+#include <math.h>
+#include <string.h>
+#include "bitmap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+
+/*
+ * The point-operation engine.
+ *
+ * A mix needs all three channels of a pixel at once, so the vector
+ * versions load 16 pixels (48 bytes) at a time and shuffle their bytes
+ * apart into a vector each of blue, green and red, widened to 16-bit
+ * lanes. The result is one byte per pixel, which is shuffled out to all
+ * three channels. The shuffles (pshufb) need SSSE3.
+ *
+ * A tone change maps every channel the same way, so the vector versions
+ * don't separate the channels: each byte v becomes (v * gain + bias) /
+ * 128, which a multiply-add (pmaddwd) of the pair (v, 1) with the pair
+ * (gain, bias) gives exactly in 32 bits. The packs down to bytes clamp
+ * it to [0, 255]. A table of any 256 values is looked up a byte at a
+ * time: a vector lookup (16 shuffles of 16 entries) is no faster.
+ *
+ * Converting between the interleaved and planar layouts is the same
+ * shuffle apart, stored a channel at a time, and its reverse: each output
+ * vector takes its bytes from the three channel vectors, one shuffle each.
+ *
+ * The mean is divided by 3 with a multiply and a shift: 0xaaab / 2^17 is
+ * just over 1/3, close enough that the result is exact for any sum below
+ * 2^16 (the most is 3 * 255).
+ */
+#define MEAN(sum) (((sum) * 0xaaab) >> 17)
+
+// The Rec. 709 weights of red, green and blue, out of 256.
+#define LUMA_RED 54
+#define LUMA_GREEN 183
+#define LUMA_BLUE 19
+#define LUMA(red, green, blue) \
+    ((LUMA_RED * (red) + LUMA_GREEN * (green) + LUMA_BLUE * (blue) + 128) >> 8)
+
+static unsigned char mix_pixel(enum pixel_mix mix, Pixel pixel) {
+    switch (mix) {
+    case MIX_AVERAGE:
+        return MEAN(pixel.red + pixel.green + pixel.blue);
+    case MIX_LUMA:
+        return LUMA(pixel.red, pixel.green, pixel.blue);
+    default:
+        return LUMA(pixel.red, pixel.green, pixel.blue) >= 128 ? 255 : 0;
+    }
+}
+
+static void mix_scalar(enum pixel_mix mix, const Pixel *in, Pixel *out, int width) {
+    for (int i = 0; i < width; i++) {
+        unsigned char value = mix_pixel(mix, in[i]);
+        out[i].red = out[i].green = out[i].blue = value;
+    }
+}
+
+static void tone_scalar(int gain, int bias, const unsigned char *in,
+                        unsigned char *out, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        int value = (in[i] * gain + bias) >> 7;
+        out[i] = value < 0 ? 0 : value > 255 ? 255 : value;
+    }
+}
+
+static void deinterleave_scalar(const Pixel *in, unsigned char *blue, unsigned char *green,
+                               unsigned char *red, int width) {
+    for (int i = 0; i < width; i++) {
+        blue[i] = in[i].blue;
+        green[i] = in[i].green;
+        red[i] = in[i].red;
+    }
+}
+
+static void interleave_scalar(const unsigned char *blue, const unsigned char *green,
+                              const unsigned char *red, Pixel *out, int width) {
+    for (int i = 0; i < width; i++) {
+        out[i].blue = blue[i];
+        out[i].green = green[i];
+        out[i].red = red[i];
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * The shuffles that take a channel out of each of the three 16-byte
+ * vectors of 16 pixels, and that put a byte per pixel back in them (-1
+ * gives a zero).
+ */
+static const signed char split_masks[3][3][16] = {
+    {   // blue
+        {0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13},
+    }, {    // green
+        {1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14},
+    }, {    // red
+        {2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15},
+    },
+};
+
+// The shuffles that put each channel's bytes in their places in each of
+// the three vectors of 16 pixels.
+static const signed char merge_masks[3][3][16] = {
+    {   // blue
+        {0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5},
+        {-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1},
+        {-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1},
+    }, {    // green
+        {-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1},
+        {5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10},
+        {-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1},
+    }, {    // red
+        {-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1},
+        {-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1},
+        {10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15},
+    },
+};
+
+static const signed char spread_masks[3][16] = {
+    {0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5},
+    {5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10},
+    {10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15},
+};
+
+// Load 16 pixels, and return their channels (blue, green, red) in c.
+__attribute__((target("ssse3")))
+static inline void split_pixels(const unsigned char *in, __m128i c[3]) {
+    __m128i v[3];
+    for (int k = 0; k < 3; k++) {
+        v[k] = _mm_loadu_si128((const __m128i *)(in + 16 * k));
+    }
+    for (int ch = 0; ch < 3; ch++) {
+        __m128i part[3];
+        for (int k = 0; k < 3; k++) {
+            part[k] = _mm_shuffle_epi8(v[k], _mm_loadu_si128((const __m128i *)split_masks[ch][k]));
+        }
+        c[ch] = _mm_or_si128(_mm_or_si128(part[0], part[1]), part[2]);
+    }
+}
+
+// Store 16 pixels, each with its byte of value in every channel.
+__attribute__((target("ssse3")))
+static inline void spread_pixels(__m128i value, unsigned char *out) {
+    for (int k = 0; k < 3; k++) {
+        _mm_storeu_si128((__m128i *)(out + 16 * k),
+                         _mm_shuffle_epi8(value,
+                                          _mm_loadu_si128((const __m128i *)spread_masks[k])));
+    }
+}
+
+__attribute__((target("ssse3")))
+static void mix_ssse3(enum pixel_mix mix, const Pixel *in, Pixel *out, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mean = _mm_set1_epi16((short)0xaaab);
+    const __m128i red_weight = _mm_set1_epi16(LUMA_RED), green_weight = _mm_set1_epi16(LUMA_GREEN);
+    const __m128i blue_weight = _mm_set1_epi16(LUMA_BLUE), half = _mm_set1_epi16(128);
+    const __m128i below = _mm_set1_epi16(127);
+    int i = 0;
+    for (; i + 16 <= width; i += 16) {
+        __m128i c[3], value[2];
+        split_pixels((const unsigned char *)(in + i), c);
+        for (int k = 0; k < 2; k++) {
+            __m128i blue = k ? _mm_unpackhi_epi8(c[0], zero) : _mm_unpacklo_epi8(c[0], zero);
+            __m128i green = k ? _mm_unpackhi_epi8(c[1], zero) : _mm_unpacklo_epi8(c[1], zero);
+            __m128i red = k ? _mm_unpackhi_epi8(c[2], zero) : _mm_unpacklo_epi8(c[2], zero);
+            if (mix == MIX_AVERAGE) {
+                __m128i sum = _mm_add_epi16(_mm_add_epi16(blue, green), red);
+                value[k] = _mm_srli_epi16(_mm_mulhi_epu16(sum, mean), 1);
+            } else {
+                __m128i luma = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(red, red_weight),
+                                                           _mm_mullo_epi16(green, green_weight)),
+                                             _mm_add_epi16(_mm_mullo_epi16(blue, blue_weight),
+                                                           half));
+                value[k] = _mm_srli_epi16(luma, 8);
+                if (mix == MIX_THRESHOLD) {
+                    // The comparison gives 0xffff or 0; keep a byte of it.
+                    value[k] = _mm_srli_epi16(_mm_cmpgt_epi16(value[k], below), 8);
+                }
+            }
+        }
+        spread_pixels(_mm_packus_epi16(value[0], value[1]), (unsigned char *)(out + i));
+    }
+    mix_scalar(mix, in + i, out + i, width - i);
+}
+
+__attribute__((target("avx2")))
+static void mix_avx2(enum pixel_mix mix, const Pixel *in, Pixel *out, int width) {
+    const __m256i mean = _mm256_set1_epi16((short)0xaaab);
+    const __m256i red_weight = _mm256_set1_epi16(LUMA_RED);
+    const __m256i green_weight = _mm256_set1_epi16(LUMA_GREEN);
+    const __m256i blue_weight = _mm256_set1_epi16(LUMA_BLUE), half = _mm256_set1_epi16(128);
+    const __m256i below = _mm256_set1_epi16(127);
+    int i = 0;
+    for (; i + 16 <= width; i += 16) {
+        __m128i c[3];
+        split_pixels((const unsigned char *)(in + i), c);
+        __m256i blue = _mm256_cvtepu8_epi16(c[0]), green = _mm256_cvtepu8_epi16(c[1]);
+        __m256i red = _mm256_cvtepu8_epi16(c[2]), value;
+        if (mix == MIX_AVERAGE) {
+            __m256i sum = _mm256_add_epi16(_mm256_add_epi16(blue, green), red);
+            value = _mm256_srli_epi16(_mm256_mulhi_epu16(sum, mean), 1);
+        } else {
+            __m256i luma = _mm256_add_epi16(
+                _mm256_add_epi16(_mm256_mullo_epi16(red, red_weight),
+                                 _mm256_mullo_epi16(green, green_weight)),
+                _mm256_add_epi16(_mm256_mullo_epi16(blue, blue_weight), half));
+            value = _mm256_srli_epi16(luma, 8);
+            if (mix == MIX_THRESHOLD) {
+                value = _mm256_srli_epi16(_mm256_cmpgt_epi16(value, below), 8);
+            }
+        }
+        spread_pixels(_mm_packus_epi16(_mm256_castsi256_si128(value),
+                                       _mm256_extracti128_si256(value, 1)),
+                      (unsigned char *)(out + i));
+    }
+    mix_scalar(mix, in + i, out + i, width - i);
+}
+
+__attribute__((target("ssse3")))
+static void deinterleave_ssse3(const Pixel *in, unsigned char *blue, unsigned char *green,
+                               unsigned char *red, int width) {
+    int i = 0;
+    for (; i + 16 <= width; i += 16) {
+        __m128i c[3];
+        split_pixels((const unsigned char *)(in + i), c);
+        _mm_storeu_si128((__m128i *)(blue + i), c[0]);
+        _mm_storeu_si128((__m128i *)(green + i), c[1]);
+        _mm_storeu_si128((__m128i *)(red + i), c[2]);
+    }
+    deinterleave_scalar(in + i, blue + i, green + i, red + i, width - i);
+}
+
+__attribute__((target("ssse3")))
+static void interleave_ssse3(const unsigned char *blue, const unsigned char *green,
+                             const unsigned char *red, Pixel *out, int width) {
+    int i = 0;
+    for (; i + 16 <= width; i += 16) {
+        __m128i c[3] = {
+            _mm_loadu_si128((const __m128i *)(blue + i)),
+            _mm_loadu_si128((const __m128i *)(green + i)),
+            _mm_loadu_si128((const __m128i *)(red + i)),
+        };
+        for (int k = 0; k < 3; k++) {
+            __m128i part[3];
+            for (int ch = 0; ch < 3; ch++) {
+                part[ch] = _mm_shuffle_epi8(c[ch],
+                                            _mm_loadu_si128((const __m128i *)merge_masks[ch][k]));
+            }
+            _mm_storeu_si128((__m128i *)((unsigned char *)(out + i) + 16 * k),
+                             _mm_or_si128(_mm_or_si128(part[0], part[1]), part[2]));
+        }
+    }
+    interleave_scalar(blue + i, green + i, red + i, out + i, width - i);
+}
+
+__attribute__((target("sse2")))
+static void tone_sse2(int gain, int bias, const unsigned char *in, unsigned char *out,
+                      size_t len) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i factors = _mm_set1_epi32(((unsigned)bias << 16) | (gain & 0xffff));
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i half[2];
+        for (int k = 0; k < 2; k++) {
+            __m128i words = k ? _mm_unpackhi_epi8(v, zero) : _mm_unpacklo_epi8(v, zero);
+            __m128i lo = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(words, one), factors), 7);
+            __m128i hi = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(words, one), factors), 7);
+            half[k] = _mm_packs_epi32(lo, hi);
+        }
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(half[0], half[1]));
+    }
+    tone_scalar(gain, bias, in + i, out + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void tone_avx2(int gain, int bias, const unsigned char *in, unsigned char *out,
+                      size_t len) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i factors = _mm256_set1_epi32(((unsigned)bias << 16) | (gain & 0xffff));
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i half[2];
+        for (int k = 0; k < 2; k++) {
+            // The unpacks and packs all work within 128-bit lanes, so the
+            // bytes come back out in order.
+            __m256i words = k ? _mm256_unpackhi_epi8(v, zero) : _mm256_unpacklo_epi8(v, zero);
+            __m256i lo = _mm256_srai_epi32(
+                _mm256_madd_epi16(_mm256_unpacklo_epi16(words, one), factors), 7);
+            __m256i hi = _mm256_srai_epi32(
+                _mm256_madd_epi16(_mm256_unpackhi_epi16(words, one), factors), 7);
+            half[k] = _mm256_packs_epi32(lo, hi);
+        }
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_packus_epi16(half[0], half[1]));
+    }
+    tone_scalar(gain, bias, in + i, out + i, len - i);
+}
+#endif
+
+
+void mix_row(enum pixel_mix mix, const Pixel *in, Pixel *out, int width) {
+#ifdef HAVE_X86_SIMD
+    if (simd_level == SIMD_AVX2) {
+        mix_avx2(mix, in, out, width);
+        return;
+    } else if (simd_level == SIMD_SSSE3) {
+        mix_ssse3(mix, in, out, width);
+        return;
+    }
+#endif
+    mix_scalar(mix, in, out, width);
+}
+
+
+void tone_row(int gain, int bias, const Pixel *in, Pixel *out, int width) {
+    const unsigned char *src = (const unsigned char *)in;
+    unsigned char *dst = (unsigned char *)out;
+    size_t len = (size_t)width * sizeof(Pixel);
+#ifdef HAVE_X86_SIMD
+    if (simd_level == SIMD_AVX2) {
+        tone_avx2(gain, bias, src, dst, len);
+        return;
+    } else if (simd_level >= SIMD_SSE2) {
+        tone_sse2(gain, bias, src, dst, len);
+        return;
+    }
+#endif
+    tone_scalar(gain, bias, src, dst, len);
+}
+
+
+void deinterleave_row(const Pixel *in, unsigned char *blue, unsigned char *green,
+                      unsigned char *red, int width) {
+#ifdef HAVE_X86_SIMD
+    if (simd_level >= SIMD_SSSE3) {
+        deinterleave_ssse3(in, blue, green, red, width);
+        return;
+    }
+#endif
+    deinterleave_scalar(in, blue, green, red, width);
+}
+
+void interleave_row(const unsigned char *blue, const unsigned char *green,
+                    const unsigned char *red, Pixel *out, int width) {
+#ifdef HAVE_X86_SIMD
+    if (simd_level >= SIMD_SSSE3) {
+        interleave_ssse3(blue, green, red, out, width);
+        return;
+    }
+#endif
+    interleave_scalar(blue, green, red, out, width);
+}
+
+
+void map_row(const unsigned char table[256], const Pixel *in, Pixel *out, int width) {
+    const unsigned char *src = (const unsigned char *)in;
+    unsigned char *dst = (unsigned char *)out;
+    for (size_t i = 0; i < (size_t)width * sizeof(Pixel); i++) {
+        dst[i] = table[src[i]];
+    }
+}
+
+
+void apply_point(const ImageBuf *in, ImageBuf *out, row_fn row) {
+    for (int i = 0; i < in->height; i++) {
+        const Pixel *rows[3] = {NULL, image_row(in, i), NULL};
+        row(rows, image_row(out, i), in->width);
+    }
+}
+
+
+/*
+ * The point filters built on the engine, besides greyscale (which is the
+ * mean):
+ *
+ * - invert: each channel becomes 255 minus itself.
+ * - brightness: each channel goes up by BRIGHTNESS, up to 255.
+ * - contrast: each channel's distance from 128 is multiplied by
+ *   CONTRAST / 128, rounded to the nearest value (halves up) and clamped.
+ * - gamma: each channel is encoded with a gamma of GAMMA (raised to the
+ *   power 1 / GAMMA, out of 255), which brightens the darker tones. Its
+ *   table is filled in when the program starts.
+ */
+#define BRIGHTNESS 32
+#define CONTRAST 192
+#define GAMMA 2.2
+
+static unsigned char gamma_table[256];
+
+__attribute__((constructor))
+static void fill_gamma_table(void) {
+    for (int v = 0; v < 256; v++) {
+        gamma_table[v] = lround(255 * pow(v / 255.0, 1 / GAMMA));
+    }
+}
+
+void luma_row(const Pixel *in[3], Pixel *out, int width) {
+    mix_row(MIX_LUMA, in[1], out, width);
+}
+
+void threshold_row(const Pixel *in[3], Pixel *out, int width) {
+    mix_row(MIX_THRESHOLD, in[1], out, width);
+}
+
+void invert_row(const Pixel *in[3], Pixel *out, int width) {
+    tone_row(-128, 255 * 128, in[1], out, width);
+}
+
+void brightness_row(const Pixel *in[3], Pixel *out, int width) {
+    tone_row(128, BRIGHTNESS * 128, in[1], out, width);
+}
+
+void contrast_row(const Pixel *in[3], Pixel *out, int width) {
+    // 128 + (v - 128) * CONTRAST / 128, plus a half to round.
+    tone_row(CONTRAST, (128 - CONTRAST) * 128 + 64, in[1], out, width);
+}
+
+void gamma_row(const Pixel *in[3], Pixel *out, int width) {
+    map_row(gamma_table, in[1], out, width);
+}
+
+
+void luma_filter(const ImageBuf *in, ImageBuf *out) {
+    apply_point(in, out, luma_row);
+}
+
+void threshold_filter(const ImageBuf *in, ImageBuf *out) {
+    apply_point(in, out, threshold_row);
+}
+
+void invert_filter(const ImageBuf *in, ImageBuf *out) {
+    apply_point(in, out, invert_row);
+}
+
+void brightness_filter(const ImageBuf *in, ImageBuf *out) {
+    apply_point(in, out, brightness_row);
+}
+
+void contrast_filter(const ImageBuf *in, ImageBuf *out) {
+    apply_point(in, out, contrast_row);
+}
+
+void gamma_filter(const ImageBuf *in, ImageBuf *out) {
+    apply_point(in, out, gamma_row);
+}
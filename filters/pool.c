@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "bitmap.h"
+
+
+int filter_threads = 1;
+
+__attribute__((constructor))
+static void choose_filter_threads(void) {
+    const char *wanted = getenv("FILTER_THREADS");
+    if (wanted != NULL) {
+        filter_threads = max(1, min(atoi(wanted), MAX_FILTER_THREADS));
+    }
+}
+
+
+/*
+ * The thread pool. Its threads are started as jobs need them, and then
+ * wait for the next job for as long as the process lives. A job is run
+ * by the thread that starts it and the first threads - 1 threads of the
+ * pool, which take its tasks in order until there are none left; one job
+ * runs at a time.
+ *
+ * A process forked from one with a pool has none of its threads, so the
+ * pool remembers which process it belongs to and starts over in another.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // Signalled when a job starts.
+    pthread_cond_t done;        // Signalled when its last task is done.
+    pid_t pid;                  // The process the threads belong to.
+    int num_threads;
+    pthread_mutex_t job_lock;   // Held for the length of a job.
+
+    task_fn task;
+    void *arg;
+    int helpers;                // The pool threads that work on the job.
+    int num_tasks;
+    int next_task;              // The next task to start.
+    int unfinished;             // The tasks not yet done.
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    0, 0, PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * Run tasks of the current job until there are none left to start, with
+ * the pool locked (it's unlocked while a task runs).
+ */
+static void run_tasks(void) {
+    while (pool.next_task < pool.num_tasks) {
+        int i = pool.next_task++;
+        pthread_mutex_unlock(&pool.lock);
+        pool.task(pool.arg, i);
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.unfinished == 0) {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+}
+
+static void *pool_thread(void *arg) {
+    int id = (long)arg;
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        while (id >= pool.helpers || pool.next_task == pool.num_tasks) {
+            pthread_cond_wait(&pool.work, &pool.lock);
+        }
+        run_tasks();
+    }
+    return NULL;
+}
+
+void run_parallel(int threads, int n, task_fn task, void *arg) {
+    if (threads <= 1 || n <= 1) {
+        for (int i = 0; i < n; i++) {
+            task(arg, i);
+        }
+        return;
+    }
+
+    if (pool.pid != getpid()) {
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_mutex_init(&pool.job_lock, NULL);
+        pthread_cond_init(&pool.work, NULL);
+        pthread_cond_init(&pool.done, NULL);
+        pool.pid = getpid();
+        pool.num_threads = 0;
+        pool.num_tasks = pool.next_task = 0;
+    }
+    pthread_mutex_lock(&pool.job_lock);
+    pthread_mutex_lock(&pool.lock);
+
+    // If a thread can't be started, the job runs on the ones there are.
+    int helpers = min(threads, n) - 1;
+    while (pool.num_threads < helpers) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_thread, (void *)(long)pool.num_threads) != 0) {
+            perror("Failed to start a filter thread");
+            break;
+        }
+        pthread_detach(thread);
+        pool.num_threads++;
+    }
+
+    pool.task = task;
+    pool.arg = arg;
+    pool.helpers = min(helpers, pool.num_threads);
+    pool.num_tasks = pool.unfinished = n;
+    pool.next_task = 0;
+    pthread_cond_broadcast(&pool.work);
+    run_tasks();
+    while (pool.unfinished > 0) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pool.helpers = 0;
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.job_lock);
+}
@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "bitmap.h"
+
+
+#define RING_MAGIC "BMPRING1"
+
+/*
+ * The start of a ring's memfd; the data follows it, RING_HEADER_SIZE bytes
+ * in. Each side's fields are on a cache line of their own. A side that
+ * has to wait says so in its waiting flag, and sleeps on the other side's
+ * sequence number, which is bumped whenever that side moves on; the other
+ * side only makes the wake-up call when the flag is set.
+ */
+typedef struct {
+    char magic[8];
+    size_t size;
+
+    // The writer's side.
+    size_t head __attribute__((aligned(64)));   // The bytes written.
+    uint32_t data_seq;
+    uint32_t writer_done;
+    uint32_t writer_waiting;
+    pid_t writer;
+
+    // The reader's side.
+    size_t tail __attribute__((aligned(64)));   // The bytes read.
+    uint32_t space_seq;
+    uint32_t reader_gone;
+    uint32_t reader_waiting;
+    pid_t reader;
+} RingHeader;
+
+#define RING_HEADER_SIZE 4096
+
+// How long a side sleeps before checking that the other is still running.
+#define RING_POLL_MS 100
+
+struct ring {
+    RingHeader *header;
+    unsigned char *data;
+    int writer;
+    size_t pos;         // This side's head or tail.
+};
+
+
+int ring_create(void) {
+    int fd = memfd_create("image_filter ring", 0);
+    if (fd < 0) {
+        return -1;
+    }
+    RingHeader header = {RING_MAGIC, RING_SIZE};
+    if (ftruncate(fd, RING_HEADER_SIZE + RING_SIZE) < 0 ||
+            pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int ring_set_pids(int fd, pid_t writer, pid_t reader) {
+    if (pwrite(fd, &writer, sizeof(writer), offsetof(RingHeader, writer)) != sizeof(writer) ||
+            pwrite(fd, &reader, sizeof(reader), offsetof(RingHeader, reader)) != sizeof(reader)) {
+        return -1;
+    }
+    return 0;
+}
+
+int is_ring(int fd) {
+    struct stat st;
+    char magic[8];
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+           st.st_size == RING_HEADER_SIZE + RING_SIZE &&
+           pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+           memcmp(magic, RING_MAGIC, sizeof(magic)) == 0;
+}
+
+Ring *ring_attach(int fd, int writer) {
+    if (!is_ring(fd)) {
+        return NULL;
+    }
+    Ring *ring = malloc(sizeof(Ring));
+    void *map = mmap(NULL, RING_HEADER_SIZE + RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    if (ring == NULL || map == MAP_FAILED) {
+        perror("Failed to map the ring");
+        free(ring);
+        return NULL;
+    }
+    ring->header = map;
+    ring->data = (unsigned char *)map + RING_HEADER_SIZE;
+    ring->writer = writer;
+    ring->pos = writer ? ring->header->head : ring->header->tail;
+    return ring;
+}
+
+
+static void wake(uint32_t *seq, uint32_t *waiting) {
+    __atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, seq, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+    }
+}
+
+/*
+ * Sleep until the other side bumps seq from the value it had when
+ * ready() was last false, ready() turns true, or RING_POLL_MS pass.
+ * Return 0, or -1 if the other side has exited.
+ */
+static int wait_on(uint32_t *seq, uint32_t *waiting, const pid_t *peer,
+                   int (*ready)(const Ring *), const Ring *ring) {
+    uint32_t value = __atomic_load_n(seq, __ATOMIC_SEQ_CST);
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (!ready(ring)) {
+        struct timespec timeout = {0, RING_POLL_MS * 1000000L};
+        syscall(SYS_futex, seq, FUTEX_WAIT, value, &timeout, NULL, 0);
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+    // A side that has exited stays a zombie until image_filter waits for
+    // it, which is when its pid goes.
+    pid_t pid = __atomic_load_n(peer, __ATOMIC_RELAXED);
+    return ready(ring) || pid == 0 || kill(pid, 0) == 0 || errno != ESRCH ? 0 : -1;
+}
+
+// Whether the reader has data, or the writer is done; and whether the
+// writer has room, or the reader is gone.
+static int readable(const Ring *ring) {
+    return __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE) != ring->pos ||
+           __atomic_load_n(&ring->header->writer_done, __ATOMIC_ACQUIRE);
+}
+
+static int writable(const Ring *ring) {
+    return ring->pos - __atomic_load_n(&ring->header->tail, __ATOMIC_ACQUIRE) < RING_SIZE ||
+           __atomic_load_n(&ring->header->reader_gone, __ATOMIC_ACQUIRE);
+}
+
+
+int ring_read(Ring *ring, void *dst, size_t len) {
+    RingHeader *header = ring->header;
+    unsigned char *out = dst;
+    while (len > 0) {
+        size_t available = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE) - ring->pos;
+        if (available == 0) {
+            if (__atomic_load_n(&header->writer_done, __ATOMIC_ACQUIRE) &&
+                    __atomic_load_n(&header->head, __ATOMIC_ACQUIRE) == ring->pos) {
+                fprintf(stderr, "Failed to read the image: it ends early\n");
+                return -1;
+            }
+            if (wait_on(&header->data_seq, &header->reader_waiting, &header->writer,
+                        readable, ring) < 0) {
+                fprintf(stderr, "Failed to read the image: the writer is gone\n");
+                return -1;
+            }
+            continue;
+        }
+        size_t offset = ring->pos & (RING_SIZE - 1);
+        size_t n = min(min(len, available), RING_SIZE - offset);
+        if (out != NULL) {
+            memcpy(out, ring->data + offset, n);
+            out += n;
+        }
+        ring->pos += n;
+        len -= n;
+        __atomic_store_n(&header->tail, ring->pos, __ATOMIC_RELEASE);
+        wake(&header->space_seq, &header->writer_waiting);
+    }
+    return 0;
+}
+
+static void publish(Ring *ring) {
+    __atomic_store_n(&ring->header->head, ring->pos, __ATOMIC_RELEASE);
+    wake(&ring->header->data_seq, &ring->header->reader_waiting);
+}
+
+int ring_write(Ring *ring, const void *src, size_t len) {
+    RingHeader *header = ring->header;
+    const unsigned char *in = src;
+    while (len > 0) {
+        if (__atomic_load_n(&header->reader_gone, __ATOMIC_ACQUIRE)) {
+            fprintf(stderr, "Failed to write the image: the reader is gone\n");
+            return -1;
+        }
+        size_t space = RING_SIZE - (ring->pos - __atomic_load_n(&header->tail,
+                                                                 __ATOMIC_ACQUIRE));
+        if (space == 0) {
+            publish(ring);
+            if (wait_on(&header->space_seq, &header->writer_waiting, &header->reader,
+                        writable, ring) < 0) {
+                fprintf(stderr, "Failed to write the image: the reader is gone\n");
+                return -1;
+            }
+            continue;
+        }
+        size_t offset = ring->pos & (RING_SIZE - 1);
+        size_t n = min(min(len, space), RING_SIZE - offset);
+        if (in != NULL) {
+            memcpy(ring->data + offset, in, n);
+            in += n;
+        } else {
+            memset(ring->data + offset, 0, n);
+        }
+        ring->pos += n;
+        len -= n;
+    }
+    // What was written is passed on at once: a row at a time, as the
+    // chain writes them.
+    publish(ring);
+    return 0;
+}
+
+void ring_detach(Ring *ring) {
+    RingHeader *header = ring->header;
+    if (ring->writer) {
+        __atomic_store_n(&header->writer_done, 1, __ATOMIC_RELEASE);
+        wake(&header->data_seq, &header->reader_waiting);
+    } else {
+        __atomic_store_n(&header->reader_gone, 1, __ATOMIC_RELEASE);
+        wake(&header->space_seq, &header->writer_waiting);
+    }
+    munmap(header, RING_HEADER_SIZE + RING_SIZE);
+    free(ring);
+}
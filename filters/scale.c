@@ -1,76 +1,329 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <sys/wait.h>
+#include <string.h>
 #include "bitmap.h"
-#include <math.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+
+#define RESAMPLE_ONE (1 << RESAMPLE_BITS)
+
+static double sinc(double x) {
+    if (x == 0) {
+        return 1;
+    }
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+// The bilinear and Lanczos-3 filters, at a distance of x input pixels.
+static double triangle(double x) {
+    x = fabs(x);
+    return x < 1 ? 1 - x : 0;
+}
+
+static double lanczos(double x) {
+    return fabs(x) < 3 ? sinc(x) * sinc(x / 3) : 0;
+}
 
 /*
- * Main filter loop.
- * This function is responsible for doing the following:
- *   1. read the entire image.
- *   2. scales it up by the scale factor which store in bmp->scaleFactor
- *   3. write out the scaled image.
+ * Store in w the weights of the input pixels [*first, *first + n) that
+ * output pixel x is computed from, not yet scaled to add up to 1, and
+ * return n. A pixel covers [x, x + 1) of its axis, and the output pixels
+ * are spread evenly over the input.
  */
-void scale_filter(Bitmap *bmp) {
-    int original_height = bmp->height / bmp->scaleFactor;
-    int original_width = bmp->width / bmp->scaleFactor;
+static int weigh(enum resample_mode mode, int in_size, int out_size, int x,
+                 double *w, int *first) {
+    if (mode == RESAMPLE_BOX && in_size <= out_size) {
+        // The input pixel under the output pixel's centre.
+        *first = (2LL * x + 1) * in_size / (2LL * out_size);
+        w[0] = 1;
+        return 1;
+    }
+    if (mode == RESAMPLE_BOX) {
+        // How much of each input pixel the output pixel covers, in units of
+        // 1/out_size of a pixel, so whole-number shrinking is exact.
+        long long start = (long long)x * in_size, end = start + in_size;
+        int n = 0;
+        *first = start / out_size;
+        for (long long i = *first; i * out_size < end; i++) {
+            w[n++] = min(end, (i + 1) * out_size) - max(start, i * out_size);
+        }
+        return n;
+    }
+
+    // The filter is centred on the output pixel's centre, and stretched to
+    // cover all the input pixels under it when shrinking.
+    double ratio = (double)in_size / out_size, stretch = max(ratio, 1.0);
+    double support = (mode == RESAMPLE_LANCZOS ? 3 : 1) * stretch;
+    double centre = (x + 0.5) * ratio;
+    int start = max((int)floor(centre - support + 0.5), 0);
+    int end = min((int)floor(centre + support + 0.5), in_size);
+    int n = 0;
+    for (int i = start; i < end; i++) {
+        double d = (i + 0.5 - centre) / stretch;
+        w[n++] = mode == RESAMPLE_LANCZOS ? lanczos(d) : triangle(d);
+    }
+
+    // Leave out the pixels at the ends the filter gives no weight.
+    int skip = 0;
+    while (n > 1 && w[n - 1] == 0) {
+        n--;
+    }
+    while (skip < n - 1 && w[skip] == 0) {
+        skip++;
+    }
+    memmove(w, w + skip, (n - skip) * sizeof(double));
+    *first = start + skip;
+    return n - skip;
+}
+
+void free_resample_axis(ResampleAxis *axis) {
+    free(axis->first);
+    free(axis->weights);
+    axis->first = NULL;
+    axis->weights = NULL;
+}
+
+int resample_axis(ResampleAxis *axis, enum resample_mode mode, int in_size, int out_size) {
+    // The most pixels weigh can give, and then the most it does give.
+    double stretch = max((double)in_size / out_size, 1.0);
+    int bound = (int)(2 * stretch * (mode == RESAMPLE_LANCZOS ? 3 : 1)) + 3;
+    double *w = malloc(bound * sizeof(double));
+    axis->first = malloc(out_size * sizeof(int));
+    axis->weights = NULL;
+    if (w == NULL || axis->first == NULL) {
+        free(w);
+        free_resample_axis(axis);
+        return -1;
+    }
+    axis->taps = 1;
+    for (int x = 0; x < out_size; x++) {
+        axis->taps = max(axis->taps, weigh(mode, in_size, out_size, x, w, &axis->first[x]));
+    }
+
+    // Every output pixel gets taps weights, with its own where they fall
+    // in the image, and zeros around them.
+    int taps = axis->taps;
+    axis->weights = calloc((size_t)out_size * taps, sizeof(short));
+    if (axis->weights == NULL) {
+        free(w);
+        free_resample_axis(axis);
+        return -1;
+    }
+    for (int x = 0; x < out_size; x++) {
+        int start;
+        int n = weigh(mode, in_size, out_size, x, w, &start);
+        axis->first[x] = min(start, in_size - taps);
+        short *weights = axis->weights + (size_t)x * taps + (start - axis->first[x]);
 
-    Pixel **original = malloc(original_height * sizeof(Pixel *));
-    if (!original) {
-        perror("Failed to allocate memory for original image");
+        // Round the weights to add up to exactly RESAMPLE_ONE, putting what
+        // rounding leaves over on the largest.
+        double sum = 0;
+        for (int t = 0; t < n; t++) {
+            sum += w[t];
+        }
+        int total = 0, largest = 0;
+        for (int t = 0; t < n; t++) {
+            weights[t] = lround(w[t] / sum * RESAMPLE_ONE);
+            total += weights[t];
+            if (weights[t] > weights[largest]) {
+                largest = t;
+            }
+        }
+        weights[largest] += RESAMPLE_ONE - total;
+    }
+    free(w);
+    return 0;
+}
+
+
+// Turn a weighted sum of channels back into a channel.
+static inline unsigned char clamp_sum(int sum) {
+    return sum <= 0 ? 0 : sum >= 255 << RESAMPLE_BITS ? 255 : sum >> RESAMPLE_BITS;
+}
+
+void resample_row(const ResampleAxis *axis, const Pixel *in, Pixel *out, int out_width) {
+    int taps = axis->taps;
+    if (taps == 1) {
+        for (int j = 0; j < out_width; j++) {
+            out[j] = in[axis->first[j]];
+        }
         return;
     }
+    for (int j = 0; j < out_width; j++) {
+        const Pixel *pixels = in + axis->first[j];
+        const short *w = axis->weights + (size_t)j * taps;
+        int blue = RESAMPLE_ONE / 2, green = RESAMPLE_ONE / 2, red = RESAMPLE_ONE / 2;
+        for (int t = 0; t < taps; t++) {
+            blue += w[t] * pixels[t].blue;
+            green += w[t] * pixels[t].green;
+            red += w[t] * pixels[t].red;
+        }
+        out[j].blue = clamp_sum(blue);
+        out[j].green = clamp_sum(green);
+        out[j].red = clamp_sum(red);
+    }
+}
 
-    for (int i = 0; i < original_height; i++) {
-        original[i] = malloc(original_width * sizeof(Pixel));
-        if (!original[i]) {
-            perror("Failed to allocate memory for a row");
-            for (int k = 0; k < i; k++) {
-                free(original[k]);
+/*
+ * The column pass sums the taps input rows a byte at a time, over the
+ * output bytes [start, end) of the row, with the first tap in rows[r] and
+ * the others after it in the ring. The scalar version adds each input row
+ * to the sums in turn, a chunk of the row at a time; the SSE2 one does 16
+ * bytes at a time, two rows at a time, with pmaddwd.
+ */
+#define COLUMN_CHUNK 768
+
+static void column_scalar(const ImageBuf *rows, int r, const short *w, int taps,
+                          unsigned char *out, size_t start, size_t end) {
+    for (; start < end; start += COLUMN_CHUNK) {
+        int sums[COLUMN_CHUNK];
+        size_t n = min(end - start, COLUMN_CHUNK);
+        for (size_t b = 0; b < n; b++) {
+            sums[b] = RESAMPLE_ONE / 2;
+        }
+        for (int t = 0, i = r; t < taps; t++, i = i + 1 == taps ? 0 : i + 1) {
+            const unsigned char *row = (const unsigned char *)image_row(rows, i) + start;
+            int weight = w[t];
+            if (weight == 0) {
+                continue;
             }
-            free(original);
-            return;
+            for (size_t b = 0; b < n; b++) {
+                sums[b] += weight * row[b];
+            }
+        }
+        for (size_t b = 0; b < n; b++) {
+            out[start + b] = clamp_sum(sums[b]);
         }
+    }
+}
 
-        if (fread(original[i], sizeof(Pixel), original_width, stdin) != original_width) {
-            perror("Failed to read pixels");
-            for (int k = 0; k <= i; k++) {
-                free(original[k]);
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void column_sse2(const ImageBuf *rows, int r, const short *w, int taps,
+                        unsigned char *out, size_t start, size_t end) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi32(RESAMPLE_ONE / 2);
+    size_t vector_end = start + ((end - start) & ~(size_t)15);
+    for (size_t b = start; b < vector_end; b += 16) {
+        __m128i sums[4] = {half, half, half, half};
+        for (int t = 0, i = r; t < taps; t += 2) {
+            // Interleave the bytes of a pair of rows, and widen them to
+            // 16 bits, so each pmaddwd sums two taps for four bytes. An odd
+            // last tap is paired with itself, and a weight of 0.
+            const unsigned char *a = (const unsigned char *)image_row(rows, i);
+            i = i + 1 == taps ? 0 : i + 1;
+            const unsigned char *c = t + 1 < taps ? (const unsigned char *)image_row(rows, i) : a;
+            i = i + 1 == taps ? 0 : i + 1;
+            int weights = (unsigned short)w[t] |
+                          (t + 1 < taps ? (unsigned)(unsigned short)w[t + 1] << 16 : 0);
+            if (weights == 0) {
+                continue;
             }
-            free(original);
-            return;
+            __m128i pair = _mm_set1_epi32(weights);
+            __m128i x = _mm_loadu_si128((const __m128i *)(a + b));
+            __m128i y = _mm_loadu_si128((const __m128i *)(c + b));
+            __m128i lo = _mm_unpacklo_epi8(x, y), hi = _mm_unpackhi_epi8(x, y);
+            sums[0] = _mm_add_epi32(sums[0], _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), pair));
+            sums[1] = _mm_add_epi32(sums[1], _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), pair));
+            sums[2] = _mm_add_epi32(sums[2], _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), pair));
+            sums[3] = _mm_add_epi32(sums[3], _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), pair));
         }
+        // Shifting and packing with saturation clamps as clamp_sum does.
+        __m128i low = _mm_packs_epi32(_mm_srai_epi32(sums[0], RESAMPLE_BITS),
+                                      _mm_srai_epi32(sums[1], RESAMPLE_BITS));
+        __m128i high = _mm_packs_epi32(_mm_srai_epi32(sums[2], RESAMPLE_BITS),
+                                       _mm_srai_epi32(sums[3], RESAMPLE_BITS));
+        _mm_storeu_si128((__m128i *)(out + b), _mm_packus_epi16(low, high));
     }
+    column_scalar(rows, r, w, taps, out, vector_end, end);
+}
+#endif
+
+void resample_column(const ResampleAxis *axis, int i, const ImageBuf *rows, Pixel *out,
+                     int width) {
+    int taps = axis->taps;
+    const short *w = axis->weights + (size_t)i * taps;
+    size_t len = (size_t)width * sizeof(Pixel);
+    if (taps == 1) {
+        memcpy(out, image_row(rows, 0), len);
+        return;
+    }
+    int r = axis->first[i] % taps;
+#ifdef HAVE_X86_SIMD
+    if (simd_level >= SIMD_SSE2) {
+        column_sse2(rows, r, w, taps, (unsigned char *)out, 0, len);
+        return;
+    }
+#endif
+    column_scalar(rows, r, w, taps, (unsigned char *)out, 0, len);
+}
 
-    for (int i = 0; i < bmp->height; i++) {
-        for (int j = 0; j < bmp->width; j++) {
-            int orig_row = i / bmp->scaleFactor;
-            int orig_col = j / bmp->scaleFactor;
-            Pixel scaled_pixel = original[orig_row][orig_col];
 
-            if (fwrite(&scaled_pixel, sizeof(Pixel), 1, stdout) != 1) {
-                perror("Failed to write scaled pixel");
-                for (int k = 0; k < original_height; k++) {
-                    free(original[k]);
-                }
-                free(original);
-                return;
+/*
+ * Resample the image in to the size of out, a row at a time: the input
+ * rows each output row needs are resampled along the row into a ring, and
+ * then down the column. With nearest-neighbour scaling, an output row
+ * from the same input row as the one before it is a copy of it.
+ */
+static void resize_image(const ImageBuf *in, ImageBuf *out, enum resample_mode mode) {
+    int width = out->width, height = out->height;
+    ResampleAxis cols = {0}, rows = {0};
+    ImageBuf ring = {NULL};
+    if (resample_axis(&cols, mode, in->width, width) < 0 ||
+            resample_axis(&rows, mode, in->height, height) < 0 ||
+            image_alloc(&ring, width, rows.taps, IMAGE_INTERLEAVED) < 0) {
+        perror("Failed to allocate memory for the scaling");
+        for (int i = 0; i < height; i++) {
+            memset(image_row(out, i), 0, width * sizeof(Pixel));
+        }
+    } else {
+        int fetched = 0;
+        for (int i = 0; i < height; i++) {
+            Pixel *row = image_row(out, i);
+            int first = rows.first[i];
+            if (rows.taps == 1 && i > 0 && first == rows.first[i - 1]) {
+                memcpy(row, image_row(out, i - 1), width * sizeof(Pixel));
+                continue;
             }
+            if (rows.taps == 1) {
+                resample_row(&cols, image_row(in, first), row, width);
+                continue;
+            }
+            for (fetched = max(fetched, first); fetched < first + rows.taps; fetched++) {
+                resample_row(&cols, image_row(in, fetched), image_row(&ring, fetched % rows.taps),
+                             width);
+            }
+            resample_column(&rows, i, &ring, row, width);
         }
     }
-    
-    for (int i = 0; i < original_height; i++) {
-        free(original[i]);
-    }
-    free(original);
+    image_free(&ring);
+    free_resample_axis(&cols);
+    free_resample_axis(&rows);
+}
 
+/*
+ * Scale the image to the size of out: nearest neighbour when it grows,
+ * and the average of the pixels each output pixel covers when it shrinks.
+ */
+void scale_filter(const ImageBuf *in, ImageBuf *out) {
+    resize_image(in, out, RESAMPLE_BOX);
 }
 
-int main() {
-    // Run the filter program with copy_filter to process the pixels.
-    // You shouldn't need to change this implementation.
-    run_filter(scale_filter, 2);
-    return 0;
-}
\ No newline at end of file
+/*
+ * Scale the image to the size of out with bilinear or Lanczos-3
+ * interpolation (which averages over the pixels each output pixel covers
+ * when the image shrinks).
+ */
+void bilinear_filter(const ImageBuf *in, ImageBuf *out) {
+    resize_image(in, out, RESAMPLE_BILINEAR);
+}
+
+void lanczos_filter(const ImageBuf *in, ImageBuf *out) {
+    resize_image(in, out, RESAMPLE_LANCZOS);
+}
@@ -7,106 +7,557 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <pthread.h>
 #include <netinet/in.h>    /* Internet domain header */
 
 #include "socket.h"
 #include "request.h"
 #include "response.h"
+#include "worker.h"
+#include "cache.h"
 
 #ifndef PORT
 #define PORT 30000
 #endif
 
 #define BACKLOG 10
-#define MAX_CLIENTS 10
+#define INITIAL_CLIENTS 64    // Initial size of the fd-indexed client table.
+#define MAX_EVENTS 64         // Events fetched per epoll_wait call.
+
+// epoll token for the listening socket; clients use their fd.
+#define LISTEN_TOKEN (WORKER_TOKEN_BASE - 1)
+
+
+// One event loop thread: its own listening socket, epoll instance,
+// fd-indexed client table and worker pool.
+typedef struct {
+    pthread_t thread;
+    int listenfd;
+    int epfd;
+    ClientState *clients;
+    int num_clients;
+    WorkerPool *pool;
+    int idle_head, idle_tail;  // Connections by last activity (fds).
+    unsigned long accepts;     // Connections accepted by this loop.
+    unsigned long requests;    // Requests handed off by this loop.
+} EventLoop;
+
+
+// The worker pool of the current loop thread, or NULL to fork a child
+// for every request.
+static __thread WorkerPool *pool = NULL;
+
+
+/*
+ * Check the values in client->reqData to determine how to respond to the
+ * request, and write the response to client->sock. This runs in a worker
+ * process or in a child forked for the request.
+ *
+ * On return, client->keep_alive says whether the connection can carry
+ * another request; client->buf holds whatever was read past this one.
+ */
+void respond(ClientState *client) {
+    int may_keep_alive = client->num_requests < max_keep_alive_requests;
+    response_set_keep_alive(client->keep_alive && may_keep_alive);
+
+    if (strcmp(client->reqData->method, GET) == 0) {
+        if (strcmp(client->reqData->path, MAIN_HTML) == 0) {
+            main_html_response(client->sock);
+        } else if (strcmp(client->reqData->path, IMAGE_FILTER) == 0){
+            image_filter_response(client->sock, client->reqData);
+        } else {
+            not_found_response(client->sock);
+        }
+    } else if (strcmp(client->reqData->method, POST) == 0) {
+        if (strcmp(client->reqData->path, IMAGE_UPLOAD) == 0) {
+            image_upload_response(client);
+        } else {
+            // The request body hasn't been read, so don't reuse the
+            // connection.
+            response_set_keep_alive(0);
+            not_found_response(client->sock);
+        }
+    } else {
+        response_set_keep_alive(0);
+    }
+
+    client->keep_alive = response_keep_alive();
+}
+
+
+/*
+ * Serve every request on a connection, in a child forked for it: respond,
+ * then wait (up to the keep-alive timeout) for the next request.
+ */
+static void serve_connection(ClientState *client) {
+    while (1) {
+        respond(client);
+        if (!client->keep_alive) {
+            break;
+        }
+        clear_request(client);
+
+        // Pipelined requests may already be buffered.
+        int parsed;
+        while ((parsed = parse_request(client)) == 0) {
+            int bytes_read = read_from_client(client);
+            if (bytes_read < 0 && errno == ENOBUFS) {
+                parsed = PARSE_TOO_LARGE;
+                break;
+            } else if (bytes_read <= 0) {
+                close(client->sock);
+                return;
+            }
+        }
+        if (parsed == PARSE_TOO_LARGE) {
+            header_fields_too_large_response(client->sock);
+        }
+        if (parsed < 0) {
+            break;
+        }
+    }
+    lingering_close(client->sock);
+}
+
+
+int handle_client(ClientState *client);
+
+/*
+ * Answer a request whose head doesn't fit with 431, and leave the
+ * connection to be drained and closed.
+ */
+static int reject_too_large(ClientState *client) {
+    response_set_keep_alive(0);
+    header_fields_too_large_response(client->sock);
+    shutdown(client->sock, SHUT_WR);
+    client->closing = 1;
+    return handle_client(client);
+}
+
+/*
+ * Answer a request whose start line is malformed with 400, and leave the
+ * connection to be drained and closed the same way.
+ */
+static int reject_malformed(ClientState *client) {
+    fprintf(stderr, "Malformed request line\n");
+    response_set_keep_alive(0);
+    bad_request_response(client->sock, "Malformed request line.");
+    shutdown(client->sock, SHUT_WR);
+    client->closing = 1;
+    return handle_client(client);
+}
 
 
 /*
  * Read data from a client socket, and, if there is enough information to
- * determine the type of request, spawn a child process to respond to the 
- * request.
+ * determine the type of request, hand it to a worker (or spawn a child
+ * process) to respond to the request.
+ *
+ * The socket is non-blocking and registered edge-triggered, so this keeps
+ * reading until either the whole request head is parsed or the socket has no
+ * more data (read fails with EAGAIN). Parsing starts from what is already
+ * buffered, which may be the next request pipelined on a persistent
+ * connection.
+ *
+ * A connection whose response has been sent but that wasn't kept alive
+ * is only drained here until the client closes it. So is one whose
+ * request head is too large, after a 431 response, or malformed, after
+ * a 400.
  *
  * Return 1 if one of the conditions hold:
  *   a) No bytes were read from the socket. (The client has likely closed the 
  *      connection.)
- *   b) A child process has been created to respond to the request.
+ *   b) The request has been passed to a worker, or a child process has been
+ *      created to respond to it.
  *
  * This return value indicates that the server process should close the socket.
  * Otherwise, return 0 (indicating that the server must continue to monitor the 
  * socket).
- *
- * Complete this function according to the comments within.
- * Note that you'll be doing this incrementally, adding to the function as you
- * complete the different parts of the assignment.
  */
 int handle_client(ClientState *client) {
+    if (client->closing) {
+        char buf[MAXLINE];
+        ssize_t n;
+        while ((n = read(client->sock, buf, sizeof(buf))) > 0) {
+            // Discard.
+        }
+        return (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 0 : 1;
+    }
+
     // Read in data from the client's socket into its buffer, 
     // and update num_bytes. If no bytes were read, return 1.
+    while (1) {
+        int parsed = parse_request(client);
+        if (parsed == PARSE_MALFORMED) {
+            return reject_malformed(client);
+        } else if (parsed == PARSE_TOO_LARGE) {
+            return reject_too_large(client);
+        } else if (parsed > 0) {
+            break;
+        }
 
-    //IMPLEMENT THIS
-    int bytes_read = read_from_client(client);
+        int bytes_read = read_from_client(client);
+        if (bytes_read == 0) {
+            return 1;
+        } else if (bytes_read < 0 && errno == ENOBUFS) {
+            return reject_too_large(client);
+        } else if (bytes_read < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : 1;
+        }
+    }
 
-    if (bytes_read <= 0) {
+    // At this point client->reqData is not null, and so we are guaranteed
+    // to hand the request off (so we return 1). With a worker pool, the
+    // socket and the parsed request are passed to a pre-forked worker,
+    // which hands the connection back after the response.
+    // Otherwise fork: in the *parent* process, just return 1; the *child*
+    // serves the connection and calls exit(0) (rather than return) to
+    // prevent it from executing the main server loop.
+    if (pool != NULL) {
+        if (pool_dispatch(pool, client) < 0) {
+            fprintf(stderr, "Couldn't hand request to a worker\n");
+        }
         return 1;
-    } 
+    }
 
-    if (parse_req_start_line(client) < 0) {
-        perror("parse req start line");
-        exit(0);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
     }
-    // At this point client->reqData is not null, and so we are guaranteed
-    // to spawn a child process to handle the request (so we return 1).
-    // First, call fork. In the *parent* process, just return 1.
-    // In the *child* process, check the values in client->reqData to determine
-    // how to respond to the request.
-    // The child should call exit(0) (rather than return) to prevent it from
-    // executing the main server loop that listens for new requests.
-
-
-    //IMPLEMENT THIS
-    if (client->reqData != NULL) {
-        pid_t pid = fork();
-        if (pid < 0) {
-            perror("fork");
+    if (pid > 0) {
+        return 1; 
+    }
+
+    // The child serves the connection with plain blocking I/O, and
+    // with the default signal mask (the server blocks SIGCHLD).
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    set_nonblocking(client->sock, 0);
+    set_recv_timeout(client->sock, keep_alive_timeout);
+
+    serve_connection(client);
+    exit(0);
+}
+
+
+/*
+ * Register fd with the epoll instance; events for it carry the given token.
+ */
+static void watch_fd(int epfd, int fd, uint32_t events, uint64_t token) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = token;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+
+/*
+ * Reap every child that has exited, reporting any that failed.
+ * Workers that die are restarted once their loop has seen their channel
+ * close (see restart_workers).
+ */
+static void reap_children(void) {
+    int status;
+    int pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "Child [%d] failed with signal %d\n", pid,
+                    WTERMSIG(status));
+        }
+    }
+}
+
+
+/*
+ * Append the client at fd to the loop's idle list, which is kept in order
+ * of last activity so that expired connections are found at its head.
+ */
+static void idle_link(EventLoop *loop, int fd) {
+    ClientState *client = &loop->clients[fd];
+    client->last_active = time(NULL);
+    client->next = -1;
+    client->prev = loop->idle_tail;
+    if (loop->idle_tail >= 0) {
+        loop->clients[loop->idle_tail].next = fd;
+    } else {
+        loop->idle_head = fd;
+    }
+    loop->idle_tail = fd;
+}
+
+static void idle_unlink(EventLoop *loop, int fd) {
+    ClientState *client = &loop->clients[fd];
+    if (client->prev >= 0) {
+        loop->clients[client->prev].next = client->next;
+    } else {
+        loop->idle_head = client->next;
+    }
+    if (client->next >= 0) {
+        loop->clients[client->next].prev = client->prev;
+    } else {
+        loop->idle_tail = client->prev;
+    }
+    client->prev = client->next = -1;
+}
+
+
+/*
+ * Add a connection to the loop's fd-indexed client table, growing it if
+ * necessary, and start watching it.
+ */
+static ClientState *add_client(EventLoop *loop, int fd) {
+    if (fd >= loop->num_clients) {
+        int new_n = loop->num_clients * 2;
+        while (fd >= new_n) {
+            new_n *= 2;
+        }
+        loop->clients = grow_clients(loop->clients, loop->num_clients, new_n);
+        loop->num_clients = new_n;
+    }
+    ClientState *client = &loop->clients[fd];
+    client->sock = fd;
+    idle_link(loop, fd);
+    watch_fd(loop->epfd, fd, EPOLLIN | EPOLLRDHUP | EPOLLET, fd);
+    return client;
+}
+
+
+/*
+ * Stop watching a connection and close the loop's copy of it.
+ */
+static void close_client(EventLoop *loop, int fd) {
+    idle_unlink(loop, fd);
+    // A worker or child may still hold the socket open, so the fd
+    // must leave the interest list explicitly before closing.
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+    remove_client(&loop->clients[fd]);
+}
+
+
+/*
+ * Close every connection that has been idle for keep_alive_timeout seconds.
+ */
+static void expire_idle(EventLoop *loop) {
+    time_t now = time(NULL);
+    while (loop->idle_head >= 0 &&
+           now - loop->clients[loop->idle_head].last_active >= keep_alive_timeout) {
+        close_client(loop, loop->idle_head);
+    }
+}
+
+
+/*
+ * Run handle_client on the connection at fd and close it if it is done.
+ */
+static void process_client(EventLoop *loop, int fd) {
+    ClientState *client = &loop->clients[fd];
+    int done = handle_client(client);
+    if (done) {
+        if (client->reqData != NULL) {
+            __atomic_add_fetch(&loop->requests, 1, __ATOMIC_RELAXED);
+        }
+        close_client(loop, fd);
+    } else {
+        idle_unlink(loop, fd);
+        idle_link(loop, fd);
+    }
+}
+
+
+/*
+ * Take back a persistent connection from a worker and continue with any
+ * request already buffered for it.
+ */
+static void resume_client(EventLoop *loop, ClientState *returned) {
+    set_nonblocking(returned->sock, 1);
+    ClientState *client = add_client(loop, returned->sock);
+    client->keep_alive = returned->keep_alive;
+    client->num_requests = returned->num_requests;
+    client->closing = returned->closing;
+    reserve_buffer(client, returned->num_bytes + 1);
+    client->num_bytes = returned->num_bytes;
+    memcpy(client->buf, returned->buf, returned->num_bytes);
+    client->buf[client->num_bytes] = '\0';
+    process_client(loop, returned->sock);
+}
+
+
+/*
+ * Accept every pending connection on the loop's listening socket.
+ */
+static void accept_clients(EventLoop *loop) {
+    // Edge-triggered: accept until the queue is empty.
+    int new_client_fd;
+    while ((new_client_fd = accept_connection(loop->listenfd)) >= 0) {
+        add_client(loop, new_client_fd);
+        __atomic_add_fetch(&loop->accepts, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+ * The body of one event loop thread.
+ */
+static void *run_loop(void *arg) {
+    EventLoop *loop = arg;
+    pool = loop->pool;
+
+    struct epoll_event events[MAX_EVENTS];
+    ClientState returned;
+
+    // Main server loop.
+    while (1) {
+        // Wake up once a second while there are connections to time out.
+        int timeout = loop->idle_head >= 0 ? 1000 : -1;
+        int nready = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout);
+        if (nready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
             exit(1);
         }
-        if (pid > 0) {
-            return 1; 
-        } else {
-            if (strcmp(client->reqData->method, "GET") == 0) {
-                if (strcmp(client->reqData->path, MAIN_HTML) == 0) {
-                    main_html_response(client->sock);
-                } else if (strcmp(client->reqData->path, IMAGE_FILTER) == 0){
-                    image_filter_response(client->sock, client->reqData);
-                } else {
-                    not_found_response(client->sock);
-                }
-            } else if (strcmp(client->reqData->method, "POST") == 0) {
-                if (strcmp(client->reqData->path, IMAGE_UPLOAD) == 0) {
-                    image_upload_response(client);
-                } else {
-                    not_found_response(client->sock);
+
+        for (int i = 0; i < nready; i++) {
+            uint64_t token = events[i].data.u64;
+
+            if (IS_WORKER_TOKEN(token)) {
+                if (pool_worker_done(pool, WORKER_INDEX(token), &returned)) {
+                    resume_client(loop, &returned);
                 }
+                continue;
             }
-        
-            close(client->sock);
-            exit(0);
+
+            if (token == LISTEN_TOKEN) {    // New client connection(s).
+                accept_clients(loop);
+                continue;
+            }
+
+            // The client table is indexed by socket fd.
+            int fd = token;
+            if (loop->clients[fd].sock < 0) {
+                continue;
+            }
+            process_client(loop, fd);
         }
 
+        expire_idle(loop);
+    }
+    return NULL;
+}
+
+
+/*
+ * Start a replacement for every worker that has died. A loop that sees a
+ * worker's channel close raises SIGUSR2, so that this runs in the main
+ * thread: forking from a loop thread would copy the process while the
+ * other loops are in the middle of their work.
+ */
+static void restart_workers(EventLoop *loops, int num_loops) {
+    for (int i = 0; i < num_loops; i++) {
+        if (loops[i].pool != NULL) {
+            pool_restart_workers(loops[i].pool);
+        }
     }
-    
-    return 0;
+}
+
+
+/*
+ * Print the accept and request counters of every loop, and the cache
+ * counters, to stderr.
+ */
+static void print_loop_stats(EventLoop *loops, int num_loops) {
+    for (int i = 0; i < num_loops; i++) {
+        fprintf(stderr, "Loop %d: %lu accepts, %lu requests\n", i,
+                __atomic_load_n(&loops[i].accepts, __ATOMIC_RELAXED),
+                __atomic_load_n(&loops[i].requests, __ATOMIC_RELAXED));
+    }
+    print_cache_stats();
 }
 
 
 int main(int argc, char **argv) {
-    ClientState *clients = init_clients(MAX_CLIENTS);
+    // By default run one event loop and one worker per core;
+    // -w 0 forks for every request instead of using workers. Every loop
+    // gets at least one worker, so there are never more loops than them.
+    int num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_loops = num_cpus;
+    int num_workers = num_cpus;
+    int backlog = BACKLOG;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:w:b:k:r:H:c:C:T:")) != -1) {
+        switch (opt) {
+        case 't':
+            num_loops = strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            num_workers = strtol(optarg, NULL, 10);
+            break;
+        case 'b':
+            backlog = strtol(optarg, NULL, 10);
+            break;
+        case 'k':
+            keep_alive_timeout = strtol(optarg, NULL, 10);
+            break;
+        case 'r':
+            max_keep_alive_requests = strtol(optarg, NULL, 10);
+            break;
+        case 'H':
+            max_request_head = strtol(optarg, NULL, 10);
+            break;
+        case 'c':
+            cache_memory_mb = strtol(optarg, NULL, 10);
+            break;
+        case 'C':
+            cache_disk_mb = strtol(optarg, NULL, 10);
+            break;
+        case 'T':
+            filter_threads = strtol(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t num_loops] [-w num_workers] "
+                    "[-b backlog] [-k keep_alive_timeout] "
+                    "[-r max_keep_alive_requests] [-H max_request_head] "
+                    "[-c cache_memory_mb] [-C cache_disk_mb] "
+                    "[-T filter_threads]\n"
+                    "  num_loops is at most num_workers; "
+                    "-w 0 forks a process for every request\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if (num_loops < 1) {
+        num_loops = 1;
+    }
+    if (num_workers < 0) {
+        num_workers = 0;
+    } else if (num_workers > 0 && num_loops > num_workers) {
+        fprintf(stderr, "Only %d workers: running %d loops\n", num_workers, num_workers);
+        num_loops = num_workers;
+    }
+    if (cache_memory_mb < 0) {
+        cache_memory_mb = 0;
+    }
+    if (cache_disk_mb < 0) {
+        cache_disk_mb = 0;
+    }
+    filter_threads = max(1, min(filter_threads, MAX_FILTER_THREADS));
+    if (max_request_head < MAXLINE) {
+        max_request_head = MAXLINE;
+    } else if (max_request_head > MAX_REQUEST_HEAD_LIMIT) {
+        max_request_head = MAX_REQUEST_HEAD_LIMIT;
+    }
 
     struct sockaddr_in *servaddr = init_server_addr(PORT);
 
-    // Create an fd to listen to new connections.
-    int listenfd = setup_server_socket(servaddr, BACKLOG);
-    
     // Print out information about this server
     char host[MAX_HOSTNAME];
     if ((gethostname(host, sizeof(host))) == -1) {
@@ -115,75 +566,78 @@ int main(int argc, char **argv) {
     }
     fprintf(stderr, "Server hostname: %s\n", host);
     fprintf(stderr, "Port: %d\n", PORT);
+    fprintf(stderr, "Loops: %d, workers: %d, backlog: %d\n",
+            num_loops, num_workers, backlog);
 
-    // Set up the arguments for select
-    int maxfd = listenfd;
-    fd_set allset;
-    FD_ZERO(&allset);
-    FD_SET(listenfd, &allset);
-    
-    // Set up a timer for select (This is only necessary for debugging help)
-    struct timeval timer;
+    // The loop threads and the workers inherit this mask; the main thread
+    // is the only one that handles these signals, with sigwait below.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
 
+    // A client that disconnects early must not kill the process writing
+    // to it.
+    signal(SIGPIPE, SIG_IGN);
 
-    // Main server loop.
-    while (1) {
-        fd_set rset = allset;
-        timer.tv_sec = 2;
-        timer.tv_usec = 0;
-        int nready = select(maxfd + 1, &rset, NULL, NULL, &timer);
-        if(nready == -1) {
-            perror("select");
-            exit(1);
-        }
-        
-        if(nready == 0) {  // timer expired
-            // Check if any children have failed
-            int status;
-            int pid;
-            errno = 0;
-            if((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-                if(WIFSIGNALED(status)) {
-                    fprintf(stderr, "Child [%d] failed with signal %d\n", pid,
-                            WTERMSIG(status));
-                }
-            }
-            continue;
-        }
-        
+    // The workers share the cache counters and its disk tier.
+    cache_init();
 
-        if (FD_ISSET(listenfd, &rset)) {    // New client connection.
-            int new_client_fd = accept_connection(listenfd);
-            if (new_client_fd >= 0) {
-                maxfd = (new_client_fd > maxfd) ? new_client_fd : maxfd;
-                FD_SET(new_client_fd, &allset);    // Add new descriptor to set.
+    // Each loop has its own SO_REUSEPORT listening socket, so the kernel
+    // spreads incoming connections across the loops, and its own share
+    // of the worker pool.
+    EventLoop *loops = calloc(num_loops, sizeof(EventLoop));
+    for (int i = 0; i < num_loops; i++) {
+        EventLoop *loop = &loops[i];
+        loop->num_clients = INITIAL_CLIENTS;
+        loop->clients = init_clients(loop->num_clients);
+        loop->idle_head = loop->idle_tail = -1;
 
-                for(int i = 0; i < MAX_CLIENTS; i++) {
-                    if (clients[i].sock < 0) {
-                        clients[i].sock = new_client_fd;
-                        break;
-                    }
-                }
-            }
+        // Create an fd to listen to new connections.
+        loop->listenfd = setup_server_socket(servaddr, backlog, num_loops > 1);
+        set_nonblocking(loop->listenfd, 1);
 
-            nready -= 1;
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd < 0) {
+            perror("epoll_create1");
+            exit(1);
         }
+        watch_fd(loop->epfd, loop->listenfd, EPOLLIN | EPOLLET, LISTEN_TOKEN);
 
-        // The nready is just an optimization; no harm in checking all fds 
-        // except efficiency
-        for (int i = 0; i < MAX_CLIENTS && nready > 0; i++) {
-            // Check whether clients[i] has an active, ready socket.
-            if (clients[i].sock < 0 || !FD_ISSET(clients[i].sock, &rset)) {
-                continue;
-            }
+        if (num_workers > 0) {
+            int share = num_workers / num_loops + (i < num_workers % num_loops);
+            loop->pool = start_worker_pool(share, loop->epfd, respond);
+        }
+    }
 
-            int done = handle_client(&clients[i]);
-            if (done) {
-                FD_CLR(clients[i].sock, &allset);
-                remove_client(&clients[i]);
-            }
+    for (int i = 0; i < num_loops; i++) {
+        if (pthread_create(&loops[i].thread, NULL, run_loop, &loops[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
 
-            nready -= 1;
+    // Children are reaped when SIGCHLD arrives, and dead workers replaced
+    // when SIGUSR2 does; SIGUSR1 prints the loop and cache counters, and
+    // SIGINT/SIGTERM print them once more before exiting.
+    while (1) {
+        int sig;
+        if (sigwait(&mask, &sig) != 0) {
+            continue;
+        }
+        if (sig == SIGCHLD) {
+            reap_children();
+        } else if (sig == SIGUSR2) {
+            restart_workers(loops, num_loops);
+        } else {
+            print_loop_stats(loops, num_loops);
+            if (sig != SIGUSR1) {
+                exit(0);
+            }
         }
     }
 }
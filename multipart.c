@@ -0,0 +1,42 @@
+#include <string.h>
+
+#include "multipart.h"
+
+
+int delimiter_init(Delimiter *d, const char *boundary) {
+    int len_boundary = strlen(boundary);
+    if (len_boundary + 2 > MAX_DELIMITER) {
+        return -1;
+    }
+    d->pattern[0] = '\r';
+    d->pattern[1] = '\n';
+    memcpy(d->pattern + 2, boundary, len_boundary);
+    d->len = len_boundary + 2;
+
+    for (int i = 0; i < 256; i++) {
+        d->skip[i] = d->len;
+    }
+    for (int i = 0; i < d->len - 1; i++) {
+        d->skip[d->pattern[i]] = d->len - 1 - i;
+    }
+    return 0;
+}
+
+
+long delimiter_find(const Delimiter *d, const char *buf, long n) {
+    const unsigned char *text = (const unsigned char *)buf;
+    const unsigned char *pattern = d->pattern;
+    int last = d->len - 1;
+    unsigned char last_byte = pattern[last];
+
+    long pos = 0;
+    while (pos + last < n) {
+        unsigned char c = text[pos + last];
+        if (c == last_byte && text[pos] == pattern[0] &&
+                memcmp(text + pos + 1, pattern + 1, last - 1) == 0) {
+            return pos;
+        }
+        pos += d->skip[c];
+    }
+    return -1;
+}
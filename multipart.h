@@ -0,0 +1,43 @@
+#ifndef MULTIPART_H_
+#define MULTIPART_H_
+
+#include <stddef.h>
+
+// Uploads are read in chunks of (at least) this size.
+#define UPLOAD_CHUNK (64 * 1024)
+
+// Longest multipart boundary (RFC 2046 allows 70 characters), plus the
+// "\r\n--" that precedes it in a delimiter.
+#define MAX_BOUNDARY 70
+#define MAX_DELIMITER (MAX_BOUNDARY + 4)
+
+
+/*
+ * A precompiled search for a multipart delimiter ("\r\n--<boundary>"),
+ * using Boyer-Moore-Horspool: for every byte, how far the window can
+ * slide when that byte is under the last position of the pattern.
+ * Bytes that don't occur in the delimiter (nearly all bytes of image
+ * data) move the window by its whole length.
+ */
+typedef struct {
+    unsigned char pattern[MAX_DELIMITER];
+    int len;
+    int skip[256];
+} Delimiter;
+
+
+/*
+ * Build the delimiter search for the given boundary string (which already
+ * starts with "--", as returned by get_boundary).
+ * Return -1 if the boundary is too long.
+ */
+int delimiter_init(Delimiter *d, const char *boundary);
+
+/*
+ * Return the offset of the first delimiter in buf[0, n), or -1 if there
+ * is none. A delimiter split across the end of buf is not found; callers
+ * streaming data keep the last d->len - 1 bytes for the next search.
+ */
+long delimiter_find(const Delimiter *d, const char *buf, long n);
+
+#endif /* MULTIPART_H_ */
@@ -1,73 +1,285 @@
+#define _GNU_SOURCE        /* memmem, splice, fallocate */
 #include "request.h"
 #include "response.h"
+#include "multipart.h"
+#include "socket.h"
 #include <string.h>
+#include <errno.h>
+#include <strings.h>
+#include <fcntl.h>
+
+
+// Set to 0 (-DLOG_REQUESTS=0) to build without the per-request log line,
+// e.g. for benchmarks.
+#ifndef LOG_REQUESTS
+#define LOG_REQUESTS 1
+#endif
+
+int keep_alive_timeout = KEEP_ALIVE_TIMEOUT;
+int max_keep_alive_requests = MAX_KEEP_ALIVE_REQUESTS;
+int max_request_head = MAX_REQUEST_HEAD;
+
+// Base-size (MAXLINE) buffers of closed connections, kept for the next
+// ones: a free list per thread, linked through the buffers themselves.
+#define MAX_FREE_BUFFERS 256
+static __thread char *free_buffers = NULL;
+static __thread int num_free_buffers = 0;
+
+// An upload is streamed through a buffer that holds a full client buffer
+// and then at least UPLOAD_CHUNK bytes per read.
+#define UPLOAD_BUFFER (MAX_REQUEST_HEAD_LIMIT + UPLOAD_CHUNK)
+
+// Bitmap uploads are spliced from the socket to the file through a pipe
+// of this size.
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+
+// Where a bitmap header stores the size of the file (as in filters/bitmap.h).
+#define BMP_FILE_SIZE_OFFSET 2
 
 
 /******************************************************************************
  * ClientState-processing functions
  *****************************************************************************/
 ClientState *init_clients(int n) {
-    ClientState *clients = malloc(sizeof(ClientState) * n);
-    for (int i = 0; i < n; i++) {
+    return grow_clients(NULL, 0, n);
+}
+
+/*
+ * Reset the parser for a new request starting at client->pos.
+ */
+static void reset_request(ClientState *client) {
+    ReqData *req = &client->req;
+    req->method = NULL;
+    req->path = NULL;
+    req->query = NULL;
+    for (int i = 0; i < MAX_QUERY_PARAMS; i++) {
+        req->params[i].name = NULL;
+        req->params[i].value = NULL;
+    }
+    req->num_headers = 0;
+    for (int i = 0; i < NUM_KNOWN_HEADERS; i++) {
+        req->known[i] = -1;
+    }
+    req->content_length = -1;
+
+    client->reqData = NULL;
+    client->state = PARSE_START_LINE;
+    if (client->pos == client->num_bytes) {
+        // Nothing buffered: start again at the front of the buffer.
+        client->pos = client->scan = client->num_bytes = 0;
+    }
+    client->req_start = client->head_end = client->pos;
+    client->body_dropped = 0;
+}
+
+/*
+ * Resize the client array from old_n to new_n entries, marking the new
+ * entries as available. Existing entries keep their index.
+ */
+ClientState *grow_clients(ClientState *clients, int old_n, int new_n) {
+    clients = realloc(clients, sizeof(ClientState) * new_n);
+    if (clients == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    for (int i = old_n; i < new_n; i++) {
         clients[i].sock = -1;  // -1 here indicates available entry
+        clients[i].buf = NULL;
+        clients[i].buf_size = 0;
+        clients[i].num_bytes = 0;
+        clients[i].pos = 0;
+        clients[i].scan = 0;
+        reset_request(&clients[i]);
+        clients[i].keep_alive = 0;
+        clients[i].num_requests = 0;
+        clients[i].closing = 0;
+        clients[i].prev = clients[i].next = -1;
     }
     return clients;
 }
 
-/* 
- * Remove the client from the client array, free any memory allocated for
- * fields of the ClientState struct, and close the socket.
+/*
+ * Give the client's buffer back to the thread's pool, or free it if it
+ * has grown past the base size or the pool is full.
  */
-void remove_client(ClientState *cs) {
-    if (cs->reqData != NULL) {
-        free(cs->reqData->method);
-        free(cs->reqData->path);
-        for (int i = 0; i < MAX_QUERY_PARAMS && cs->reqData->params[i].name != NULL; i++) {
-            free(cs->reqData->params[i].name);
-            free(cs->reqData->params[i].value);
-        }
-        free(cs->reqData);
-        cs->reqData = NULL;
+static void release_buffer(ClientState *cs) {
+    if (cs->buf == NULL) {
+        return;
+    }
+    if (cs->buf_size == MAXLINE && num_free_buffers < MAX_FREE_BUFFERS) {
+        *(char **)cs->buf = free_buffers;
+        free_buffers = cs->buf;
+        num_free_buffers++;
+    } else {
+        free(cs->buf);
     }
+    cs->buf = NULL;
+    cs->buf_size = 0;
+}
+
+/*
+ * Remove the client from the client array, reset the fields of the
+ * ClientState struct, and close the socket.
+ */
+void remove_client(ClientState *cs) {
     close(cs->sock);
+    release_buffer(cs);
     cs->sock = -1;
     cs->num_bytes = 0;
+    cs->pos = 0;
+    cs->scan = 0;
+    reset_request(cs);
+    cs->keep_alive = 0;
+    cs->num_requests = 0;
+    cs->closing = 0;
+}
+
+/*
+ * Forget the parsed request, keeping the connection and its buffer.
+ * Nothing needs to be freed: the request data are views into the buffer.
+ */
+void clear_request(ClientState *cs) {
+    reset_request(cs);
 }
 
 
 /*
- * Search the first inbuf characters of buf for a network newline ("\r\n").
- * Return the index *immediately after* the location of the '\n'
- * if the network newline is found, or -1 otherwise.
- * Definitely do not use strchr or any other string function in here. (Why not?)
+ * Move every view of the request being parsed from the bytes at from to
+ * the same bytes at to, after they have been copied there.
  */
-int find_network_newline(const char *buf, int inbuf) {
-    
-    //IMPLEMENT THIS
-    for (int i = 0; i < inbuf - 1; i++) {
-        if (buf[i] == '\r' && buf[i + 1] == '\n') {
-            return i + 2;
+static void rebase_request(ReqData *req, const char *from, char *to) {
+    char **views[3 + 2 * MAX_QUERY_PARAMS];
+    int n = 0;
+    views[n++] = &req->method;
+    views[n++] = &req->path;
+    views[n++] = &req->query;
+    for (int i = 0; i < MAX_QUERY_PARAMS; i++) {
+        views[n++] = &req->params[i].name;
+        views[n++] = &req->params[i].value;
+    }
+    for (int i = 0; i < n; i++) {
+        if (*views[i] != NULL) {
+            *views[i] = to + (*views[i] - from);
         }
     }
+    for (int i = 0; i < req->num_headers; i++) {
+        req->headers[i].name = to + (req->headers[i].name - from);
+        req->headers[i].value = to + (req->headers[i].value - from);
+    }
+}
+
+
+int reserve_buffer(ClientState *client, int size) {
+    if (size <= client->buf_size) {
+        return 0;
+    }
+
+    int new_size = MAXLINE;
+    while (new_size < size) {
+        new_size *= 2;
+    }
+    if (new_size > max_request_head) {
+        new_size = max_request_head;
+    }
+    if (new_size < size) {
+        return -1;
+    }
+
+    char *buf;
+    if (new_size == MAXLINE && free_buffers != NULL) {
+        buf = free_buffers;
+        free_buffers = *(char **)buf;
+        num_free_buffers--;
+    } else if ((buf = malloc(new_size)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    if (client->buf != NULL) {
+        memcpy(buf, client->buf, client->num_bytes + 1);
+        rebase_request(&client->req, client->buf, buf);
+        release_buffer(client);
+    } else {
+        buf[0] = '\0';
+    }
+    client->buf = buf;
+    client->buf_size = new_size;
+    return 0;
+}
+
+/*
+ * Make room at the end of the client buffer by moving the current request
+ * (and everything after it) to the front. Once the head has been parsed,
+ * body bytes already consumed are dropped too. This is the only place
+ * buffered bytes are ever moved, and it happens at most once per
+ * buffer-full.
+ */
+static void compact_buffer(ClientState *client) {
+    if (client->state == PARSE_DONE && client->pos > client->head_end) {
+        int consumed = client->pos - client->head_end;
+        memmove(client->buf + client->head_end, client->buf + client->pos,
+                client->num_bytes - client->pos);
+        client->num_bytes -= consumed;
+        client->pos -= consumed;
+        client->scan -= consumed;
+        client->body_dropped += consumed;
+    }
+
+    int keep = client->req_start;
+    if (keep == 0) {
+        return;
+    }
+    memmove(client->buf, client->buf + keep, client->num_bytes - keep);
+    rebase_request(&client->req, client->buf + keep, client->buf);
+    client->num_bytes -= keep;
+    client->pos -= keep;
+    client->scan -= keep;
+    client->head_end -= keep;
+    client->req_start = 0;
+}
+
+
+/*
+ * Return the length (including the CRLF) of the complete line that starts
+ * at client->pos, or -1 if it hasn't been read in full yet.
+ *
+ * client->scan remembers how far the search got, so a byte is examined
+ * only once no matter how many reads it takes for the line to arrive.
+ * Definitely do not use strchr or any other string function in here
+ * (the buffer may hold binary data); memchr is fine.
+ */
+static int next_line(ClientState *client) {
+    char *start = client->buf + client->pos;
+    char *end = client->buf + client->num_bytes;
+    char *p = client->buf + client->scan;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        if (p > start && p[-1] == '\r') {
+            client->scan = p + 1 - client->buf;
+            return client->scan - client->pos;
+        }
+        p++;
+    }
+    client->scan = client->num_bytes;
     return -1;
 }
 
 /*
- * Removes one line (terminated by \r\n) from the client's buffer.
- * Update client->num_bytes accordingly.
+ * Removes one line (terminated by \r\n) from the client's buffer, reading
+ * more data first if the line is incomplete. Nothing is moved: the start
+ * of the unconsumed data (client->pos) just advances past the line.
  *
- * For example, if `client->buf` contains the string "hello\r\ngoodbye\r\nblah",
- * after calling remove_line on it, buf should contain "goodbye\r\nblah"
- * Remember that the client buffer is *not* null-terminated automatically.
+ * Return the length of the line removed, or -1 if the client closed the
+ * connection first.
  */
-void remove_buffered_line(ClientState *client) {
-    
-    //IMPLEMENT THIS
-    int newline = find_network_newline(client->buf, client->num_bytes);
-    if (newline > 0) {
-        memmove(client->buf, client->buf + newline, client->num_bytes - newline);
-        client->num_bytes -= newline;
+static int remove_buffered_line(ClientState *client) {
+    int len;
+    while ((len = next_line(client)) < 0) {
+        if (read_from_client(client) <= 0) {
+            return -1;
+        }
     }
+    client->pos += len;
+    return len;
 }
 
 
@@ -75,19 +287,30 @@ void remove_buffered_line(ClientState *client) {
  * Read some data into the client buffer. Append new data to data already
  * in the buffer.  Update client->num_bytes accordingly.
  * Return the number of bytes read in, or -1 if the read failed.
+ * The socket may be non-blocking; in that case -1 is returned with errno
+ * set to EAGAIN when no data is available, and nothing is reported.
+ * A full buffer is compacted, then grown, up to max_request_head bytes;
+ * past that -1 is returned with errno set to ENOBUFS.
 
  * Be very careful with memory here: there might be existing data in the buffer
  * that you don't want to overwrite, and you also don't want to go past
  * the end of the buffer, and you should ensure the string is null-terminated.
  */
 int read_from_client(ClientState *client) {
-    
+
     //IMPLEMENT THIS
-    if (client->num_bytes >= MAXLINE - 1) {
-        return 0;
+    if (client->num_bytes >= client->buf_size - 1) {
+        if (client->buf != NULL) {
+            compact_buffer(client);
+        }
+        if (client->num_bytes >= client->buf_size - 1 &&
+                reserve_buffer(client, client->num_bytes + 2) < 0) {
+            errno = ENOBUFS;
+            return -1;
+        }
     }
 
-    int read_bytes = read(client->sock, client->buf + client->num_bytes, MAXLINE - 1 - client->num_bytes);
+    int read_bytes = read(client->sock, client->buf + client->num_bytes, client->buf_size - 1 - client->num_bytes);
     if (read_bytes > 0) {
         client->num_bytes += read_bytes;
         client->buf[client->num_bytes] = '\0';
@@ -95,127 +318,237 @@ int read_from_client(ClientState *client) {
     } else if (read_bytes == 0) {
         return 0;
     } else {
-        perror("read error in read_from_client");
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("read error in read_from_client");
+        }
         return -1;
     }
 
 }
 
-    
+
 
 /*****************************************************************************
- * Parsing the start line of an HTTP request.
+ * Parsing the head of an HTTP request.
  ****************************************************************************/
 // Helper function declarations.
-void parse_query(ReqData *req, const char *str);
-void update_fdata(Fdata *f, const char *str);
-void fdata_free(Fdata *f);
+static int parse_start_line(ClientState *client, char *line, int len);
+static int parse_header(ClientState *client, char *line, int len);
+void parse_query(ReqData *req, char *str);
 void log_request(const ReqData *req);
 
 
-/* If there is a full line (terminated by a network newline (CRLF)) 
- * then use this line to initialize client->reqData
- * Return 0 if a full line has not been read, 1 otherwise.
+/*
+ * Run the parser over the complete lines in the buffer. Each line is
+ * terminated in place (its CR becomes '\0') and its tokens become views
+ * into the buffer.
+ * Return 1 once the empty line ending the headers has been parsed, 0 if
+ * more data is needed, PARSE_MALFORMED if the start line is malformed, or
+ * PARSE_TOO_LARGE if there are more than MAX_HEADERS headers.
  */
-int parse_req_start_line(ClientState *client) {
-
-    //IMPLEMENT THIS
-    int newline = find_network_newline(client->buf, client->num_bytes);
-    if (newline < 0) {
+int parse_request(ClientState *client) {
+    if (client->state == PARSE_DONE) {
+        return 1;
+    } else if (client->buf == NULL) {
         return 0;
     }
 
-    char line[newline + 1];
-    strncpy(line, client->buf, newline);
-    line[newline] = '\0';
-
-    char *method = strtok(line, " ");
-    char *path = strtok(NULL, " ");
-
-    if (method && path) {
-        ReqData *reqData = (ReqData *)malloc(sizeof(ReqData));
-        if (reqData) {
-            reqData->method = NULL;
-            reqData->path = NULL;
-            for (int i = 0; i < MAX_QUERY_PARAMS; i++) {
-                reqData->params[i].name = NULL;
-                reqData->params[i].value = NULL;
+    int len;
+    while ((len = next_line(client)) > 0) {
+        char *line = client->buf + client->pos;
+        client->pos += len;
+        len -= 2;
+        line[len] = '\0';
+
+        if (client->state == PARSE_START_LINE) {
+            if (len == 0) {
+                // Ignore empty lines before a request.
+                client->req_start = client->pos;
+                continue;
+            }
+            if (parse_start_line(client, line, len) < 0) {
+                return PARSE_MALFORMED;
+            }
+            client->state = PARSE_HEADERS;
+        } else if (len > 0) {
+            if (parse_header(client, line, len) < 0) {
+                return PARSE_TOO_LARGE;
             }
+        } else {
+            client->state = PARSE_DONE;
+            client->head_end = client->pos;
+            client->reqData = &client->req;
 
-            client->reqData = reqData;
+            // This part is just for debugging purposes.
+            if (LOG_REQUESTS) {
+                log_request(client->reqData);
+            }
+            return 1;
         }
+    }
+    return 0;
+}
 
-        if (client->reqData) {
-            client->reqData->method = strdup(method);
 
-            char *query = strchr(path, '?');
-            if (query) {
-                *query = '\0';
-                query++;
-                parse_query(client->reqData, query);
-            }
+/*
+ * Split the start line "METHOD target VERSION" in place.
+ * Return -1 if there is no method or no target.
+ */
+static int parse_start_line(ClientState *client, char *line, int len) {
+    ReqData *req = &client->req;
+    char *end = line + len;
 
-            client->reqData->path = strdup(path);
+    char *space = memchr(line, ' ', len);
+    if (space == NULL || space == line) {
+        return -1;
+    }
+    *space = '\0';
+    req->method = line;
+
+    char *target = space + 1;
+    char *version = NULL;
+    space = memchr(target, ' ', end - target);
+    if (space != NULL) {
+        *space = '\0';
+        version = space + 1;
+        end = space;
+    }
+    if (target == end) {
+        return -1;
+    }
 
-            if (!client->reqData->method || !client->reqData->path) {
-                if (client->reqData->method) free(client->reqData->method);
-                if (client->reqData->path) free(client->reqData->path);
-                free(client->reqData);
-                client->reqData = NULL;
-                return 0;
-            }
+    char *query = memchr(target, '?', end - target);
+    if (query) {
+        *query = '\0';
+        req->query = query + 1;
+        parse_query(req, req->query);
+    }
+    req->path = target;
+
+    // HTTP/1.1 connections are persistent unless a header says otherwise.
+    client->keep_alive = version != NULL && strcmp(version, "HTTP/1.1") == 0;
+    client->num_requests++;
+    return 0;
+}
 
+
+// Names of the known headers, by enum known_header.
+static const char *known_headers[NUM_KNOWN_HEADERS] = {
+    [HDR_CONNECTION] = "Connection",
+    [HDR_CONTENT_LENGTH] = "Content-Length",
+    [HDR_CONTENT_TYPE] = "Content-Type",
+    [HDR_HOST] = "Host",
+    [HDR_IF_NONE_MATCH] = "If-None-Match",
+    [HDR_TRANSFER_ENCODING] = "Transfer-Encoding",
+};
+
+/*
+ * Return the known header with the given name (of length len), or -1.
+ */
+static int find_known_header(const char *name, int len) {
+    for (int i = 0; i < NUM_KNOWN_HEADERS; i++) {
+        if (strlen(known_headers[i]) == len &&
+                strcasecmp(known_headers[i], name) == 0) {
+            return i;
         }
+    }
+    return -1;
+}
 
-    } else {
+/*
+ * Split a "Name: value" header line in place and record it in the header
+ * table, indexing it if it is a known header. A Connection header also
+ * updates client->keep_alive.
+ * Return -1 if the header table is full.
+ */
+static int parse_header(ClientState *client, char *line, int len) {
+    ReqData *req = &client->req;
+    char *colon = memchr(line, ':', len);
+    if (colon == NULL) {
         return 0;
+    } else if (req->num_headers == MAX_HEADERS) {
+        return -1;
+    }
+    *colon = '\0';
+
+    char *value = colon + 1;
+    char *end = line + len;
+    while (value < end && (*value == ' ' || *value == '\t')) {
+        value++;
+    }
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
     }
+    *end = '\0';
 
-    remove_buffered_line(client);
+    int index = req->num_headers++;
+    req->headers[index].name = line;
+    req->headers[index].value = value;
 
-    // This part is just for debugging purposes.
-    log_request(client->reqData);
-    return 1;
+    int known = find_known_header(line, colon - line);
+    if (known < 0) {
+        return 0;
+    }
+    req->known[known] = index;
+
+    if (known == HDR_CONNECTION) {
+        if (strncasecmp(value, "close", 5) == 0) {
+            client->keep_alive = 0;
+        } else if (strncasecmp(value, "keep-alive", 10) == 0) {
+            client->keep_alive = 1;
+        }
+    } else if (known == HDR_CONTENT_LENGTH) {
+        char *rest;
+        long length = strtol(value, &rest, 10);
+        req->content_length = (rest != value && *rest == '\0' && length >= 0) ? length : -1;
+    }
+    return 0;
 }
 
 
 /*
- * Initializes req->params from the key-value pairs contained in the given 
- * string.
+ * Initializes req->params from the key-value pairs contained in the given
+ * string, splitting it in place.
  * Assumes that the string is the part after the '?' in the HTTP request target,
  * e.g., name1=value1&name2=value2.
  */
-void parse_query(ReqData *req, const char *str) {
-    
+void parse_query(ReqData *req, char *str) {
+
     //IMPLEMENT THIS
-    char *token = strtok((char *)str, "&");
     int index = 0;
-    while (token != NULL && index < MAX_QUERY_PARAMS) {
-        char *key = token;
-        char *value = strchr(token, '=');
+    while (str != NULL && index < MAX_QUERY_PARAMS) {
+        char *key = str;
+        str = strchr(str, '&');
+        if (str) {
+            *str++ = '\0';
+        }
+
+        char *value = strchr(key, '=');
         if (value) {
             *value = '\0';
-            value++;
-            req->params[index].name = strdup(key);
-            req->params[index].value = strdup(value);
-
-            if (!req->params[index].name || !req->params[index].value) {
-                if (req->params[index].name) free(req->params[index].name);
-                if (req->params[index].value) free(req->params[index].value);
-                return;
-            }
-        } else {
-            req->params[index].name = NULL;
-            req->params[index].value = NULL;
-            
+            req->params[index].name = key;
+            req->params[index].value = value + 1;
+            index++;
+        } else if (*key != '\0') {
             fprintf(stderr, "Invalid key-value pair format: %s\n", key);
         }
-        index++;
-        token = strtok(NULL, "&");
     }
 }
 
 
+/*
+ * Return the value of the named header (case-insensitive), or NULL.
+ */
+const char *get_header(const ReqData *req, const char *name) {
+    for (int i = 0; i < req->num_headers; i++) {
+        if (strcasecmp(req->headers[i].name, name) == 0) {
+            return req->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+
 /*
  * Print information stored in the given request data to stderr.
  */
@@ -223,7 +556,7 @@ void log_request(const ReqData *req) {
 
     fprintf(stderr, "Request parsed: [%s] [%s]\n", req->method, req->path);
     for (int i = 0; i < MAX_QUERY_PARAMS && req->params[i].name != NULL; i++) {
-        fprintf(stderr, "  %s -> %s\n", 
+        fprintf(stderr, "  %s -> %s\n",
                 req->params[i].name, req->params[i].value);
     }
 }
@@ -234,32 +567,20 @@ void log_request(const ReqData *req) {
  *****************************************************************************/
 
 char *get_boundary(ClientState *client) {
-    int len_header = strlen(POST_BOUNDARY_HEADER);
-
-    while (1) {
-        int where = find_network_newline(client->buf, client->num_bytes);
-        if (where > 0) {
-            if (where < len_header || strncmp(POST_BOUNDARY_HEADER, client->buf, len_header) != 0) {
-                remove_buffered_line(client);
-            } else {
-                // We've found the boundary string!
-                // We are going to add "--" to the beginning to make it easier
-                // to match the boundary line later
-                char *boundary = malloc(where - len_header + 1);
-                strncpy(boundary, "--", where - len_header + 1);
-                strncat(boundary, client->buf + len_header, where - len_header - 1);
-                boundary[where - len_header] = '\0';
-                return boundary;
-            }
-        } else {
-            // Need to read more bytes
-            if (read_from_client(client) <= 0) {
-                // Couldn't read; this is a bad request, so give up.
-                return NULL;
-            }
-        }
+    const char *type = get_known_header(client->reqData, HDR_CONTENT_TYPE);
+    int len_prefix = strlen(MULTIPART_FORM_DATA);
+    if (type == NULL || strncmp(type, MULTIPART_FORM_DATA, len_prefix) != 0) {
+        return NULL;
     }
-    return NULL;
+
+    // We've found the boundary string!
+    // We are going to add "--" to the beginning to make it easier
+    // to match the boundary line later
+    const char *raw = type + len_prefix;
+    char *boundary = malloc(strlen(raw) + 3);
+    strcpy(boundary, "--");
+    strcat(boundary, raw);
+    return boundary;
 }
 
 
@@ -268,131 +589,247 @@ char *get_bitmap_filename(ClientState *client, const char *boundary) {
 
     // Read until finding the boundary string.
     while (1) {
-        int where = find_network_newline(client->buf, client->num_bytes);
-        if (where > 0) {
-            if (where < len_boundary + 2 ||
-                    strncmp(boundary, client->buf, len_boundary) != 0) {
-                remove_buffered_line(client);
-            } else {
-                // We've found the line with the boundary!
-                remove_buffered_line(client);
-                break;
-            }
-        } else {
-            // Need to read more bytes
-            if (read_from_client(client) <= 0) {
-                // Couldn't read; this is a bad request, so give up.
-                return NULL;
-            }
+        int len = remove_buffered_line(client);
+        if (len < 0) {
+            // Couldn't read; this is a bad request, so give up.
+            return NULL;
+        }
+        char *line = client->buf + client->pos - len;
+        if (len >= len_boundary + 2 && strncmp(boundary, line, len_boundary) == 0) {
+            // We've found the line with the boundary!
+            break;
         }
     }
 
-    int where = find_network_newline(client->buf, client->num_bytes);
+    // The next line is the part's Content-Disposition, with the filename.
+    int len = remove_buffered_line(client);
+    if (len < 0) {
+        return NULL;
+    }
+    char *line = client->buf + client->pos - len;
+    const char *key = "filename=\"";
+    char *raw_filename = memmem(line, len, key, strlen(key));
+    if (raw_filename == NULL) {
+        return NULL;
+    }
+    raw_filename += strlen(key);
+    char *quote = memchr(raw_filename, '"', line + len - raw_filename);
+    if (quote == NULL) {
+        return NULL;
+    }
 
-    client->buf[where-1] = '\0';  // Used for strrchr to work on just the single line.
-    char *raw_filename = strrchr(client->buf, '=') + 2;
-    int len_filename = client->buf + where - 3 - raw_filename;
+    int len_filename = quote - raw_filename;
     char *filename = malloc(len_filename + 1);
-    strncpy(filename, raw_filename, len_filename);
+    memcpy(filename, raw_filename, len_filename);
     filename[len_filename] = '\0';
-
-    // Restore client->buf
-    client->buf[where - 1] = '\n';
-    remove_buffered_line(client);
     return filename;
 }
 
 /*
- * Read the file data from the socket and write it to the file descriptor
- * file_fd.
- * You know when you have reached the end of the file in one of two ways:
- *    - search for the boundary string in each chunk of data read 
- * (Remember the "\r\n" that comes before the boundary string, and the 
- * "--\r\n" that comes after.)
- *    - extract the file size from the bitmap data, and use that to determine
- * how many bytes to read from the socket and write to the file
+ * Read from the client socket into chunk (which holds n bytes) until it
+ * holds at least want bytes. Return the new n, or -1 if the client
+ * stopped sending first.
  */
-int save_file_upload(ClientState *client, const char *boundary, int file_fd) {
-    // Read in the next two lines: Content-Type line, and empty line
-    remove_buffered_line(client);
-    remove_buffered_line(client);
-    
-    // IMPLEMENT THIS
-    ssize_t write_result = write(file_fd, client->buf, client->num_bytes);
-    if (write_result < 0) {
-        perror("write");
-        return -1;
+static long fill_chunk(ClientState *client, char *chunk, long n, long want) {
+    while (n < want) {
+        ssize_t read_bytes = read(client->sock, chunk + n, UPLOAD_BUFFER - n);
+        if (read_bytes <= 0) {
+            return -1;
+        }
+        n += read_bytes;
     }
-    client->num_bytes = 0;
-
-    int boundary_len = strlen(boundary);
-    char end_boundary[boundary_len + 6]; 
-    sprintf(end_boundary, "\r\n%s--\r\n", boundary);    
-
-    // Initialize a buffer
-    char buffer[MAXLINE]; 
+    return n;
+}
 
-    size_t end_boundary_len = strlen(end_boundary);
-    size_t end_boundary_found = 0;
+/*
+ * Return the file size in the header of the bitmap starting at data (of
+ * which n bytes are available), or -1 if it doesn't look like a bitmap.
+ */
+static long bmp_file_size(const char *data, long n) {
+    if (n < BMP_FILE_SIZE_OFFSET + 4 || data[0] != 'B' || data[1] != 'M') {
+        return -1;
+    }
+    const unsigned char *size = (const unsigned char *)data + BMP_FILE_SIZE_OFFSET;
+    long file_size = size[0] | size[1] << 8 | size[2] << 16 | (long)size[3] << 24;
+    return file_size >= BMP_FILE_SIZE_OFFSET + 4 ? file_size : -1;
+}
 
-    size_t end_boundary_found_prev = 0;
-    char buffer_prev[MAXLINE];
-    size_t write_bytes_prev = 0;
-    
-    while (1) {
-        ssize_t read_bytes = read(client->sock, buffer, sizeof(buffer));
+/*
+ * Move length bytes from the socket to the file with splice(), through a
+ * pipe, so the data never enters user space. Filesystems that can't
+ * splice get a plain read/write copy instead.
+ * Return 0 on success, -1 on error.
+ */
+static int splice_to_file(int sock, int file_fd, long length) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        return -1;
+    }
+    // A bigger pipe means fewer splice calls; the default is fine too.
+    long pipe_size = fcntl(fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    if (pipe_size < 0) {
+        pipe_size = UPLOAD_CHUNK;
+    }
 
-        if (read_bytes <= 0) {
+    int status = 0;
+    while (length > 0) {
+        ssize_t in = splice(sock, NULL, fds[1], NULL,
+                            length < pipe_size ? length : pipe_size,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in <= 0) {
+            status = -1;
             break;
         }
-
-        // Search for the end boundary
-        for (size_t i = 0; i < read_bytes; i++) {
-            if (buffer[i] == end_boundary[end_boundary_found]) {
-                end_boundary_found++;
-                if (end_boundary_found == end_boundary_len) {
-                    break;
+        length -= in;
+        while (in > 0) {
+            ssize_t out = splice(fds[0], NULL, file_fd, NULL, in, SPLICE_F_MOVE);
+            if (out < 0 && errno == EINVAL) {
+                // The destination doesn't support splice: drain the pipe
+                // into it through user space.
+                char buf[UPLOAD_CHUNK];
+                out = read(fds[0], buf, in < sizeof(buf) ? in : sizeof(buf));
+                if (out > 0 && write_all(file_fd, buf, out) < 0) {
+                    out = -1;
                 }
-            } else {
-                end_boundary_found = 0;
             }
-        }      
-
-        if (end_boundary_found == end_boundary_len) {
-            if (end_boundary_found_prev) {
-                ssize_t write_bytes = write_bytes_prev - end_boundary_found_prev;
-                if (write_bytes > 0) {
-                    write_result = write(file_fd, buffer_prev, write_bytes);
-                    if (write_result < 0) {
-                        perror("write");
-                        break;
-                    }
-                }               
-                break;
-            }
-            ssize_t write_bytes = read_bytes - end_boundary_found;
-            if (write_bytes > 0) {
-                write_result = write(file_fd, buffer, write_bytes);
-                if (write_result < 0) {
-                    perror("write");
-                    break;
-                }
-            }
-            break;
-        } else if (end_boundary_found > 3) {
-            // if the end boundary is found in the two buffer
-            end_boundary_found_prev = end_boundary_found;
-            strncpy(buffer_prev, buffer, read_bytes);
-            write_bytes_prev = read_bytes;
-        } else {
-            write_result = write(file_fd, buffer, read_bytes);
-            if (write_result < 0) {
-                perror("write");
+            if (out <= 0) {
+                perror("splice");
+                status = -1;
+                length = 0;
                 break;
             }
+            in -= out;
         }
     }
-  
+    close(fds[0]);
+    close(fds[1]);
+    return status;
+}
+
+/*
+ * Finish an upload whose file data has been written: chunk (holding n
+ * bytes) starts at the delimiter that ended the data, which must close
+ * the body ("--\r\n"); any other delimiter starts another part, which
+ * isn't supported. Bytes after it go back to the client buffer.
+ */
+static int finish_upload(ClientState *client, const Delimiter *delim,
+                         char *chunk, long n) {
+    long end = delim->len + 4;
+    if ((n = fill_chunk(client, chunk, n, end)) < 0) {
+        return -1;
+    }
+    if (memcmp(chunk, delim->pattern, delim->len) != 0 ||
+            memcmp(chunk + delim->len, "--\r\n", 4) != 0) {
+        return -1;
+    }
+
+    // Anything after the end boundary belongs to the next request on this
+    // connection.
+    int leftover = n - end;
+    if (client->num_bytes + leftover >= client->buf_size) {
+        compact_buffer(client);
+        if (client->num_bytes + leftover >= client->buf_size &&
+                reserve_buffer(client, client->num_bytes + leftover + 1) < 0) {
+            client->keep_alive = 0;
+            return 0;
+        }
+    }
+    memcpy(client->buf + client->num_bytes, chunk + end, leftover);
+    client->num_bytes += leftover;
+    client->buf[client->num_bytes] = '\0';
     return 0;
+}
+
+/*
+ * Copy file data from chunk (holding n bytes), and then from the socket,
+ * to file_fd up to the delimiter that ends it, and finish the upload.
+ */
+static int stream_upload(ClientState *client, const Delimiter *delim, int file_fd,
+                         char *chunk, long n) {
+    long found;
+    while ((found = delimiter_find(delim, chunk, n)) < 0) {
+        long keep = n < delim->len - 1 ? n : delim->len - 1;
+        if (write_all(file_fd, chunk, n - keep) < 0) {
+            perror("write");
+            return -1;
+        }
+        memmove(chunk, chunk + n - keep, keep);
+        if ((n = fill_chunk(client, chunk, keep, keep + 1)) < 0) {
+            return -1;
+        }
+    }
+    if (write_all(file_fd, chunk, found) < 0) {
+        perror("write");
+        return -1;
+    }
+    memmove(chunk, chunk + found, n - found);
+    return finish_upload(client, delim, chunk, n - found);
+}
 
+/*
+ * Read the file data from the socket and write it to the file descriptor
+ * file_fd.
+ *
+ * A bitmap says how long it is in its header. When that agrees with the
+ * Content-Length (the bitmap fills the body up to the closing delimiter),
+ * the file is preallocated and the rest of the data is spliced from the
+ * socket to the file without being looked at. The closing delimiter must
+ * follow the spliced bytes, as it must follow a streamed file: if it
+ * doesn't, the header lied or another part follows, and the upload fails.
+ *
+ * Anything else is streamed through one large buffer (first the bytes
+ * already buffered for the client, then reads of at least UPLOAD_CHUNK
+ * bytes) and searched for the delimiter that ends it with
+ * delimiter_find. The last bytes of each chunk, which could be the start
+ * of a delimiter split across reads, are carried over to the next search
+ * instead of being written.
+ */
+int save_file_upload(ClientState *client, const char *boundary, int file_fd) {
+    // Read in the next two lines: Content-Type line, and empty line
+    if (remove_buffered_line(client) < 0 || remove_buffered_line(client) < 0) {
+        return -1;
+    }
+
+    // IMPLEMENT THIS
+    Delimiter delim;
+    if (delimiter_init(&delim, boundary) < 0) {
+        return -1;
+    }
+
+    // Uploads are only saved by workers and forked children, one at a time.
+    static char chunk[UPLOAD_BUFFER];
+    long n = client->num_bytes - client->pos;
+    memcpy(chunk, client->buf + client->pos, n);
+    // The body bytes before the file data: the part's boundary and headers.
+    long body_used = client->body_dropped + client->pos - client->head_end;
+    client->num_bytes = client->scan = client->pos;
+
+    // The closing delimiter alone takes this many bytes.
+    long tail = delim.len + 4;
+    if ((n = fill_chunk(client, chunk, n, tail)) < 0) {
+        return -1;
+    }
+
+    long file_size = bmp_file_size(chunk, n);
+    long body_size = client->reqData->content_length;
+    if (file_size < 0 || body_size < 0 || file_size != body_size - body_used - tail ||
+            delimiter_find(&delim, chunk, n < file_size ? n : file_size) >= 0) {
+        return stream_upload(client, &delim, file_fd, chunk, n);
+    }
+
+    if (fallocate(file_fd, 0, 0, file_size) < 0 && errno == ENOSPC) {
+        perror("fallocate");
+        return -1;
+    }
+    long have = n < file_size ? n : file_size;
+    if (write_all(file_fd, chunk, have) < 0) {
+        perror("write");
+        return -1;
+    }
+    if (splice_to_file(client->sock, file_fd, file_size - have) < 0) {
+        return -1;
+    }
+    memmove(chunk, chunk + have, n - have);
+    return finish_upload(client, &delim, chunk, n - have);
 }
@@ -5,11 +5,24 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
 
 
 #define MAX_QUERY_PARAMS 5
+#define MAX_HEADERS 64
 #define MAXLINE 1024
 
+// Client buffers start at MAXLINE bytes and double as needed, up to the
+// limit on the size of a request head (-H on the command line). A head
+// that doesn't fit, or has more than MAX_HEADERS headers, is answered
+// with 431.
+#define MAX_REQUEST_HEAD 16384
+#define MAX_REQUEST_HEAD_LIMIT 65536
+
+// Keep-alive defaults; both can be changed from the command line.
+#define KEEP_ALIVE_TIMEOUT 5        // Seconds a connection may stay idle.
+#define MAX_KEEP_ALIVE_REQUESTS 100 // Requests served per connection.
+
 // String constants for parsing HTTP requests.
 #define GET "GET"
 #define POST "POST"
@@ -20,17 +33,34 @@
 #define IMAGE_DIR "images/"
 #define FILTER_DIR "filters/"
 
-#define POST_BOUNDARY_HEADER "Content-Type: multipart/form-data; boundary="
+#define MULTIPART_FORM_DATA "multipart/form-data; boundary="
 
 
-// A struct representing a key-value pair as a query params
+// A struct representing a key-value pair as a query params (or a header)
 typedef struct formdata {
     char *name;
     char *value;
 } Fdata;
 
+// Headers the server looks up, indexed when they are parsed.
+enum known_header {
+    HDR_CONNECTION,
+    HDR_CONTENT_LENGTH,
+    HDR_CONTENT_TYPE,
+    HDR_HOST,
+    HDR_IF_NONE_MATCH,
+    HDR_TRANSFER_ENCODING,
+    NUM_KNOWN_HEADERS
+};
 
-/* A struct storing three parts of the first line of an HTTP request.
+
+/* A struct storing the parts of the first line of an HTTP request and
+ * its headers.
+ *
+ * Every string is a view into the client buffer: the parser terminates
+ * each token in place, so nothing is copied. The views stay valid until
+ * the request is cleared (the buffer is only compacted or grown by
+ * rebasing them).
  *
  * The params array should be parsed from the 'query' field.
  * If there are fewer than MAX_QUERY_PARAMS, each remaining Fdata 
@@ -39,42 +69,99 @@ typedef struct formdata {
 typedef struct {
     char *method;       // Either "GET" or "POST"
     char *path;         // Request path, e.g. "main.html" or "image-filter"
+    char *query;        // The part of the target after '?', or NULL.
     Fdata params[MAX_QUERY_PARAMS];  // An array of query params.
+    Fdata headers[MAX_HEADERS];      // Header names and (trimmed) values.
+    int num_headers;
+    int known[NUM_KNOWN_HEADERS];    // Index in headers of each known
+                                     // header, or -1 if it is absent.
+    long content_length;             // -1 if there's no Content-Length.
 } ReqData;
 
+// Where the parser is within the head (start line and headers) of a request.
+enum parse_state {
+    PARSE_START_LINE,
+    PARSE_HEADERS,
+    PARSE_DONE
+};
+
+// parse_request results other than 0 (need more data) and 1 (done).
+#define PARSE_MALFORMED -1      // The start line is malformed.
+#define PARSE_TOO_LARGE -2      // Too many headers for the header table.
+
 
 typedef struct {
     int sock;            // The socket fd used to communicate with the client.
-    char buf[MAXLINE];   // A buffer of the data read from the client request,
-                         // PLUS space for a null-terminator 
-                         // (so at most MAXLINE - 1 bytes from client).
+    char *buf;           // A buffer of the data read from the client request,
+                         // PLUS space for a null-terminator (allocated on
+                         // first use; NULL until then).
+    int buf_size;        // Size of buf: MAXLINE, doubled as needed.
     int num_bytes;       // The number of bytes currently in the buffer
-                         // (must be between 0 and MAXLINE - 1).
-    ReqData *reqData;    // The data parsed from the first line of the HTTP 
-                         // request from the client.
+                         // (must be between 0 and buf_size - 1).
+    int pos;             // Start of the bytes not consumed yet.
+    int scan;            // Bytes before this (from pos) hold no line end.
+    int req_start;       // Start of the request being parsed or served.
+    int head_end;        // End of its head, once state is PARSE_DONE.
+    long body_dropped;   // Body bytes consumed and dropped from buf since.
+    enum parse_state state;
+    ReqData req;         // Storage for the parsed request.
+    ReqData *reqData;    // The data parsed from the head of the HTTP
+                         // request from the client (&req once complete).
+    int keep_alive;      // 1 if the connection stays open after the response.
+    int num_requests;    // Requests parsed so far on this connection.
+    int closing;         // 1 once the response is sent and the connection
+                         // is only waiting for the client to close it.
+    time_t last_active;  // When the connection last made progress.
+    int prev, next;      // Neighbours in the event loop's idle list.
 } ClientState;
 
 
+extern int keep_alive_timeout;
+extern int max_keep_alive_requests;
+extern int max_request_head;
+
+
 /*
  * Returns an array of ClientStates of the given size.
  */
 ClientState *init_clients(int n);
 
 /*
- * Frees memory allocated for the given client fields.
+ * Resize an array of ClientStates from old_n to new_n entries.
+ * New entries are marked as available (sock == -1).
+ */
+ClientState *grow_clients(ClientState *clients, int old_n, int new_n);
+
+/*
+ * Closes the client's socket and returns its buffer to the pool.
  * Doesn't actually free the client itself since it is allocated as part of
  * an array of ClientState, but sets its sock value to -1 to act as a flag.
  */
 void remove_client(ClientState *cs);
 
+/*
+ * Forget the parsed request data of the client, keeping the connection and
+ * any buffered bytes (e.g. the next pipelined request).
+ */
+void clear_request(ClientState *cs);
+
 
 /******************************************************************************
  * Functions for directly maniputing client buffers.
  *****************************************************************************/
 
+/*
+ * Make sure the client buffer can hold size bytes, allocating it or
+ * growing it (and rebasing the request views) if necessary.
+ * Return -1 if size is over the max_request_head limit.
+ */
+int reserve_buffer(ClientState *client, int size);
+
 /*
  * Read some data into the client buffer. Update client->num_bytes accordingly.
- * Return the number of bytes read in, or -1 if the read failed.
+ * Return the number of bytes read in, or -1 if the read failed
+ * (errno is EAGAIN if a non-blocking socket has no more data, and ENOBUFS
+ * if the buffer is full and already at the max_request_head limit).
  */
 int read_from_client(ClientState *client);
 
@@ -84,13 +171,36 @@ int read_from_client(ClientState *client);
  *****************************************************************************/
 
 /*
- * Parse the start line of an HTTP request, storing the data in client->reqData.
+ * Parse the head of an HTTP request (start line and headers) from the
+ * client buffer, storing the data in client->reqData.
+ *
+ * This is an incremental parser: it resumes where the previous call
+ * stopped and never examines a byte twice, so it can be called after
+ * every read. Pipelined requests already in the buffer are picked up
+ * without reading from the socket.
+ *
+ * Return 1 once the whole head has been parsed, 0 if more data is needed,
+ * or PARSE_MALFORMED / PARSE_TOO_LARGE.
+ */
+int parse_request(ClientState *client);
+
+/*
+ * Return the value of the named header (case-insensitive), or NULL.
+ * Known headers are better looked up with get_known_header.
+ */
+const char *get_header(const ReqData *req, const char *name);
+
+/*
+ * Return the value of a known header, or NULL if it is absent.
  */
-int parse_req_start_line(ClientState *client);
+static inline const char *get_known_header(const ReqData *req,
+                                           enum known_header h) {
+    return req->known[h] < 0 ? NULL : req->headers[req->known[h]].value;
+}
 
 
 /*
- * Return the boundary string for this request.
+ * Return the boundary string for this request, from its Content-Type header.
  * This should be returned in a separate dynamically-allocated,
  * null-terminated string (note that the boundary in the raw request data is
  * certainly *not* null-terminated).
@@ -122,6 +232,7 @@ char *get_bitmap_filename(ClientState *client, const char *boundary);
  *
  * Return 0 if boundary string was found at the end of the request,
  * and -1 otherwise (this indicates a bad request).
+ * Bytes read past the end of the request are left in the client buffer.
  *
  * HINT: You may assume that the characters "\r\n--<boundary>--\r\n" are
  * guaranteed to be the last characters in the request data.
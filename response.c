@@ -9,64 +9,377 @@
 #include "response.h"
 #include "request.h"
 #include <fcntl.h>
-#include <sys/wait.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "socket.h"
+#include "filters/bitmap.h"
+#include "cache.h"
 
 // Functions for internal use only.
-void write_image_list(int fd);
-void write_image_response_header(int fd);
+void write_image_list(FILE *out);
+void write_response_header(int fd, const char *status, const char *headers,
+                           long length);
+
+// Whether the connection stays open after the current response.
+static int keep_alive = 0;
+
+
+void response_set_keep_alive(int on) {
+    keep_alive = on;
+}
+
+int response_keep_alive(void) {
+    return keep_alive;
+}
 
 
 /*
- * Write the main.html response to the given fd.
- * This response dynamically populates the image-filter form with
- * the filenames located in IMAGE_DIR.
+ * Format a status line and the given header lines, followed by
+ * Content-Length (omitted if length < 0) and Connection headers, into buf
+ * (of MAXLINE bytes). Return the length of the header.
  */
-void main_html_response(int fd) {
-    char *header =
-        "HTTP/1.1 200 OK\r\n"
-        "Content-type: text/html\r\n\r\n";
+static int format_response_header(char *buf, const char *status,
+                                  const char *headers, long length) {
+    int n = snprintf(buf, MAXLINE, "HTTP/1.1 %s\r\n%s", status, headers);
+    if (length >= 0) {
+        n += snprintf(buf + n, MAXLINE - n, "Content-Length: %ld\r\n", length);
+    }
+    n += snprintf(buf + n, MAXLINE - n, "Connection: %s\r\n\r\n",
+                  keep_alive ? "keep-alive" : "close");
+    return n;
+}
 
-    if(write(fd, header, strlen(header)) == -1) {
+void write_response_header(int fd, const char *status, const char *headers,
+                           long length) {
+    char buf[MAXLINE];
+    int n = format_response_header(buf, status, headers, length);
+    if (write_all(fd, buf, n) < 0) {
         perror("write");
     }
+}
+
 
+/*
+ * The rendered main.html page, kept by each process that serves it.
+ *
+ * An inotify watch on the server directory (for main.html itself, which
+ * editors often replace rather than rewrite) and on IMAGE_DIR marks it
+ * stale; the next request renders a new page and only then swaps it in.
+ * Serving a fresh page touches nothing but the inotify descriptor.
+ */
+static char *main_page = NULL;
+static size_t main_page_len = 0;
+static int page_watch = -1;      // inotify fd; -1 if not watching.
+static int server_dir_wd = -1;   // Its watch on the server directory.
+static int page_watched = 0;     // 1 once the watch has been attempted.
+
+/*
+ * Start watching main.html and IMAGE_DIR for changes. Without a watch,
+ * the page is rendered for every request.
+ */
+static void watch_main_html(void) {
+    page_watched = 1;
+    page_watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (page_watch < 0) {
+        perror("inotify_init1");
+        return;
+    }
+    uint32_t events = IN_CREATE | IN_DELETE | IN_CLOSE_WRITE |
+                      IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+    server_dir_wd = inotify_add_watch(page_watch, ".", events);
+    if (server_dir_wd < 0 || inotify_add_watch(page_watch, IMAGE_DIR, events) < 0) {
+        perror("inotify_add_watch");
+        close(page_watch);
+        page_watch = -1;
+    }
+}
+
+/*
+ * Drain pending inotify events. Return 1 if any of them can change the
+ * page: any event in IMAGE_DIR (or a lost one), or one for main.html.
+ */
+static int main_html_changed(void) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t n;
+    while ((n = read(page_watch, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->wd != server_dir_wd || (ev->mask & IN_Q_OVERFLOW) ||
+                    (ev->len > 0 && strcmp(ev->name, "main.html") == 0)) {
+                changed = 1;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return changed;
+}
+
+/*
+ * Render main.html, with the list of images inserted into its script.
+ * Return a malloc'd page and store its length in len, or return NULL.
+ */
+static char *render_main_html(size_t *len) {
+    char *page = NULL;
+    FILE *out = open_memstream(&page, len);
     FILE *in_fp = fopen("main.html", "r");
-    char buf[MAXLINE];
-    while (fgets(buf, MAXLINE, in_fp) > 0) {
-        if(write(fd, buf, strlen(buf)) == -1) {
-            perror("write");
+    if (in_fp == NULL || out == NULL) {
+        perror("main.html");
+        if (in_fp != NULL) {
+            fclose(in_fp);
+        }
+        if (out != NULL) {
+            fclose(out);
+            free(page);
         }
+        return NULL;
+    }
+    char buf[MAXLINE];
+    while (fgets(buf, MAXLINE, in_fp) != NULL) {
+        fputs(buf, out);
         // Insert a bit of dynamic Javascript into the HTML page.
         // This assumes there's only one "<script>" element in the page.
         if (strncmp(buf, "<script>", strlen("<script>")) == 0) {
-            write_image_list(fd);
+            write_image_list(out);
         }
     }
     fclose(in_fp);
+    fclose(out);
+    return page;
 }
 
 
 /*
- * Write image directory contents to the given fd, in the format
+ * Write the main.html response to the given fd.
+ * This response dynamically populates the image-filter form with
+ * the filenames located in IMAGE_DIR.
+ *
+ * The page comes from the cache (rendered again first if it is stale),
+ * and is sent with its header in a single writev.
+ */
+void main_html_response(int fd) {
+    if (!page_watched) {
+        watch_main_html();
+    }
+    int stale = main_page == NULL || page_watch < 0 || main_html_changed();
+    if (stale) {
+        size_t len;
+        char *page = render_main_html(&len);
+        if (page == NULL) {
+            internal_server_error_response(fd, "Couldn't load main.html");
+            return;
+        }
+        free(main_page);
+        main_page = page;
+        main_page_len = len;
+    }
+
+    char header[MAXLINE];
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = format_response_header(header, "200 OK",
+        "Content-Type: text/html\r\n", main_page_len);
+    iov[1].iov_base = main_page;
+    iov[1].iov_len = main_page_len;
+    if (writev_all(fd, iov, 2) < 0) {
+        perror("writev");
+    }
+}
+
+
+/*
+ * Write image directory contents to the given stream, in the format
  * "var filenames = ['<filename1>', '<filename2>', ...];\n"
  *
  * This is actually a line of Javascript that's used to populate the form
  * when the webpage is loaded.
  */
-void write_image_list(int fd) {
+void write_image_list(FILE *out) {
     DIR *d = opendir(IMAGE_DIR);
     struct dirent *dir;
 
-    dprintf(fd, "var filenames = [");
+    fprintf(out, "var filenames = [");
     if (d != NULL) {
         while ((dir = readdir(d)) != NULL) {
             if (strcmp(dir->d_name, ".") != 0 && strcmp(dir->d_name, "..") != 0) {
-                dprintf(fd, "'%s', ", dir->d_name);
+                fprintf(out, "'%s', ", dir->d_name);
             }
         }
         closedir(d);
     }
-    dprintf(fd, "];\n");
+    fprintf(out, "];\n");
+}
+
+
+/*
+ * Write the header of a bitmap response of len bytes to header (of
+ * MAXLINE bytes), and return its length. The X-Cache header tells how
+ * the result was found: "hit" in the cache, "miss", or "coalesced" with
+ * another process's miss. There is none if cache is NULL.
+ */
+static int format_image_header(char *header, size_t len, const char *cache) {
+    char headers[MAXLINE];
+    snprintf(headers, sizeof(headers),
+             "Content-Type: image/bmp\r\n"
+             "Content-Disposition: attachment; filename=\"output.bmp\"\r\n"
+             "%s%s%s", cache ? "X-Cache: " : "", cache ? cache : "",
+             cache ? "\r\n" : "");
+    return format_response_header(header, "200 OK", headers, len);
+}
+
+/*
+ * Send a bitmap response of len bytes, from data, or from file_fd with
+ * sendfile if data is NULL, with the X-Cache header given by cache.
+ */
+static void send_image(int fd, const unsigned char *data, int file_fd,
+                       size_t len, const char *cache) {
+    char header[MAXLINE];
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = format_image_header(header, len, cache);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    int status;
+    if (data != NULL) {
+        status = writev_all(fd, iov, 2);
+    } else {
+        status = writev_all(fd, iov, 1);
+        if (status == 0) {
+            status = sendfile_all(fd, file_fd, len);
+        }
+    }
+    if (status < 0) {
+        perror("send image");
+        keep_alive = 0;
+    }
+}
+
+
+/*
+ * Send the image at path as it is, if it is a bitmap file with nothing
+ * after its pixels, and so is its own copy. Return -1, having sent
+ * nothing, if it isn't.
+ */
+static int send_unfiltered(int fd, const char *path) {
+    int image_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (image_fd < 0) {
+        return -1;
+    }
+    unsigned char header[4096];
+    struct stat st;
+    ssize_t n;
+    if (fstat(image_fd, &st) < 0 ||
+            (n = pread(image_fd, header, sizeof(header), 0)) < 0 ||
+            bitmap_size(header, n) != st.st_size) {
+        close(image_fd);
+        return -1;
+    }
+    send_image(fd, NULL, image_fd, st.st_size, NULL);
+    close(image_fd);
+    return 0;
+}
+
+
+/*
+ * Send the result of a flight another process leads, as it is produced.
+ * Return -1 if its leader failed before anything was sent.
+ */
+static int follow_flight(int fd, Flight *flight) {
+    long len = flight_length(flight);
+    if (len < 0) {
+        return -1;
+    }
+    char header[MAXLINE];
+    int header_len = format_image_header(header, len, "coalesced");
+    if (write_all(fd, header, header_len) < 0) {
+        keep_alive = 0;
+        return 0;
+    }
+    long sent = 0;
+    while (sent < len) {
+        long available = flight_wait(flight, sent);
+        if (available <= sent || sendfile_all(fd, flight->fd, available - sent) < 0) {
+            break;
+        }
+        sent = available;
+    }
+    if (sent < len) {
+        // The client can't be told of the error part way through the body.
+        fprintf(stderr, "Flight ended after %ld of %ld bytes\n", sent, len);
+        keep_alive = 0;
+    }
+    return 0;
+}
+
+// Where the result of a miss goes as it is produced: to the client, to
+// the followers of its flight, if any, and into a buffer for the cache.
+// A result too large for the cache is only passed on, through a buffer of
+// one chunk.
+typedef struct {
+    int fd;               // The client, or -1 once sending to it fails.
+    unsigned char *data;
+    size_t len, size;     // Bytes in data, and the size of the result.
+    Flight *flight;
+    size_t flushed;       // Bytes of data passed on to the client and followers.
+    size_t cap;           // Size of data: the result's, or RESULT_CHUNK.
+    size_t produced;      // Bytes of the result so far.
+} Result;
+
+// The client and the followers get the result in chunks of about this
+// size, the first as soon as the first rows are done.
+#define RESULT_CHUNK (64 * 1024)
+
+static void pass_on(Result *result, const void *data, size_t len) {
+    if (result->fd >= 0 && write_all(result->fd, data, len) < 0) {
+        perror("send image");
+        result->fd = -1;
+        keep_alive = 0;
+    }
+}
+
+/*
+ * Pass len bytes of the result on to the client and the followers.
+ */
+static void flush_result(Result *result, const void *data, size_t len) {
+    if (result->flight != NULL) {
+        flight_write(result->flight, data, len);
+    }
+    pass_on(result, data, len);
+}
+
+static int collect_result(void *arg, const void *data, size_t len) {
+    Result *result = arg;
+    if (result->data == NULL) {
+        result->cap = cache_fits(result->size) ? result->size : RESULT_CHUNK;
+        if ((result->data = malloc(result->cap)) == NULL) {
+            perror("Failed to allocate memory for the image");
+            return -1;
+        }
+        if (result->flight != NULL) {
+            flight_size(result->flight, result->size);
+        }
+        char header[MAXLINE];
+        pass_on(result, header, format_image_header(header, result->size, "miss"));
+    }
+    result->produced += len;
+    if (result->len + len > result->cap) {
+        // Only a result that isn't kept gets here: its buffer is reused.
+        flush_result(result, result->data + result->flushed, result->len - result->flushed);
+        result->len = result->flushed = 0;
+        if (len > result->cap) {
+            flush_result(result, data, len);
+            return 0;
+        }
+    }
+    memcpy(result->data + result->len, data, len);
+    result->len += len;
+    if (result->len - result->flushed >= RESULT_CHUNK || result->produced == result->size) {
+        flush_result(result, result->data + result->flushed, result->len - result->flushed);
+        result->flushed = result->len;
+    }
+    return 0;
 }
 
 
@@ -76,75 +389,149 @@ void write_image_list(int fd) {
  *    under the "Input validation" section of Part 3 of the handout.
  *
  *    Ignore all other query parameters, and any other data in the request.
- *    Read about and use the "access" system call to check for the presence of
- *    files *with the correct permissions*.
+ *    The request names either one filter from the filter registry, or a
+ *    chain of them ("chain=gaussian_blur,greyscale,scale:2"), and the
+ *    image must be readable ("access" checks for the presence of files
+ *    *with the correct permissions*). It may ask for the filters to run
+ *    on a number of threads ("threads=4", up to MAX_FILTER_THREADS);
+ *    otherwise they run on filter_threads. The chain is run as planned
+ *    (see plan_chain), for the same image exactly, or with a tolerance
+ *    ("tolerance=2"), for an image whose channels may differ by that much.
  *
  * 2. If the request is invalid, send an informative error message as a response
  *    using the bad_request_response function.
  *
- * 3. Otherwise, write an appropriate HTTP header for a bitmap file (we've
- *    provided a function to do so), and then use dup2 and execl to run
- *    the specified image filter and write the output directly to the socket.
+ * 3. Otherwise, if the filters leave the image as it is, send the image
+ *    file itself. Else send the result from the cache, or from the flight
+ *    of a process already running the same filters on the same image, or
+ *    run the filters in this process on the image, mapped (see
+ *    map_image), as a single pass over its rows, sending the result (with
+ *    a header for a bitmap file) as it is produced, and add it to the
+ *    cache.
  */
 void image_filter_response(int fd, const ReqData *reqData) {
-
-    // IMPLEMENT THIS
-    char *filter = NULL, *image = NULL;
+    char *filter_name = NULL, *chain = NULL, *image = NULL;
+    int threads = filter_threads, tolerance = 0;
 
     for (int i = 0; i < MAX_QUERY_PARAMS && reqData->params[i].name != NULL; i++) {
         if (strcmp(reqData->params[i].name, "filter") == 0) {
-            filter = reqData->params[i].value;
+            filter_name = reqData->params[i].value;
+        } else if (strcmp(reqData->params[i].name, "chain") == 0) {
+            chain = reqData->params[i].value;
         } else if (strcmp(reqData->params[i].name, "image") == 0) {
             image = reqData->params[i].value;
+        } else if (strcmp(reqData->params[i].name, "threads") == 0) {
+            char *end;
+            long value = strtol(reqData->params[i].value, &end, 10);
+            threads = *end == '\0' && value >= 1 ? min(value, MAX_FILTER_THREADS) : -1;
+        } else if (strcmp(reqData->params[i].name, "tolerance") == 0) {
+            char *end;
+            long value = strtol(reqData->params[i].value, &end, 10);
+            tolerance = *end == '\0' && value >= 0 ? min(value, 255) : -1;
         }
     }
 
-    if (!filter || !image || strchr(filter, '/') || strchr(image, '/')) {
+    ChainStep steps[MAX_CHAIN];
+    int num_steps = -1;
+    if (chain != NULL) {
+        num_steps = parse_chain(chain, steps);
+    } else if (filter_name != NULL && (steps[0].filter = find_filter(filter_name)) != NULL) {
+        steps[0].scale = (Scale){steps[0].filter->scale_factor, 1};
+        num_steps = 1;
+    }
+
+    if (num_steps < 0 || threads < 0 || tolerance < 0 || !image || strchr(image, '/')) {
         bad_request_response(fd, "bad request error");
         return;
     }
 
-    char filter_path[MAXLINE];
     char image_path[MAXLINE];
-    snprintf(filter_path, sizeof(filter_path), "./filters/%s", filter);
     snprintf(image_path, sizeof(image_path), "./images/%s", image);
-    
-    if (access(filter_path, X_OK) != 0 || access(image_path, R_OK) != 0) {
+
+    if (access(image_path, R_OK) != 0) {
         bad_request_response(fd, "bad request error");
         return;
     }
 
-    write_image_response_header(fd);
-    
-    // Run the image filter
-    int pid = fork();
-    if (pid == 0) {
-        int image_fd = open(image_path, O_RDONLY);
-        if (image_fd == -1) {
-            perror("Failed to open image file");
-            exit(1);
-        }
-        if (dup2(image_fd, STDIN_FILENO) == -1) {
-            perror("Failed to redirect stdin");
-            exit(1);
-        }
+    // The plan is what runs, and what the result is cached as.
+    Plan plan;
+    num_steps = plan_chain(steps, num_steps, tolerance, &plan);
+    memcpy(steps, plan.steps, num_steps * sizeof(ChainStep));
 
-        close(image_fd);
+    // A chain of copies needs neither the filters nor the cache.
+    char canonical[16];
+    if (format_chain(steps, num_steps, canonical, sizeof(canonical)) > 0 &&
+            strcmp(canonical, "copy") == 0 && send_unfiltered(fd, image_path) == 0) {
+        return;
+    }
 
-        if (dup2(fd, STDOUT_FILENO) == -1) {
-            perror("Failed to redirect stdout to socket");
-            exit(1);
+    // Results are cached by the image's contents and the chain. While
+    // the image is unchanged, its hash is remembered, so a hit doesn't
+    // touch it at all, and its mapping is kept, so a miss reads nothing.
+    uint64_t image_hash;
+    ImageSource src = {NULL};
+    if (!lookup_image_hash(image, &image_hash)) {
+        if (map_image(image, &src) < 0) {
+            internal_server_error_response(fd, "Unable to read image");
+            return;
         }
+        image_hash = hash_image(image, src.data, src.len);
+    }
+    CacheKey key;
+    make_cache_key(&key, image_hash, steps, num_steps);
+    CacheHit hit;
+    if (cache_lookup(&key, &hit)) {
+        if (src.map != NULL) {
+            release_image(&src);
+        }
+        send_image(fd, hit.data, hit.fd, hit.len, "hit");
+        cache_release(&hit);
+        return;
+    }
 
-        execl(filter_path, filter, NULL); 
+    // If another process is already running these filters on this image,
+    // send its result as it comes. If it fails, run them here after all.
+    Flight flight;
+    int leader = cache_join(&key, &flight);
+    if (leader == 0) {
+        int followed = follow_flight(fd, &flight);
+        flight_leave(&flight);
+        if (followed == 0) {
+            if (src.map != NULL) {
+                release_image(&src);
+            }
+            return;
+        }
+    }
 
-        perror("Failed to execute image filter");
-        exit(1);
-    } else if (pid > 0) {
-        wait(NULL);
-    } else {
-        bad_request_response(fd, "Unable to fork");
+    Result result = {fd, NULL, 0, 0, leader == 1 ? &flight : NULL, 0, 0, 0};
+    if (src.map == NULL && map_image(image, &src) < 0) {
+        cache_finish(&key, result.flight, NULL, 0);
+        internal_server_error_response(fd, "Unable to read image");
+        return;
+    }
+    int status = stream_chain(steps, num_steps, src.data, src.len, &result.size, threads,
+                              collect_result, &result);
+    release_image(&src);
+    if (status < 0) {
+        cache_finish(&key, result.flight, NULL, 0);
+        if (result.data != NULL) {
+            // The response has started: all that can be done is to cut it short.
+            free(result.data);
+            keep_alive = 0;
+        } else if (result.size == 0) {
+            // stream_chain gives the size of the result only for a valid bitmap.
+            bad_request_response(fd, "Image is not a valid bitmap.");
+        } else {
+            internal_server_error_response(fd, "Unable to filter the image.");
+        }
+        return;
     }
+    if (result.cap < result.size) {
+        free(result.data);
+        result.data = NULL;
+    }
+    cache_finish(&key, result.flight, result.data, result.len);
 }
 
 
@@ -156,13 +543,16 @@ void image_filter_response(int fd, const ReqData *reqData) {
  *
  * We've split up the parsing of the rest of the request data into different
  * steps, so at each step it's a bit easier for you to test your code.
+ *
+ * This runs in long-lived worker processes, so errors return rather than
+ * exit, and the caller closes the socket.
  */
 void image_upload_response(ClientState *client) {
     // First, extract the boundary string for the request.
     char *boundary = get_boundary(client);
     if (boundary == NULL) {
         bad_request_response(client->sock, "Couldn't find boundary string in request.");
-        exit(1);
+        return;
     }
     fprintf(stderr, "Boundary string: %s\n", boundary);
 
@@ -170,8 +560,8 @@ void image_upload_response(ClientState *client) {
     char *filename = get_bitmap_filename(client, boundary);
     if (filename == NULL) {
         bad_request_response(client->sock, "Couldn't find bitmap filename in request.");
-        close(client->sock);
-        exit(1);
+        free(boundary);
+        return;
     }
 
     // If the file already exists, send a Bad Request error to the user.
@@ -181,47 +571,48 @@ void image_upload_response(ClientState *client) {
 
     fprintf(stderr, "Bitmap path: %s\n", path);
 
-    if (access(path, F_OK) >= 0) {
+    int file_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (file_fd < 0 && errno == EEXIST) {
         bad_request_response(client->sock, "File already exists.");
-        exit(1);
+        free(boundary);
+        free(filename);
+        free(path);
+        return;
+    } else if (file_fd < 0) {
+        perror("open");
+        internal_server_error_response(client->sock, "Couldn't save the file.");
+        free(boundary);
+        free(filename);
+        free(path);
+        return;
+    }
+    int status = save_file_upload(client, boundary, file_fd);
+    close(file_fd);
+    if (status < 0) {
+        // Don't leave a partial (or preallocated) file behind.
+        unlink(path);
     }
-
-    FILE *file = fopen(path, "wb");
-    save_file_upload(client, boundary, fileno(file));
-    fclose(file);
     free(boundary);
     free(filename);
     free(path);
+    if (status < 0) {
+        bad_request_response(client->sock, "Incomplete upload.");
+        return;
+    }
     see_other_response(client->sock, MAIN_HTML);
 }
 
 
-/*
- * Write the header for a bitmap image response to the given fd.
- */
-void write_image_response_header(int fd) {
-    char *response =
-        "HTTP/1.1 200 OK\r\n"
-        "Content-Type: image/bmp\r\n"
-        "Content-Disposition: attachment; filename=\"output.bmp\"\r\n\r\n";
-
-    write(fd, response, strlen(response));
-}
-
-
 void not_found_response(int fd) {
-    char *response =
-        "HTTP/1.1 404 Not Found\r\n"
-        "Content-Type: text/plain\r\n\r\n"
-        "Page not found.\r\n";
-    write(fd, response, strlen(response));
+    char *body = "Page not found.\r\n";
+    write_response_header(fd, "404 Not Found", "Content-Type: text/plain\r\n",
+                          strlen(body));
+    write_all(fd, body, strlen(body));
 }
 
 
 void internal_server_error_response(int fd, const char *message) {
-    char *response =
-        "HTTP/1.1 500 Internal Server Error\r\n"
-        "Content-Type: text/html\r\n\r\n"
+    char *response_body =
         "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
         "<html><head>\r\n"
         "<title>500 Internal Server Error</title>\r\n"
@@ -230,15 +621,16 @@ void internal_server_error_response(int fd, const char *message) {
         "<p>%s<p>\r\n"
         "</body></html>\r\n";
 
-    dprintf(fd, response, message);
+    char body_buf[MAXLINE];
+    int len = snprintf(body_buf, sizeof(body_buf), response_body, message);
+    keep_alive = 0;
+    write_response_header(fd, "500 Internal Server Error",
+                          "Content-Type: text/html\r\n", len);
+    write_all(fd, body_buf, len);
 }
 
 
 void bad_request_response(int fd, const char *message) {
-    char *response_header =
-        "HTTP/1.1 400 Bad Request\r\n"
-        "Content-Type: text/html\r\n"
-        "Content-Length: %d\r\n\r\n";
     char *response_body = 
         "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
         "<html><head>\r\n"
@@ -247,24 +639,55 @@ void bad_request_response(int fd, const char *message) {
         "<h1>Bad Request</h1>\r\n"
         "<p>%s<p>\r\n"
         "</body></html>\r\n";
-    char header_buf[MAXLINE];
     char body_buf[MAXLINE];
-    sprintf(body_buf, response_body, message);
-    sprintf(header_buf, response_header, strlen(body_buf));
-    write(fd, header_buf, strlen(header_buf));
-    write(fd, body_buf, strlen(body_buf));
-    // Because we are making some simplfications with the HTTP protocol
-    // the browser will get a "connection reset" message. This happens
-    // because our server is closing the connection and terminating the process.
-    // So this is really a hack.
-    sleep(1);
+    int len = snprintf(body_buf, sizeof(body_buf), response_body, message);
+    // The rest of a bad request can't be trusted, so the connection is
+    // closed after the response. The caller shuts down the write side
+    // first and drains what the client still sends (a "lingering close"),
+    // so the client sees the response instead of a connection reset.
+    keep_alive = 0;
+    write_response_header(fd, "400 Bad Request", "Content-Type: text/html\r\n", len);
+    write_all(fd, body_buf, len);
 }
 
 
-void see_other_response(int fd, const char *other) {
-    char *response =
-        "HTTP/1.1 303 See Other\r\n"
-        "Location: %s\r\n\r\n";
+void header_fields_too_large_response(int fd) {
+    char *response_body =
+        "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
+        "<html><head>\r\n"
+        "<title>431 Request Header Fields Too Large</title>\r\n"
+        "</head><body>\r\n"
+        "<h1>Request Header Fields Too Large</h1>\r\n"
+        "</body></html>\r\n";
+    int len = strlen(response_body);
+    // The rest of the request hasn't been read, so the connection can't
+    // be reused.
+    keep_alive = 0;
+    write_response_header(fd, "431 Request Header Fields Too Large",
+                          "Content-Type: text/html\r\n", len);
+    write_all(fd, response_body, len);
+}
+
 
-    dprintf(fd, response, other);
-}
\ No newline at end of file
+void service_unavailable_response(int fd) {
+    char *response_body =
+        "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
+        "<html><head>\r\n"
+        "<title>503 Service Unavailable</title>\r\n"
+        "</head><body>\r\n"
+        "<h1>Service Unavailable</h1>\r\n"
+        "</body></html>\r\n";
+    int len = strlen(response_body);
+    // The request was never served, so nothing more is read from the
+    // connection.
+    keep_alive = 0;
+    write_response_header(fd, "503 Service Unavailable", "Content-Type: text/html\r\n", len);
+    write_all(fd, response_body, len);
+}
+
+
+void see_other_response(int fd, const char *other) {
+    char headers[MAXLINE];
+    snprintf(headers, sizeof(headers), "Location: %s\r\n", other);
+    write_response_header(fd, "303 See Other", headers, 0);
+}
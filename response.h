@@ -5,6 +5,14 @@
 #include "request.h"
 
 
+/*
+ * Set whether the connection stays open after the response being written,
+ * which determines its Connection header. Error responses turn this off;
+ * response_keep_alive() reports the final decision.
+ */
+void response_set_keep_alive(int on);
+int response_keep_alive(void);
+
 /*
  * Write the main.html response to the given fd.
  * This response dynamically populates the image-filter form with
@@ -32,6 +40,8 @@ void image_upload_response(ClientState *client);
 void not_found_response(int fd);
 void bad_request_response(int fd, const char *message);
 void internal_server_error_response(int fd, const char *message);
+void header_fields_too_large_response(int fd);
+void service_unavailable_response(int fd);
 
 // This one takes a resource name instead, and redirects the client
 // to that resource.
@@ -1,13 +1,20 @@
+#define _GNU_SOURCE        /* accept4 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <arpa/inet.h>     /* inet_ntoa */
 #include <netdb.h>         /* gethostname */
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 
 #include "socket.h"
 
+#define MAXLINE_DRAIN 4096
+
 /*
  * Initialize a server address associated with the given port.
  */
@@ -29,8 +36,10 @@ struct sockaddr_in *init_server_addr(int port) {
 
 /*
  * Create and setup a socket for a server to listen on.
+ * With reuse_port set, several sockets can bind the same address and the
+ * kernel balances incoming connections between them.
  */
-int setup_server_socket(struct sockaddr_in *self, int num_queue) {
+int setup_server_socket(struct sockaddr_in *self, int num_queue, int reuse_port) {
     int soc = socket(PF_INET, SOCK_STREAM, 0);
     if (soc < 0) {
         perror("socket");
@@ -47,6 +56,12 @@ int setup_server_socket(struct sockaddr_in *self, int num_queue) {
         exit(1);
     }
 
+    if (reuse_port && setsockopt(soc, SOL_SOCKET, SO_REUSEPORT,
+            (const char *) &on, sizeof(on)) < 0) {
+        perror("setsockopt");
+        exit(1);
+    }
+
     // Associate the process with the address and a port
     if (bind(soc, (struct sockaddr *)self, sizeof(*self)) < 0) {
         // bind failed; could be because port is in use.
@@ -66,18 +81,22 @@ int setup_server_socket(struct sockaddr_in *self, int num_queue) {
 
 
 /*
- * Wait for and accept a new connection.
- * Return -1 if the accept call failed.
+ * Accept a new connection. The listening socket is non-blocking, so the
+ * returned socket is non-blocking as well.
+ * Return -1 if the accept call failed; errno is EAGAIN once the queue
+ * of pending connections has been drained.
  */
 int accept_connection(int listenfd) {
     struct sockaddr_in peer;
     unsigned int peer_len = sizeof(peer);
     peer.sin_family = PF_INET;
 
-    fprintf(stderr, "Waiting for a new connection...\n");
-    int client_socket = accept(listenfd, (struct sockaddr *)&peer, &peer_len);
+    int client_socket = accept4(listenfd, (struct sockaddr *)&peer, &peer_len,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (client_socket < 0) {
-        perror("accept");
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("accept");
+        }
         return -1;
     } else {
         fprintf(stderr,
@@ -88,6 +107,120 @@ int accept_connection(int listenfd) {
     }
 }
 
+/*
+ * Turn O_NONBLOCK on (on != 0) or off for the given fd.
+ * Return -1 if fcntl failed.
+ */
+int set_nonblocking(int fd, int on) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        perror("fcntl");
+        return -1;
+    }
+    flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    if (fcntl(fd, F_SETFL, flags) < 0) {
+        perror("fcntl");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Make blocking reads on fd fail with EAGAIN after the given number of
+ * seconds without data. Return -1 if setsockopt failed.
+ */
+int set_recv_timeout(int fd, int seconds) {
+    struct timeval tv = { .tv_sec = seconds, .tv_usec = 0 };
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        perror("setsockopt");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Close a blocking socket without resetting it: stop writing, then discard
+ * whatever the client still sends until it closes its end (or the receive
+ * timeout expires), so that it reads the whole response first.
+ */
+void lingering_close(int fd) {
+    char buf[MAXLINE_DRAIN];
+    shutdown(fd, SHUT_WR);
+    set_recv_timeout(fd, 1);
+    while (read(fd, buf, sizeof(buf)) > 0) {
+        // Discard.
+    }
+    close(fd);
+}
+
+
+/*
+ * Write all len bytes of buf to fd, retrying short writes.
+ * Return -1 if a write failed.
+ */
+int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/*
+ * Write every buffer in iov to fd, retrying short writes. The iov array
+ * is modified. Return -1 if a write failed.
+ */
+int writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Send len bytes of file_fd, from its current offset, to fd with sendfile,
+ * retrying short writes. Return -1 if sending failed.
+ */
+int sendfile_all(int fd, int file_fd, size_t len) {
+    while (len > 0) {
+        ssize_t n = sendfile(fd, file_fd, NULL, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
 
 /******************************************************************************
  * Client-specific functions
@@ -6,8 +6,16 @@
 #define MAX_HOSTNAME 256
 
 struct sockaddr_in *init_server_addr(int port);
-int setup_server_socket(struct sockaddr_in *self, int num_queue);
+int setup_server_socket(struct sockaddr_in *self, int num_queue, int reuse_port);
 int accept_connection(int listenfd);
+int set_nonblocking(int fd, int on);
+int set_recv_timeout(int fd, int seconds);
+void lingering_close(int fd);
+
+struct iovec;
+int write_all(int fd, const void *buf, size_t len);
+int writev_all(int fd, struct iovec *iov, int iovcnt);
+int sendfile_all(int fd, int file_fd, size_t len);
 
 int connect_to_server(int port, const char *hostname);
 
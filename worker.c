@@ -0,0 +1,480 @@
+#define _GNU_SOURCE        /* close_range */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "response.h"
+#include "socket.h"
+#include "worker.h"
+
+
+/******************************************************************************
+ * Passing requests over the worker channel
+ *****************************************************************************/
+
+// A connection that this many workers failed to take is answered with 503.
+#define MAX_DISPATCH_ATTEMPTS 3
+
+// Views of a request that are passed as offsets: method, path, query,
+// then the name and value of every param and header.
+#define NUM_VIEWS (3 + 2 * MAX_QUERY_PARAMS + 2 * MAX_HEADERS)
+
+/*
+ * Collect pointers to every view of the request, in a fixed order.
+ */
+static void request_views(ReqData *req, char ***views) {
+    int n = 0;
+    views[n++] = &req->method;
+    views[n++] = &req->path;
+    views[n++] = &req->query;
+    for (int i = 0; i < MAX_QUERY_PARAMS; i++) {
+        views[n++] = &req->params[i].name;
+        views[n++] = &req->params[i].value;
+    }
+    for (int i = 0; i < MAX_HEADERS; i++) {
+        views[n++] = &req->headers[i].name;
+        views[n++] = &req->headers[i].value;
+    }
+}
+
+// The fixed part of a request message; the request bytes follow it.
+typedef struct {
+    int keep_alive;
+    int num_requests;
+    int num_headers;
+    int pos;                         // Where the unconsumed bytes start.
+    int len;                         // Number of request bytes that follow.
+    long content_length;
+    int known[NUM_KNOWN_HEADERS];
+    int offsets[NUM_VIEWS];          // Views as offsets; -1 stands for NULL.
+} RequestMsg;
+
+// The fixed part of a message handing a connection back to the listener;
+// its unconsumed bytes follow it.
+typedef struct {
+    int keep_alive;
+    int num_requests;
+    int num_bytes;
+} ConnectionMsg;
+
+/*
+ * Return the size of the largest message sent over a worker channel: a
+ * request can't be larger than a full client buffer.
+ */
+static int max_msg_size(void) {
+    return sizeof(RequestMsg) + max_request_head;
+}
+
+/*
+ * Return the length of the message pack_request makes for the client.
+ */
+static int request_msg_size(const ClientState *client) {
+    return sizeof(RequestMsg) + client->num_bytes - client->req_start;
+}
+
+/*
+ * Serialize the client's parsed request into msg. The request is already
+ * laid out in the client buffer (with its tokens terminated in place), so
+ * its raw bytes (from req_start on) are sent as they are, after a
+ * RequestMsg with the views as offsets into them.
+ * Return the length of the message.
+ */
+static int pack_request(const ClientState *client, char *msg) {
+    const ReqData *req = client->reqData;
+    char *base = client->buf + client->req_start;
+    RequestMsg head;
+    head.keep_alive = client->keep_alive;
+    head.num_requests = client->num_requests;
+    head.num_headers = req->num_headers;
+    head.pos = client->pos - client->req_start;
+    head.len = client->num_bytes - client->req_start;
+    head.content_length = req->content_length;
+    memcpy(head.known, req->known, sizeof(head.known));
+
+    char **views[NUM_VIEWS];
+    request_views(client->reqData, views);
+    for (int i = 0; i < NUM_VIEWS; i++) {
+        head.offsets[i] = *views[i] ? *views[i] - base : -1;
+    }
+
+    memcpy(msg, &head, sizeof(head));
+    memcpy(msg + sizeof(head), base, head.len);
+    return sizeof(head) + head.len;
+}
+
+/*
+ * Rebuild a ClientState from a message produced by pack_request. The
+ * request bytes go to the front of client->buf and the views are rebased
+ * onto them.
+ */
+static void unpack_request(const char *msg, ClientState *client) {
+    RequestMsg head;
+    memcpy(&head, msg, sizeof(head));
+    client->keep_alive = head.keep_alive;
+    client->num_requests = head.num_requests;
+    client->req.num_headers = head.num_headers;
+    client->req.content_length = head.content_length;
+    memcpy(client->req.known, head.known, sizeof(head.known));
+
+    client->num_bytes = 0;
+    reserve_buffer(client, head.len + 1);
+    memcpy(client->buf, msg + sizeof(head), head.len);
+    client->num_bytes = head.len;
+    client->buf[client->num_bytes] = '\0';
+    client->pos = client->scan = client->head_end = head.pos;
+    client->req_start = 0;
+    client->body_dropped = 0;
+
+    char **views[NUM_VIEWS];
+    request_views(&client->req, views);
+    for (int i = 0; i < NUM_VIEWS; i++) {
+        *views[i] = head.offsets[i] < 0 ? NULL : client->buf + head.offsets[i];
+    }
+    client->state = PARSE_DONE;
+    client->reqData = &client->req;
+}
+
+/*
+ * Serialize the state of a connection going back to the listener: a
+ * ConnectionMsg followed by the unconsumed bytes of the client buffer.
+ * Return the length of the message.
+ */
+static int pack_connection(const ClientState *client, char *msg) {
+    ConnectionMsg head;
+    head.keep_alive = client->keep_alive;
+    head.num_requests = client->num_requests;
+    head.num_bytes = client->num_bytes - client->pos;
+    memcpy(msg, &head, sizeof(head));
+    memcpy(msg + sizeof(head), client->buf + client->pos, head.num_bytes);
+    return sizeof(head) + head.num_bytes;
+}
+
+/*
+ * Rebuild a returned connection from a message made by pack_connection.
+ * Its buffer points into msg; the caller copies the bytes it needs.
+ */
+static void unpack_connection(char *msg, ClientState *client) {
+    ConnectionMsg head;
+    memcpy(&head, msg, sizeof(head));
+    client->keep_alive = head.keep_alive;
+    client->num_requests = head.num_requests;
+    client->num_bytes = head.num_bytes;
+    client->buf = msg + sizeof(head);
+    client->buf_size = head.num_bytes;
+    client->pos = client->scan = client->req_start = client->head_end = 0;
+    client->reqData = NULL;
+    client->closing = !client->keep_alive;
+}
+
+/*
+ * Send a message together with a file descriptor (SCM_RIGHTS).
+ */
+static int send_with_fd(int chan, const char *msg, int len, int fd) {
+    struct iovec iov = { .iov_base = (void *)msg, .iov_len = len };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl.buf;
+    mh.msg_controllen = sizeof(ctl.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(chan, &mh, MSG_NOSIGNAL) < 0) {
+        perror("sendmsg");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Receive a message and the file descriptor attached to it.
+ * Return the message length, 0 if the channel was closed, or -1 on error.
+ */
+static int recv_with_fd(int chan, char *msg, int cap, int *fd) {
+    struct iovec iov = { .iov_base = msg, .iov_len = cap };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl.buf;
+    mh.msg_controllen = sizeof(ctl.buf);
+
+    int len = recvmsg(chan, &mh, MSG_CMSG_CLOEXEC);
+    if (len <= 0) {
+        return len;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "Worker message without a socket\n");
+        return -1;
+    }
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    return len;
+}
+
+
+/******************************************************************************
+ * Worker processes
+ *****************************************************************************/
+
+/*
+ * The body of a worker process: serve one request at a time for as long
+ * as the listener keeps the channel open. The message buffer and
+ * ClientState are reused for every request.
+ *
+ * After the response, the socket goes back to the listener with any bytes
+ * of the next (pipelined) request, so that an idle persistent connection
+ * never ties up a worker. A connection that is not kept alive has its
+ * write side shut down and is handed back only to be drained and closed.
+ */
+static void worker_main(int chan, void (*serve)(ClientState *)) {
+    static ClientState client;
+    int msg_size = max_msg_size();
+    char *msg = malloc(msg_size);
+
+    while (1) {
+        int sock;
+        int len = recv_with_fd(chan, msg, msg_size, &sock);
+        if (len == 0) {
+            exit(0);     // The listener has gone away.
+        } else if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            exit(1);
+        }
+
+        unpack_request(msg, &client);
+        client.sock = sock;
+        set_nonblocking(sock, 0);
+        set_recv_timeout(sock, keep_alive_timeout);
+
+        serve(&client);
+
+        if (!client.keep_alive) {
+            shutdown(sock, SHUT_WR);
+        }
+        len = pack_connection(&client, msg);
+        if (send_with_fd(chan, msg, len, sock) < 0) {
+            exit(1);
+        }
+        close(sock);
+    }
+}
+
+/*
+ * Fork the worker at index i and register its channel with the listener
+ * for the given events.
+ *
+ * The server is multithreaded by the time a worker has to be replaced,
+ * so that is done by the main thread (see pool_restart_workers), which
+ * waits in sigwait and so holds no locks when it forks. glibc's fork
+ * leaves malloc and stdio usable in the child, and the child only closes
+ * what it inherited before it runs worker_main.
+ */
+static void spawn_worker(WorkerPool *pool, int i, uint32_t events) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    } else if (pid == 0) {
+        // Drop everything inherited from the listener (the listening
+        // socket, epoll instance, other workers' channels and client
+        // sockets) except stdio and this worker's channel.
+        int chan = sv[1];
+        close_range(3, chan - 1, 0);
+        close_range(chan + 1, ~0U, 0);
+
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+
+        worker_main(chan, pool->serve);
+        exit(0);
+    }
+
+    close(sv[1]);
+    pool->workers[i].pid = pid;
+    pool->workers[i].chan = sv[0];
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = WORKER_TOKEN(i);
+    if (epoll_ctl(pool->epfd, EPOLL_CTL_ADD, sv[0], &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+
+WorkerPool *start_worker_pool(int num_workers, int epfd,
+                              void (*serve)(ClientState *)) {
+    WorkerPool *pool = malloc(sizeof(WorkerPool));
+    pool->workers = malloc(sizeof(Worker) * num_workers);
+    pool->num_workers = num_workers;
+    pool->epfd = epfd;
+    pool->serve = serve;
+    pool->head = pool->tail = NULL;
+    pool->msg = malloc(max_msg_size());
+
+    for (int i = 0; i < num_workers; i++) {
+        pool->workers[i].busy = pool->workers[i].restarting = pool->workers[i].dead = 0;
+        spawn_worker(pool, i, EPOLLIN);
+    }
+    return pool;
+}
+
+
+/******************************************************************************
+ * Dispatching connections
+ *****************************************************************************/
+
+/*
+ * Hand the next pending connection to the (idle) worker at index i.
+ *
+ * If the worker can't take it, the worker is treated as dead: it is
+ * killed and marked busy, so nothing more is sent to it until its channel
+ * closes and pool_worker_done starts a replacement. The connection stays
+ * at the head of the queue for the next idle worker, unless too many
+ * have failed to take it; then it is answered with 503 and closed.
+ * Return -1 if the worker failed, and 0 otherwise.
+ */
+static int dispatch_pending(WorkerPool *pool, int i) {
+    Pending *p = pool->head;
+    if (p == NULL) {
+        return 0;
+    }
+
+    int sent = send_with_fd(pool->workers[i].chan, p->msg, p->len, p->sock) == 0;
+    if (!sent) {
+        fprintf(stderr, "Worker [%d] didn't take a request; restarting it\n",
+                pool->workers[i].pid);
+        kill(pool->workers[i].pid, SIGKILL);
+        pool->workers[i].busy = 1;
+        if (++p->attempts < MAX_DISPATCH_ATTEMPTS) {
+            return -1;
+        }
+    }
+
+    pool->head = p->next;
+    if (pool->head == NULL) {
+        pool->tail = NULL;
+    }
+    if (sent) {
+        pool->workers[i].busy = 1;
+    } else {
+        service_unavailable_response(p->sock);
+        shutdown(p->sock, SHUT_WR);
+    }
+    close(p->sock);
+    free(p);
+    return sent ? 0 : -1;
+}
+
+
+int pool_dispatch(WorkerPool *pool, ClientState *client) {
+    Pending *p = malloc(sizeof(Pending) + request_msg_size(client));
+    p->len = pack_request(client, p->msg);
+
+    // The caller closes its own copy of the socket once this returns.
+    p->sock = dup(client->sock);
+    if (p->sock < 0) {
+        perror("dup");
+        free(p);
+        return -1;
+    }
+    p->attempts = 0;
+    p->next = NULL;
+    if (pool->tail) {
+        pool->tail->next = p;
+    } else {
+        pool->head = p;
+    }
+    pool->tail = p;
+
+    for (int i = 0; i < pool->num_workers && pool->head; i++) {
+        if (!pool->workers[i].busy) {
+            dispatch_pending(pool, i);
+        }
+    }
+    return 0;
+}
+
+
+int pool_worker_done(WorkerPool *pool, int i, ClientState *returned) {
+    Worker *w = &pool->workers[i];
+    if (w->restarting) {
+        // The replacement has started: from now on, only wait for it to
+        // hand back connections.
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = WORKER_TOKEN(i);
+        epoll_ctl(pool->epfd, EPOLL_CTL_MOD, w->chan, &ev);
+        w->restarting = 0;
+        w->busy = 0;
+        dispatch_pending(pool, i);
+        return 0;
+    }
+
+    int sock;
+    int len = recv_with_fd(w->chan, pool->msg, max_msg_size(), &sock);
+    if (len > 0) {
+        w->busy = 0;
+        dispatch_pending(pool, i);
+        unpack_connection(pool->msg, returned);
+        returned->sock = sock;
+        return 1;
+    } else if (len < 0 && errno == EINTR) {
+        return 0;
+    }
+
+    // The channel was closed: the worker died. Its connection (if any)
+    // went with it. Nothing is sent to the slot until the main thread has
+    // started a replacement.
+    fprintf(stderr, "Worker [%d] exited; restarting it\n", w->pid);
+    epoll_ctl(pool->epfd, EPOLL_CTL_DEL, w->chan, NULL);
+    close(w->chan);
+    w->busy = w->restarting = 1;
+    __atomic_store_n(&w->dead, 1, __ATOMIC_RELEASE);
+    kill(getpid(), SIGUSR2);
+    return 0;
+}
+
+
+void pool_restart_workers(WorkerPool *pool) {
+    for (int i = 0; i < pool->num_workers; i++) {
+        if (__atomic_load_n(&pool->workers[i].dead, __ATOMIC_ACQUIRE)) {
+            pool->workers[i].dead = 0;
+            // A new channel is writable at once, which tells the loop.
+            spawn_worker(pool, i, EPOLLIN | EPOLLOUT);
+        }
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef WORKER_H_
+#define WORKER_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "request.h"
+
+// epoll tokens for worker channels. Client sockets use their fd as the
+// token, so worker tokens live above the range of valid fds.
+#define WORKER_TOKEN_BASE ((uint64_t)1 << 32)
+#define WORKER_TOKEN(i) (WORKER_TOKEN_BASE + (uint64_t)(i))
+#define IS_WORKER_TOKEN(t) ((t) >= WORKER_TOKEN_BASE)
+#define WORKER_INDEX(t) ((int)((t) - WORKER_TOKEN_BASE))
+
+
+// A long-lived worker process and the listener's end of its channel.
+typedef struct {
+    pid_t pid;
+    int chan;            // Unix seqpacket socket shared with the worker.
+    int busy;            // 1 while the worker is serving a connection,
+                         // and from its death until its replacement
+                         // has started.
+    int restarting;      // 1 until the replacement's channel is first
+                         // reported writable.
+    int dead;            // Set (atomically) by the loop when the worker
+                         // dies, cleared by pool_restart_workers.
+} Worker;
+
+// A connection waiting for an idle worker.
+typedef struct pending {
+    int sock;
+    int len;
+    int attempts;        // Workers that failed to take it so far.
+    struct pending *next;
+    char msg[];          // The serialized request, len bytes.
+} Pending;
+
+typedef struct {
+    Worker *workers;
+    int num_workers;
+    int epfd;                        // Listener epoll instance.
+    void (*serve)(ClientState *);    // Request handler run by workers.
+    Pending *head, *tail;            // FIFO of connections to dispatch.
+    char *msg;                       // Receives returned connections.
+} WorkerPool;
+
+
+/*
+ * Fork num_workers worker processes that run serve() for every connection
+ * handed to them. Their channels are registered with epfd using
+ * WORKER_TOKEN(i).
+ */
+WorkerPool *start_worker_pool(int num_workers, int epfd,
+                              void (*serve)(ClientState *));
+
+/*
+ * Hand the client's socket and its parsed request to an idle worker, or
+ * queue it until one becomes idle. The caller keeps ownership of its own
+ * copy of client->sock and should close it afterwards.
+ * Return -1 if the request could not be handed over.
+ */
+int pool_dispatch(WorkerPool *pool, ClientState *client);
+
+/*
+ * Handle an event on a channel: the worker at index i has either finished
+ * a request and can take the next pending one, or died, or (after dying)
+ * been replaced. A dead worker is marked for pool_restart_workers, and
+ * SIGUSR2 is raised so the thread that calls it knows.
+ * If the worker handed back its connection, store it in returned and
+ * return 1; the caller owns returned->sock, and returned->buf (its
+ * buffered bytes) is only valid until the next call.
+ */
+int pool_worker_done(WorkerPool *pool, int i, ClientState *returned);
+
+/*
+ * Start a replacement for every worker of the pool that has died. This
+ * runs in the main thread rather than in the loop that owns the pool;
+ * the loop picks up a replacement once its channel is reported writable.
+ */
+void pool_restart_workers(WorkerPool *pool);
+
+#endif /* WORKER_H_ */